@@ -0,0 +1,188 @@
+/*
+ * Reading a -f file list into the playlist's PathArena, the way it was
+ * done before appendList() and the way readList() does it now: fgets()
+ * into a 4096 byte buffer and a lock per path, against mmap() and
+ * memchr() with a lock per 4096 paths, and 1MB read()s from a pipe.
+ * The list is written to a temporary file and read once beforehand, so
+ * all three run from the page cache.
+ *
+ *   bench/filelist [lines]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "src/thread.h"
+#include "src/patharena.h"
+
+/* as in ImageManager::appendList() and main.cpp */
+#define APPEND_BATCH 4096
+#define LIST_CHUNK   (1 << 20)
+
+/* ImageManager's m_paths and m_pending, and the lock guarding them */
+struct Playlist {
+	PathArena             paths;
+	std::vector<uint32_t> pending;
+	Mutex                 lock;
+};
+
+/* ImageManager::append(), a path at a time */
+static void append(Playlist &pl, const char *path)
+{
+	uint32_t id;
+
+	pl.lock.lock();
+	id = pl.paths.add(path);
+	if (id != PathArena::None)
+		pl.pending.push_back(id);
+	pl.lock.unlock();
+}
+
+/* ImageManager::appendList() */
+static void appendList(Playlist &pl, const char *list, size_t len)
+{
+	const char *end = list + len;
+	const char *p = list;
+
+	while (p < end) {
+		pl.lock.lock();
+		for (int i = 0; i < APPEND_BATCH && p < end; ++i) {
+			const char *eol = (const char *)memchr(p, '\n', end - p);
+			uint32_t id;
+
+			if (eol == NULL)
+				eol = end;
+			if (eol == p) {
+				p++;
+				continue;
+			}
+			id = pl.paths.add(p, eol - p);
+			if (id != PathArena::None)
+				pl.pending.push_back(id);
+			p = eol + 1;
+		}
+		pl.lock.unlock();
+	}
+}
+
+static void readFgets(Playlist &pl, const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char line[4096];
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		size_t len = strlen(line);
+
+		if (len > 0 && line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (line[0] != '\0')
+			append(pl, line);
+	}
+	fclose(fp);
+}
+
+static void readMapped(Playlist &pl, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	void *map;
+
+	fstat(fd, &st);
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	appendList(pl, (const char *)map, st.st_size);
+	munmap(map, st.st_size);
+	close(fd);
+}
+
+/* readList()'s loop for pipes, minus dropping overlong lines */
+static void readPipe(Playlist &pl, const char *path)
+{
+	char cmd[4200];
+	char *buf = (char *)malloc(LIST_CHUNK);
+	size_t len = 0;
+	ssize_t n;
+	FILE *fp;
+
+	snprintf(cmd, sizeof(cmd), "cat '%s'", path);
+	fp = popen(cmd, "r");
+	while ((n = read(fileno(fp), buf + len, LIST_CHUNK - len)) > 0) {
+		const char *eol;
+
+		len += n;
+		eol = (const char *)memrchr(buf, '\n', len);
+		if (eol == NULL)
+			continue;
+		appendList(pl, buf, eol + 1 - buf);
+		len -= eol + 1 - buf;
+		memmove(buf, eol + 1, len);
+	}
+	if (len > 0)
+		appendList(pl, buf, len);
+	pclose(fp);
+	free(buf);
+}
+
+static void run(const char *name, void (*reader)(Playlist &, const char *),
+		const char *path, int lines)
+{
+	Playlist *pl = new Playlist;
+	Timestamp t;
+
+	t = Time::monotonicMS();
+	reader(*pl, path);
+	t = Time::monotonicMS() - t;
+	printf("%-18s %6llu ms", name, t);
+	if ((int)pl->pending.size() != lines)
+		printf("  (%d paths, not %d)", (int)pl->pending.size(), lines);
+	printf("\n");
+	delete pl;
+}
+
+int main(int argc, char **argv)
+{
+	int lines = argc > 1 ? atoi(argv[1]) : 5000000;
+	const char *tmp = getenv("TMPDIR");
+	char path[4096];
+	size_t size = 0;
+	FILE *fp;
+	char *buf;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/imager-filelist-XXXXXX", tmp != NULL ? tmp : "/tmp");
+	fd = mkstemp(path);
+	if (fd == -1) {
+		perror(path);
+		return 1;
+	}
+	fp = fdopen(fd, "w");
+	for (int i = 0; i < lines; ++i) {
+		uint32_t dir = i / 250;
+
+		size += fprintf(fp, "/home/user/photos/%u/%02u-event %u/IMG_%04u.JPG\n",
+				2000 + dir / 40 % 25, dir % 12 + 1, dir, i % 250 * 7 % 10000);
+	}
+	fclose(fp);
+
+	/* into the page cache */
+	buf = (char *)malloc(LIST_CHUNK);
+	fd = open(path, O_RDONLY);
+	while (read(fd, buf, LIST_CHUNK) > 0);
+	close(fd);
+	free(buf);
+	printf("%d lines, %zu MB\n", lines, size >> 20);
+
+	run("fgets + append", readFgets, path, lines);
+	run("mmap + appendList", readMapped, path, lines);
+	run("pipe + appendList", readPipe, path, lines);
+
+	unlink(path);
+
+	return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * The playlist's paths as they used to be kept, an array of String
+ * pointers each owning a strdup'd path, against PathArena: heap bytes
+ * per entry, and a full strverscmp() sort of the shuffled list, with
+ * qsort() over the Strings and std::sort() over arena ids.
+ *
+ *   bench/patharena [entries]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <algorithm>
+
+#include "src/thread.h"
+#include "src/patharena.h"
+
+/* ImageManager::String, as it was */
+class String {
+public:
+	String(const char *str)
+	 : m_text(strdup(str))
+	{ }
+	~String()
+	{
+		free(m_text);
+	}
+	const char *getText(void) const
+	{
+		return m_text;
+	}
+
+private:
+	char *m_text;
+};
+
+static int xstrverscmp(const void *p1, const void *p2)
+{
+	return strverscmp((*(String **)p1)->getText(), (*(String **)p2)->getText());
+}
+
+struct ArenaOrder {
+	ArenaOrder(const PathArena &paths)
+	 : paths(paths)
+	{ }
+
+	bool operator()(uint32_t a, uint32_t b) const
+	{
+		return paths.compare(a, b) < 0;
+	}
+
+	const PathArena &paths;
+};
+
+/* a photo collection: /home/user/photos/<year>/<event>/IMG_<n>.JPG */
+static void makePath(char *buf, int len, uint32_t i)
+{
+	static const char *events[] = { "holiday", "birthday", "garden", "misc", "trip to the coast" };
+	uint32_t dir = i / 250;
+
+	snprintf(buf, len, "/home/user/photos/%u/%02u-%s %u/IMG_%04u.JPG",
+			2000 + dir / 40 % 25, dir % 12 + 1, events[dir % 5], dir, i % 250 * 7 % 10000);
+}
+
+/* large blocks are mmap'd by malloc, and count too */
+static size_t heapUsed(void)
+{
+	struct mallinfo2 mi = mallinfo2();
+
+	return mi.uordblks + mi.hblkhd;
+}
+
+int main(int argc, char **argv)
+{
+	int n = argc > 1 ? atoi(argv[1]) : 1000000;
+	uint32_t *shuffle = new uint32_t[n];
+	uint32_t *ids = new uint32_t[n];
+	String **strings;
+	size_t chars = 0, heap;
+	char path[256];
+	Timestamp t;
+
+	for (int i = 0; i < n; ++i)
+		shuffle[i] = i;
+	srand(1);
+	for (int i = n - 1; i > 0; --i)
+		std::swap(shuffle[i], shuffle[rand() % (i + 1)]);
+	for (int i = 0; i < n; ++i) {
+		makePath(path, sizeof(path), i);
+		chars += strlen(path) + 1;
+	}
+	printf("%d paths, %.1f bytes each with the NUL\n", n, (double)chars / n);
+
+	heap = heapUsed();
+	strings = new String*[n];
+	for (int i = 0; i < n; ++i) {
+		makePath(path, sizeof(path), shuffle[i]);
+		strings[i] = new String(path);
+	}
+	printf("String*    %6.1f bytes/entry of heap, %d allocations\n",
+			(double)(heapUsed() - heap) / n, 2 * n + 1);
+
+	{
+		PathArena paths;
+
+		heap = heapUsed();
+		for (int i = 0; i < n; ++i) {
+			makePath(path, sizeof(path), shuffle[i]);
+			ids[i] = paths.add(path);
+		}
+		printf("PathArena  %6.1f bytes/entry used + 4 of playlist, %.1f of heap\n",
+				(double)paths.memoryUsage() / n, (double)(heapUsed() - heap) / n + 4);
+
+		t = Time::monotonicMS();
+		qsort(strings, n, sizeof(strings[0]), xstrverscmp);
+		printf("String*    sort %6llu ms\n", Time::monotonicMS() - t);
+
+		t = Time::monotonicMS();
+		std::sort(ids, ids + n, ArenaOrder(paths));
+		printf("PathArena  sort %6llu ms\n", Time::monotonicMS() - t);
+
+		for (int i = 0; i < n; ++i) {
+			paths.path(ids[i], path, sizeof(path));
+			if (strcmp(path, strings[i]->getText())) {
+				printf("orders differ at %d\n", i);
+				break;
+			}
+		}
+	}
+
+	for (int i = 0; i < n; ++i)
+		delete strings[i];
+	delete[] strings;
+	delete[] ids;
+	delete[] shuffle;
+
+	return 0;
+}
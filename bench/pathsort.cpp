@@ -0,0 +1,101 @@
+/*
+ * PathSorter against std::sort() with PathArena::compare(), which the
+ * sorts used before it, on shuffled photo collection paths: a first
+ * sort, one with the name keys cached, and one after appending a tenth
+ * more.  The orders are checked against each other.
+ *
+ *   bench/pathsort [entries]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "src/thread.h"
+#include "src/patharena.h"
+#include "src/pathsort.h"
+
+struct ArenaOrder {
+	ArenaOrder(const PathArena &paths)
+	 : paths(paths)
+	{ }
+
+	bool operator()(uint32_t a, uint32_t b) const
+	{
+		return paths.compare(a, b) < 0;
+	}
+
+	const PathArena &paths;
+};
+
+/* /home/user/photos/<year>/<event>/IMG_<n>.JPG, with the odd subdirectory */
+static void makePath(char *buf, int len, uint32_t i)
+{
+	static const char *events[] = { "holiday", "birthday", "garden", "misc", "trip to the coast" };
+	uint32_t dir = i / 250;
+
+	if (i % 250 >= 240)
+		snprintf(buf, len, "/home/user/photos/%u/%02u-%s %u/edited/IMG_%04u-1.JPG",
+				2000 + dir / 40 % 25, dir % 12 + 1, events[dir % 5], dir, i % 250);
+	else
+		snprintf(buf, len, "/home/user/photos/%u/%02u-%s %u/IMG_%04u.JPG",
+				2000 + dir / 40 % 25, dir % 12 + 1, events[dir % 5], dir,
+				i % 250 * 7 % 10000);
+}
+
+static void shuffle(std::vector<uint32_t> &ids)
+{
+	for (size_t i = ids.size() - 1; i > 0; --i)
+		std::swap(ids[i], ids[rand() % (i + 1)]);
+}
+
+int main(int argc, char **argv)
+{
+	int n = argc > 1 ? atoi(argv[1]) : 1000000;
+	std::vector<uint32_t> order, ids;
+	PathArena paths;
+	PathSorter sorter(paths);
+	char path[256];
+	Timestamp t;
+
+	srand(1);
+	for (int i = 0; i < n; ++i) {
+		makePath(path, sizeof(path), i);
+		ids.push_back(paths.add(path));
+	}
+	shuffle(ids);
+	printf("%d paths, %d cpus\n", n, ThreadPool::cpuCount());
+
+	order = ids;
+	t = Time::monotonicMS();
+	std::sort(order.begin(), order.end(), ArenaOrder(paths));
+	printf("compare()        %6llu ms\n", Time::monotonicMS() - t);
+
+	t = Time::monotonicMS();
+	sorter.sort(&ids[0], ids.size());
+	printf("PathSorter       %6llu ms\n", Time::monotonicMS() - t);
+	if (ids != order)
+		printf("orders differ\n");
+
+	shuffle(ids);
+	t = Time::monotonicMS();
+	sorter.sort(&ids[0], ids.size());
+	printf("  keys cached    %6llu ms\n", Time::monotonicMS() - t);
+
+	for (int i = n; i < n + n / 10; ++i) {
+		makePath(path, sizeof(path), i);
+		ids.push_back(paths.add(path));
+	}
+	shuffle(ids);
+	order = ids;
+	t = Time::monotonicMS();
+	sorter.sort(&ids[0], ids.size());
+	printf("  after appends  %6llu ms\n", Time::monotonicMS() - t);
+	std::sort(order.begin(), order.end(), ArenaOrder(paths));
+	if (ids != order)
+		printf("orders differ after appends\n");
+
+	return 0;
+}
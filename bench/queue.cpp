@@ -0,0 +1,162 @@
+/*
+ * Contention on the queues: producers push and consumers pop a fixed
+ * number of items through the WaitQ that used to sit on Queue (a list
+ * node and a semaphore post per push), the ring based WaitQ, and
+ * RingQueue.
+ *
+ *   bench/queue [items] [max threads a side]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "src/thread.h"
+
+/* WaitQ as it was: a Queue of heap allocated items, counted by semaphores */
+template <typename _T>
+class ListWaitQ {
+public:
+	class Item : public Queue::Item {
+	public:
+		Item(_T p)
+		 : data(p) { }
+		_T data;
+	};
+
+	ListWaitQ(int max)
+	 : sem(0), empty(max)
+	{ }
+
+	void pushBack(_T item)
+	{
+		empty.wait();
+		queue.pushBack(new Item(item));
+		sem.post();
+	}
+
+	_T popFront(void)
+	{
+		Item *qi;
+		_T ret;
+
+		sem.wait();
+		qi = static_cast<Item *>(queue.popFront());
+		ret = qi->data;
+		delete qi;
+		empty.post();
+
+		return ret;
+	}
+
+private:
+	Queue queue;
+	Semaphore sem;
+	Semaphore empty;
+};
+
+template <typename _Q>
+struct Run {
+	_Q   *queue;
+	long  items;       /* per producer */
+	long  sum;         /* per consumer */
+	int   consumers;
+};
+
+template <typename _Q>
+static void producer(void *data)
+{
+	Run<_Q> *r = (Run<_Q> *)data;
+
+	for (long i = 1; i <= r->items; ++i)
+		r->queue->pushBack(i);
+}
+
+template <typename _Q>
+static void consumer(void *data)
+{
+	Run<_Q> *r = (Run<_Q> *)data;
+	long v;
+
+	while ((v = r->queue->popFront()) != 0)
+		r->sum += v;
+}
+
+/* RingQueue has no pushBack()/popFront() of its own */
+class Ring {
+public:
+	Ring(int max)
+	 : m_ring(max)
+	{ }
+
+	void pushBack(long item)
+	{
+		m_ring.push(item);
+	}
+
+	long popFront(void)
+	{
+		long item;
+
+		m_ring.pop(item);
+		return item;
+	}
+
+private:
+	RingQueue<long> m_ring;
+};
+
+template <typename _Q>
+static void bench(const char *name, long total, int np, int nc)
+{
+	_Q queue(1024);
+	Run<_Q> prod, *cons = new Run<_Q>[nc];
+	Thread **threads = new Thread*[np + nc];
+	long sum = 0;
+	Timestamp t;
+
+	prod.queue = &queue;
+	prod.items = total / np;
+	for (int i = 0; i < nc; ++i) {
+		cons[i].queue = &queue;
+		cons[i].sum = 0;
+	}
+
+	t = Time::monotonicMS();
+	for (int i = 0; i < nc; ++i)
+		threads[i] = new Thread(consumer<_Q>, &cons[i]);
+	for (int i = 0; i < np; ++i)
+		threads[nc + i] = new Thread(producer<_Q>, &prod);
+	for (int i = 0; i < np; ++i)
+		threads[nc + i]->join();
+	/* one stop per consumer, once everything else is through */
+	for (int i = 0; i < nc; ++i)
+		queue.pushBack(0);
+	for (int i = 0; i < nc; ++i)
+		threads[i]->join();
+	t = Time::monotonicMS() - t;
+
+	for (int i = 0; i < nc; ++i)
+		sum += cons[i].sum;
+	if (sum != np * (prod.items * (prod.items + 1) / 2))
+		printf("%s: lost items\n", name);
+	printf("%-10s %dp/%dc  %6llu ms  %6.0f ns/item\n", name, np, nc, t,
+			t * 1e6 / (prod.items * np));
+
+	for (int i = 0; i < np + nc; ++i)
+		delete threads[i];
+	delete[] threads;
+	delete[] cons;
+}
+
+int main(int argc, char **argv)
+{
+	long items = argc > 1 ? atol(argv[1]) : 1000000;
+	int maxt = argc > 2 ? atoi(argv[2]) : 4;
+
+	for (int n = 1; n <= maxt; n *= 2) {
+		bench< ListWaitQ<long> >("list WaitQ", items, n, n);
+		bench< WaitQ<long> >("WaitQ", items, n, n);
+		bench<Ring>("RingQueue", items, n, n);
+	}
+
+	return 0;
+}
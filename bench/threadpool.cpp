@@ -0,0 +1,196 @@
+/*
+ * ThreadPool against the single loader thread it replaced: the same
+ * decode sized jobs run one after another on a thread fed through a
+ * WaitQ, then on pools of 1..N workers.  Also times the bare cost of a
+ * task, submitted and waited on, and of nested fork/join.
+ *
+ *   bench/threadpool [jobs] [max workers]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "src/thread.h"
+
+#define WIDTH  1024
+#define HEIGHT 768
+
+/* a 2x box downscale of a 1024x768 RGBA image, about what scaling costs */
+static void work(const uint8_t *src, uint8_t *dst)
+{
+	for (int y = 0; y < HEIGHT / 2; ++y) {
+		const uint8_t *a = src + (size_t)y * 2 * WIDTH * 4;
+		const uint8_t *b = a + WIDTH * 4;
+		uint8_t *d = dst + (size_t)y * WIDTH / 2 * 4;
+
+		for (int x = 0; x < WIDTH / 2; ++x) {
+			for (int c = 0; c < 4; ++c)
+				d[c] = (a[c] + a[c + 4] + b[c] + b[c + 4] + 2) >> 2;
+			a += 8;
+			b += 8;
+			d += 4;
+		}
+	}
+}
+
+class Job : public Task {
+public:
+	Job(const uint8_t *src, uint8_t *dst)
+	 : m_src(src), m_dst(dst)
+	{ }
+
+	void run(void)
+	{
+		if (m_src != NULL)
+			work(m_src, m_dst);
+	}
+
+private:
+	const uint8_t *m_src;
+	uint8_t       *m_dst;
+};
+
+/* nested fork/join: each level forks two children and waits on them */
+class Split : public Task {
+public:
+	Split(ThreadPool *pool, int depth)
+	 : m_pool(pool), m_depth(depth)
+	{ }
+
+	void run(void)
+	{
+		if (m_depth == 0)
+			return;
+		Split a(m_pool, m_depth - 1), b(m_pool, m_depth - 1);
+		m_pool->submit(&a);
+		m_pool->submit(&b);
+		a.wait();
+		b.wait();
+	}
+
+private:
+	ThreadPool *m_pool;
+	int         m_depth;
+};
+
+struct Loader {
+	WaitQ<Job *> queue;
+	WaitQ<Job *> done;
+};
+
+/* the old design: one thread popping jobs off a queue */
+static void loaderMain(void *data)
+{
+	Loader *l = (Loader *)data;
+	Job *job;
+
+	while ((job = l->queue.popFront()) != NULL) {
+		job->run();
+		l->done.pushBack(job);
+	}
+}
+
+static uint8_t *source(void)
+{
+	uint8_t *p = (uint8_t *)malloc((size_t)WIDTH * HEIGHT * 4);
+
+	for (size_t i = 0; i < (size_t)WIDTH * HEIGHT * 4; ++i)
+		p[i] = (uint8_t)(i * 2654435761u >> 24);
+
+	return p;
+}
+
+int main(int argc, char **argv)
+{
+	int jobs = argc > 1 ? atoi(argv[1]) : 256;
+	int maxw = argc > 2 ? atoi(argv[2]) : ThreadPool::cpuCount();
+	uint8_t *src = source();
+	uint8_t **dst = new uint8_t*[jobs];
+	Job **list = new Job*[jobs];
+	Timestamp t;
+
+	for (int i = 0; i < jobs; ++i) {
+		dst[i] = (uint8_t *)malloc((size_t)WIDTH * HEIGHT);
+		list[i] = new Job(src, dst[i]);
+		/* fault the pages in, so the first run isn't charged for them */
+		work(src, dst[i]);
+	}
+	printf("%d jobs of %dx%d, %d cpus\n", jobs, WIDTH, HEIGHT, ThreadPool::cpuCount());
+
+	{
+		Loader l;
+		Thread thread(loaderMain, &l);
+
+		t = Time::monotonicMS();
+		for (int i = 0; i < jobs; ++i)
+			l.queue.pushBack(list[i]);
+		for (int i = 0; i < jobs; ++i)
+			l.done.popFront();
+		printf("single thread      %6llu ms\n", Time::monotonicMS() - t);
+		l.queue.pushBack(NULL);
+		thread.join();
+	}
+
+	for (int w = 1; w <= maxw; w *= 2) {
+		ThreadPool pool(w, "bench");
+
+		t = Time::monotonicMS();
+		for (int i = 0; i < jobs; ++i)
+			pool.submit(list[i]);
+		for (int i = 0; i < jobs; ++i)
+			list[i]->wait();
+		printf("pool of %-2d         %6llu ms\n", w, Time::monotonicMS() - t);
+		/* fresh tasks for the next pool */
+		for (int i = 0; i < jobs; ++i) {
+			delete list[i];
+			list[i] = new Job(src, dst[i]);
+		}
+	}
+
+	{
+		ThreadPool pool(maxw, "bench");
+		const int n = 100000;
+		Job empty(NULL, NULL);
+
+		t = Time::monotonicMS();
+		for (int i = 0; i < n; ++i) {
+			Job *job = new Job(NULL, NULL);
+			pool.submit(job);
+			job->wait();
+			delete job;
+		}
+		printf("submit+wait        %6.2f us/task\n",
+				(Time::monotonicMS() - t) * 1000.0 / n);
+
+		Loader l;
+		Thread thread(loaderMain, &l);
+
+		t = Time::monotonicMS();
+		for (int i = 0; i < n; ++i) {
+			l.queue.pushBack(&empty);
+			l.done.popFront();
+		}
+		printf("WaitQ round trip   %6.2f us/job\n",
+				(Time::monotonicMS() - t) * 1000.0 / n);
+		l.queue.pushBack(NULL);
+		thread.join();
+
+		Split root(&pool, 14);
+		t = Time::monotonicMS();
+		pool.submit(&root);
+		root.wait();
+		printf("fork/join 2^14     %6.2f us/task\n",
+				(Time::monotonicMS() - t) * 1000.0 / (2 << 14));
+	}
+
+	for (int i = 0; i < jobs; ++i) {
+		delete list[i];
+		free(dst[i]);
+	}
+	delete[] list;
+	delete[] dst;
+	free(src);
+
+	return 0;
+}
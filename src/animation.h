@@ -55,6 +55,18 @@ public:
 		m_animations.remove(anim);
 	}
 
+	/* true while any animation still has frames to show */
+	bool active(void) const
+	{
+		std::list<Animation *>::const_iterator it = m_animations.begin();
+
+		for (; it != m_animations.end(); ++it) {
+			if (!(*it)->finished())
+				return true;
+		}
+		return false;
+	}
+
 	void step(void)
 	{
 		std::list<Animation *>::iterator it = m_animations.begin();
@@ -0,0 +1,101 @@
+#include <algorithm>
+
+#include "batchreader.h"
+
+class BatchReader::Job : public Task {
+public:
+	Job(BatchReader *reader)
+	 : m_reader(reader)
+	{ }
+
+	void run(void)
+	{
+		m_reader->run();
+	}
+
+private:
+	BatchReader *m_reader;
+};
+
+BatchReader::BatchReader(int batch)
+ : m_batch(batch), m_next(0), m_running(0), m_quit(false)
+{ }
+
+BatchReader::~BatchReader()
+{
+	stop();
+}
+
+void BatchReader::stop(void)
+{
+	unsigned int key;
+	int running;
+
+	m_lock.lock();
+	m_quit = true;
+	m_lock.unlock();
+	for (;;) {
+		key = m_idle.prepare();
+		m_lock.lock();
+		running = m_running;
+		m_lock.unlock();
+		if (running == 0)
+			break;
+		m_idle.wait(key);
+	}
+}
+
+void BatchReader::drained(void)
+{ }
+
+void BatchReader::queue(const uint32_t *ids, int count)
+{
+	int limit, spawn;
+
+	if (count == 0)
+		return;
+
+	m_lock.lock();
+	m_queue.insert(m_queue.end(), ids, ids + count);
+
+	/* leave room on the pool for loading what is shown meanwhile */
+	limit = std::max(1, ThreadPool::shared().size() / 2);
+	spawn = std::min(limit - m_running,
+			(int)((m_queue.size() - m_next + m_batch - 1) / m_batch));
+	spawn = std::max(0, spawn);
+	m_running += spawn;
+	m_lock.unlock();
+
+	while (spawn-- > 0)
+		ThreadPool::shared().submit(new Job(this), true);
+}
+
+/* a batch from the queue; hands on to a new task while there is more */
+void BatchReader::run(void)
+{
+	std::vector<uint32_t> ids;
+	bool more;
+
+	m_lock.lock();
+	while ((int)ids.size() < m_batch && m_next < m_queue.size() && !m_quit)
+		ids.push_back(m_queue[m_next++]);
+	m_lock.unlock();
+
+	if (!ids.empty())
+		read(&ids[0], ids.size());
+
+	m_lock.lock();
+	more = m_next < m_queue.size() && !m_quit;
+	if (!more && --m_running == 0) {
+		m_queue.clear();
+		m_next = 0;
+		/* still under m_lock, so that stop() can't return meanwhile */
+		if (!m_quit)
+			drained();
+		m_idle.notifyAll();
+	}
+	m_lock.unlock();
+
+	if (more)
+		ThreadPool::shared().submit(new Job(this), true);
+}
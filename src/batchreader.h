@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "thread.h"
+
+/*
+ * Reads something about ids of a PathArena in the background, for
+ * DateSorter and Deduplicator.  Ids are read in the order they were
+ * queued, a batch per task on the shared pool, and by at most half of
+ * the pool, so loading what is shown never waits behind them for long.
+ * Subclasses call stop() first thing in their destructor.
+ */
+class BatchReader {
+public:
+	BatchReader(int batch);
+	virtual ~BatchReader();
+
+protected:
+	/* reads ids, starting as many tasks as that takes */
+	void queue(const uint32_t *ids, int count);
+	/* waits for reads in progress, and drops what is still queued */
+	void stop(void);
+
+	/* on a pool thread, for up to a batch of ids */
+	virtual void read(const uint32_t *ids, int count) = 0;
+	/* everything queued has been read; must not queue() more */
+	virtual void drained(void);
+
+private:
+	class Job;
+
+	void run(void);
+
+	int           m_batch;
+	Mutex         m_lock;     /* guards everything below */
+	std::vector<uint32_t> m_queue;    /* to be read, from m_next on */
+	size_t        m_next;
+	int           m_running;
+	bool          m_quit;
+	EventCount    m_idle;
+};
@@ -0,0 +1,135 @@
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <utility>
+
+#include "exif.h"
+#include "memorymapper.h"
+#include "datesort.h"
+
+/* files read per task */
+#define DATE_BATCH 64
+/* in m_dates, besides dates; 0 is an image that doesn't have one */
+#define UNKNOWN    (-1)
+#define PENDING    (-2)
+
+DateSorter::DateSorter(const PathArena &paths)
+ : BatchReader(DATE_BATCH), m_paths(paths), m_meta(NULL), m_notify(NULL), m_done(false)
+{ }
+
+DateSorter::~DateSorter()
+{
+	stop();
+}
+
+void DateSorter::setMetaIndex(MetaIndex *meta)
+{
+	m_meta = meta;
+}
+
+void DateSorter::setNotify(EventCount *notify)
+{
+	m_notify = notify;
+}
+
+void DateSorter::request(const uint32_t *ids, int count)
+{
+	std::vector<uint32_t> unread;
+	uint32_t maxid = 0;
+
+	m_lock.lock();
+	for (int i = 0; i < count; ++i)
+		maxid = std::max(maxid, ids[i]);
+	if (count > 0 && m_dates.size() <= maxid)
+		m_dates.resize(maxid + 1, UNKNOWN);
+	for (int i = 0; i < count; ++i) {
+		if (m_dates[ids[i]] == UNKNOWN) {
+			m_dates[ids[i]] = PENDING;
+			unread.push_back(ids[i]);
+		}
+	}
+	m_lock.unlock();
+
+	if (!unread.empty())
+		queue(&unread[0], unread.size());
+}
+
+bool DateSorter::collect(void)
+{
+	bool done;
+
+	m_lock.lock();
+	done = m_done;
+	m_done = false;
+	m_lock.unlock();
+
+	return done;
+}
+
+void DateSorter::sort(uint32_t *ids, int count)
+{
+	std::vector<std::pair<int64_t, uint32_t> > keys(count);
+	std::vector<uint32_t> old(ids, ids + count);
+
+	m_lock.lock();
+	for (int i = 0; i < count; ++i) {
+		int64_t date = ids[i] < m_dates.size() ? m_dates[ids[i]] : UNKNOWN;
+
+		/* with the position, so that ties stay as they were */
+		keys[i] = std::make_pair(date > 0 ? date : INT64_MAX, (uint32_t)i);
+	}
+	m_lock.unlock();
+
+	std::sort(keys.begin(), keys.end());
+	for (int i = 0; i < count; ++i)
+		ids[i] = old[keys[i].second];
+}
+
+void DateSorter::read(const uint32_t *ids, int count)
+{
+	int64_t dates[DATE_BATCH];
+
+	for (int i = 0; i < count; ++i)
+		dates[i] = readDate(ids[i]);
+
+	m_lock.lock();
+	for (int i = 0; i < count; ++i)
+		m_dates[ids[i]] = dates[i];
+	m_lock.unlock();
+}
+
+void DateSorter::drained(void)
+{
+	m_lock.lock();
+	m_done = true;
+	if (m_notify != NULL)
+		m_notify->notify();
+	m_lock.unlock();
+}
+
+int64_t DateSorter::readDate(uint32_t id)
+{
+	char path[PATH_MAX];
+	MemoryMapper::Map *map;
+	struct stat st;
+	int64_t date = 0;
+
+	m_paths.path(id, path, sizeof(path));
+	/* streams would have to be fetched whole */
+	if (!strncmp(path, "http://", 7) || stat(path, &st))
+		return 0;
+	if (m_meta != NULL && m_meta->taken(path, &st, date))
+		return date;
+
+	/* only the pages up to APP1 are ever touched */
+	map = MemoryMapper::map(path);
+	if (map == NULL)
+		return 0;
+	date = exif_date(map->getData(), map->getLength());
+	MemoryMapper::unmap(map);
+	if (m_meta != NULL)
+		m_meta->recordTaken(path, &st, date);
+
+	return date;
+}
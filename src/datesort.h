@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "thread.h"
+#include "batchreader.h"
+#include "patharena.h"
+#include "metaindex.h"
+
+/*
+ * Orders ids of a PathArena by when the images were taken, as EXIF
+ * DateTimeOriginal has it.  Dates are read in the background, and only
+ * as far into each file as its APP1 segment, through the mmap.  The
+ * MetaIndex keeps them, so each file is read once.  Images whose date
+ * isn't known (yet) sort after all the others.
+ */
+class DateSorter : private BatchReader {
+public:
+	DateSorter(const PathArena &paths);
+	/* waits for reads in progress */
+	~DateSorter();
+
+	/* before any request() */
+	void setMetaIndex(MetaIndex *meta);
+	void setNotify(EventCount *notify);
+
+	/* reads the dates of those of ids that weren't asked for before */
+	void request(const uint32_t *ids, int count);
+	/* true, once, when everything requested is known; notify says when */
+	bool collect(void);
+	/* reorders ids by date, keeping the order of those that tie */
+	void sort(uint32_t *ids, int count);
+
+private:
+	void read(const uint32_t *ids, int count);
+	void drained(void);
+	int64_t readDate(uint32_t id);
+
+	const PathArena &m_paths;
+	MetaIndex    *m_meta;
+	EventCount   *m_notify;
+	Mutex         m_lock;     /* guards everything below */
+	std::vector<int64_t>  m_dates;    /* by id */
+	bool          m_done;
+};
@@ -0,0 +1,219 @@
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "xxhash.h"
+#include "memorymapper.h"
+#include "dedup.h"
+
+/* files read per task; each is read whole, so fewer than for dates */
+#define HASH_BATCH 16
+/* in m_hashes, besides hashes, which are nudged past them */
+#define UNKNOWN    0
+#define PENDING    1
+#define UNHASHED   2   /* unreadable, or not a local file */
+#define RESERVED   3
+
+Deduplicator::Deduplicator(const PathArena &paths)
+ : BatchReader(HASH_BATCH), m_paths(paths), m_meta(NULL), m_notify(NULL)
+{ }
+
+Deduplicator::~Deduplicator()
+{
+	stop();
+}
+
+void Deduplicator::setMetaIndex(MetaIndex *meta)
+{
+	m_meta = meta;
+}
+
+void Deduplicator::setNotify(EventCount *notify)
+{
+	m_notify = notify;
+}
+
+void Deduplicator::request(const uint32_t *ids, int count)
+{
+	std::vector<uint32_t> unread;
+	uint32_t maxid = 0;
+
+	m_lock.lock();
+	for (int i = 0; i < count; ++i)
+		maxid = std::max(maxid, ids[i]);
+	if (count > 0 && m_hashes.size() <= maxid)
+		m_hashes.resize(std::max((size_t)maxid + 1, m_hashes.size() * 2), Hash());
+	for (int i = 0; i < count; ++i) {
+		if (m_hashes[ids[i]].value == UNKNOWN) {
+			m_hashes[ids[i]].value = PENDING;
+			unread.push_back(ids[i]);
+		}
+	}
+	m_lock.unlock();
+
+	if (!unread.empty())
+		queue(&unread[0], unread.size());
+}
+
+void Deduplicator::forget(uint32_t id)
+{
+	std::map<Key, uint32_t>::iterator it;
+	std::pair<std::multimap<Key, uint32_t>::iterator,
+		std::multimap<Key, uint32_t>::iterator> range;
+	std::vector<uint32_t> again;
+	Key key;
+
+	m_lock.lock();
+	if (id >= m_hashes.size()) {
+		m_lock.unlock();
+		return;
+	}
+	if (m_hashes[id].value >= RESERVED) {
+		key = Key(m_hashes[id].value, m_hashes[id].size);
+		it = m_originals.find(key);
+		range = m_copyids.equal_range(key);
+		if (it != m_originals.end() && it->second == id) {
+			/* the first of its copies hashed again takes its place */
+			m_originals.erase(it);
+			for (std::multimap<Key, uint32_t>::iterator c = range.first; c != range.second; ++c) {
+				m_hashes[c->second].value = PENDING;
+				m_hashes[c->second].gen++;
+				again.push_back(c->second);
+			}
+			m_copyids.erase(range.first, range.second);
+		} else {
+			for (std::multimap<Key, uint32_t>::iterator c = range.first; c != range.second; ++c) {
+				if (c->second == id) {
+					m_copyids.erase(c);
+					break;
+				}
+			}
+		}
+	}
+	/* a read in progress is dropped when it finishes */
+	m_hashes[id].value = UNKNOWN;
+	m_hashes[id].gen++;
+	m_lock.unlock();
+
+	if (!again.empty())
+		queue(&again[0], again.size());
+}
+
+uint64_t Deduplicator::hash(uint32_t id)
+{
+	uint64_t size;
+	int64_t mtime;
+
+	return hash(id, size, mtime);
+}
+
+uint64_t Deduplicator::hash(uint32_t id, uint64_t &size, int64_t &mtime)
+{
+	Hash hash = Hash();
+
+	m_lock.lock();
+	if (id < m_hashes.size())
+		hash = m_hashes[id];
+	m_lock.unlock();
+
+	size = hash.size;
+	mtime = hash.mtime;
+
+	return hash.value >= RESERVED ? hash.value : 0;
+}
+
+bool Deduplicator::collect(std::vector<uint32_t> &copies, std::vector<uint32_t> &restored)
+{
+	bool found;
+
+	m_lock.lock();
+	found = !m_copies.empty() || !m_restored.empty();
+	copies.insert(copies.end(), m_copies.begin(), m_copies.end());
+	m_copies.clear();
+	restored.insert(restored.end(), m_restored.begin(), m_restored.end());
+	m_restored.clear();
+	m_lock.unlock();
+
+	return found;
+}
+
+void Deduplicator::read(const uint32_t *batch, int count)
+{
+	uint32_t ids[HASH_BATCH], gens[HASH_BATCH];
+	Hash hashes[HASH_BATCH];
+	bool found = false;
+
+	m_lock.lock();
+	for (int i = 0; i < count; ++i) {
+		ids[i] = batch[i];
+		gens[i] = m_hashes[ids[i]].gen;
+	}
+	m_lock.unlock();
+
+	for (int i = 0; i < count; ++i)
+		readHash(ids[i], hashes[i]);
+
+	m_lock.lock();
+	for (int i = 0; i < count; ++i) {
+		std::pair<std::map<Key, uint32_t>::iterator, bool> at;
+		Hash &hash = m_hashes[ids[i]];
+		Key key(hashes[i].value, hashes[i].size);
+
+		/* forgotten meanwhile, if maybe asked for again since */
+		if (hash.value != PENDING || hash.gen != gens[i])
+			continue;
+		hash.value = hashes[i].value;
+		hash.size = hashes[i].size;
+		hash.mtime = hashes[i].mtime;
+		if (hash.value == UNHASHED)
+			continue;
+		at = m_originals.insert(std::make_pair(key, ids[i]));
+		/* batches finish in any order; the lowest id stays the original */
+		if (!at.second && ids[i] < at.first->second)
+			std::swap(ids[i], at.first->second);
+		if (m_hashes[at.first->second].copy) {
+			m_hashes[at.first->second].copy = false;
+			m_restored.push_back(at.first->second);
+			found = true;
+		}
+		if (at.second)
+			continue;
+		m_copyids.insert(std::make_pair(key, ids[i]));
+		m_hashes[ids[i]].copy = true;
+		m_copies.push_back(ids[i]);
+		found = true;
+	}
+	if (found && m_notify != NULL)
+		m_notify->notify();
+	m_lock.unlock();
+}
+
+void Deduplicator::readHash(uint32_t id, Hash &hash)
+{
+	char path[PATH_MAX];
+	MemoryMapper::Map *map;
+	struct stat st;
+
+	hash = Hash();
+	hash.value = UNHASHED;
+	m_paths.path(id, path, sizeof(path));
+	/* streams would have to be fetched whole */
+	if (!strncmp(path, "http://", 7) || stat(path, &st))
+		return;
+	hash.size = st.st_size;
+	hash.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	if (m_meta == NULL || !m_meta->hash(path, &st, hash.value)) {
+		map = MemoryMapper::map(path);
+		if (map == NULL) {
+			hash.value = UNHASHED;
+			return;
+		}
+		hash.value = xxh64(map->getData(), map->getLength(), 0);
+		MemoryMapper::unmap(map);
+		if (m_meta != NULL)
+			m_meta->recordHash(path, &st, hash.value);
+	}
+	if (hash.value < RESERVED)
+		hash.value += RESERVED;
+}
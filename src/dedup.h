@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include "thread.h"
+#include "batchreader.h"
+#include "patharena.h"
+#include "metaindex.h"
+
+/*
+ * Finds ids of a PathArena whose files have the same content, by hashing
+ * them whole with xxh64() through the mmap.  Hashing runs in the
+ * background, in the order ids are asked for.  The MetaIndex keeps the
+ * hashes, so each file is only read for it once.  Files count as the
+ * same when both their size and hash match.  Of the ids with the same
+ * content, the lowest is the original and the others are copies.
+ */
+class Deduplicator : private BatchReader {
+public:
+	Deduplicator(const PathArena &paths);
+	/* waits for reads in progress */
+	~Deduplicator();
+
+	/* before any request() */
+	void setMetaIndex(MetaIndex *meta);
+	void setNotify(EventCount *notify);
+
+	/* hashes those of ids that weren't asked for before */
+	void request(const uint32_t *ids, int count);
+	/*
+	 * id changed; it is hashed again once asked for.  When it was an
+	 * original, its copies are hashed again, for one to take its place.
+	 */
+	void forget(uint32_t id);
+	/* the hash of id's content, 0 if it isn't known (yet) */
+	uint64_t hash(uint32_t id);
+	/* the same, with the file's size and mtime (ns) when it was hashed */
+	uint64_t hash(uint32_t id, uint64_t &size, int64_t &mtime);
+	/*
+	 * Appends to copies the ids found to be copies since the last call,
+	 * including originals that a lower id turned up for, and to restored
+	 * former copies that are originals now.  false if there were none;
+	 * notify says when there are.
+	 */
+	bool collect(std::vector<uint32_t> &copies, std::vector<uint32_t> &restored);
+
+private:
+	struct Hash {
+		uint64_t value;
+		uint64_t size;
+		int64_t  mtime;
+		uint32_t gen;     /* bumped by forget(), to drop reads in progress */
+		bool     copy;    /* was collected as a copy */
+	};
+	/* what makes files the same */
+	typedef std::pair<uint64_t, uint64_t> Key;   /* hash, size */
+
+	void read(const uint32_t *ids, int count);
+	void readHash(uint32_t id, Hash &hash);
+
+	const PathArena &m_paths;
+	MetaIndex    *m_meta;
+	EventCount   *m_notify;
+	Mutex         m_lock;     /* guards everything below */
+	std::vector<Hash> m_hashes;       /* by id */
+	std::map<Key, uint32_t> m_originals;
+	std::multimap<Key, uint32_t> m_copyids;   /* of the originals */
+	std::vector<uint32_t> m_copies;   /* for collect() */
+	std::vector<uint32_t> m_restored; /* for collect() */
+};
@@ -0,0 +1,475 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include "dirscanner.h"
+
+/* walks are I/O bound; on network filesystems, more requests in flight help */
+#define SCAN_THREADS   8
+#define DENTS_BUF_SIZE 32768
+/* commit at least this often while scanning, as well as whenever the playlist grows by half */
+#define COMMIT_MS      250
+#define WATCH_MASK     (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | \
+			IN_MOVED_TO | IN_ONLYDIR)
+
+struct linux_dirent64 {
+	uint64_t       d_ino;
+	int64_t        d_off;
+	unsigned short d_reclen;
+	unsigned char  d_type;
+	char           d_name[];
+};
+
+class DirScanner::Walk : public Task {
+public:
+	Walk(DirScanner *scanner, const char *path, bool root)
+	 : m_scanner(scanner), m_path(strdup(path)), m_root(root)
+	{ }
+
+	~Walk()
+	{
+		free(m_path);
+	}
+
+	void run(void)
+	{
+		m_scanner->walk(m_path, m_root);
+	}
+
+private:
+	DirScanner *m_scanner;
+	char       *m_path;
+	bool        m_root;
+};
+
+/* follows symlinks, like stat(); returns -1 if name can't be stat'ed */
+static int is_dir(int dirfd, const char *name)
+{
+#ifdef STATX_TYPE
+	struct statx stx;
+
+	if (statx(dirfd, name, 0, STATX_TYPE, &stx) == 0)
+		return S_ISDIR(stx.stx_mode);
+	if (errno != ENOSYS)
+		return -1;
+#endif
+	struct stat st;
+
+	if (fstatat(dirfd, name, &st, 0))
+		return -1;
+	return S_ISDIR(st.st_mode);
+}
+
+DirScanner::DirScanner(ImageManager &im)
+ : m_im(im), m_meta(im.metaIndex()), m_inotify(-1), m_outstanding(1), m_found(0), m_committed(0), m_committing(0),
+   m_lastcommit(0), m_finished(false), m_done(false), m_quit(false)
+{
+	m_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	m_pool = new ThreadPool(SCAN_THREADS, "scan");
+}
+
+DirScanner::~DirScanner()
+{
+	unsigned int key;
+
+	__atomic_store_n(&m_quit, true, __ATOMIC_RELEASE);
+	finish();
+	for (;;) {
+		key = m_idle.prepare();
+		if (__atomic_load_n(&m_outstanding, __ATOMIC_ACQUIRE) == 0)
+			break;
+		m_idle.wait(key);
+	}
+	/* the last walk may still be on its way out */
+	delete m_pool;
+	if (m_fd != -1)
+		close(m_fd);
+
+	for (std::map<int, Watch>::iterator it = m_watches.begin(); it != m_watches.end(); ++it)
+		free(it->second.path);
+	if (m_inotify != -1)
+		close(m_inotify);
+}
+
+void DirScanner::add(const char *path)
+{
+	spawn(path, true);
+}
+
+void DirScanner::finish(void)
+{
+	if (m_finished)
+		return;
+	m_finished = true;
+	release();
+}
+
+bool DirScanner::done(void) const
+{
+	return __atomic_load_n(&m_done, __ATOMIC_ACQUIRE);
+}
+
+int DirScanner::fd(void) const
+{
+	return m_fd;
+}
+
+int DirScanner::count(void) const
+{
+	return __atomic_load_n(&m_found, __ATOMIC_RELAXED);
+}
+
+void DirScanner::spawn(const char *path, bool root)
+{
+	__atomic_add_fetch(&m_outstanding, 1, __ATOMIC_ACQ_REL);
+	m_pool->submit(new Walk(this, path, root), true);
+}
+
+void DirScanner::release(void)
+{
+	uint64_t one = 1;
+	bool first;
+
+	if (__atomic_sub_fetch(&m_outstanding, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	commit(true);
+	first = !__atomic_exchange_n(&m_done, true, __ATOMIC_ACQ_REL);
+	if (m_fd != -1)
+		while (write(m_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+	m_idle.notifyAll();
+
+	/* so a crash later doesn't cost the next run a full walk */
+	if (first && m_meta != NULL && !__atomic_load_n(&m_quit, __ATOMIC_ACQUIRE))
+		m_meta->save();
+}
+
+void DirScanner::commit(bool force)
+{
+	int found = __atomic_load_n(&m_found, __ATOMIC_ACQUIRE);
+	int committed = __atomic_load_n(&m_committed, __ATOMIC_RELAXED);
+	Timestamp now = Time::MS();
+	int expected = 0;
+
+	if (found == committed)
+		return;
+	/* the first batch right away, then whenever the playlist grew by half */
+	if (!force && committed != 0 && found - committed < committed / 2 &&
+			now - __atomic_load_n(&m_lastcommit, __ATOMIC_RELAXED) < COMMIT_MS)
+		return;
+	/* walks commit before they are released, so the final one never contends */
+	if (!__atomic_compare_exchange_n(&m_committing, &expected, 1,
+			false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	m_im.commit();
+	__atomic_store_n(&m_committed, found, __ATOMIC_RELAXED);
+	__atomic_store_n(&m_lastcommit, now, __ATOMIC_RELAXED);
+	__atomic_store_n(&m_committing, 0, __ATOMIC_RELEASE);
+}
+
+/* true the first time a directory is seen; symlinks can form loops */
+bool DirScanner::visit(int fd, struct stat *st)
+{
+	bool seen;
+
+	if (fstat(fd, st))
+		return true;
+
+	m_lock.lock();
+	seen = !m_visited.insert(std::make_pair(st->st_dev, st->st_ino)).second;
+	m_lock.unlock();
+
+	return !seen;
+}
+
+int DirScanner::watch(void)
+{
+	if (m_inotify == -1)
+		m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	return m_inotify == -1 ? -1 : 0;
+}
+
+int DirScanner::watchFd(void) const
+{
+	return m_inotify;
+}
+
+void DirScanner::addWatch(const char *path, const struct stat *st)
+{
+	static bool warned;
+	Watch w;
+	int wd;
+
+	wd = inotify_add_watch(m_inotify, path, WATCH_MASK);
+	if (wd == -1) {
+		if (errno == ENOSPC && !__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED))
+			fprintf(stderr, "Out of inotify watches, not all directories are watched "
+					"(see fs.inotify.max_user_watches)\n");
+		return;
+	}
+
+	w.path = strdup(path);
+	w.dev = st->st_dev;
+	w.ino = st->st_ino;
+	m_lock.lock();
+	if (m_watches.count(wd))
+		free(m_watches[wd].path);
+	m_watches[wd] = w;
+	m_lock.unlock();
+}
+
+/* stops watching path and everything below it; it may be walked again */
+void DirScanner::forget(const char *path)
+{
+	int len = strlen(path);
+
+	m_lock.lock();
+	for (std::map<int, Watch>::iterator it = m_watches.begin(); it != m_watches.end(); ) {
+		Watch &w = it->second;
+
+		if (strncmp(w.path, path, len) || (w.path[len] != 0 && w.path[len] != '/')) {
+			++it;
+			continue;
+		}
+		inotify_rm_watch(m_inotify, it->first);
+		m_visited.erase(std::make_pair(w.dev, w.ino));
+		free(w.path);
+		m_watches.erase(it++);
+	}
+	m_lock.unlock();
+}
+
+/* copies the path of watch wd; false if it is gone */
+bool DirScanner::watched(int wd, char *buf, int len)
+{
+	std::map<int, Watch>::iterator it;
+	bool found;
+
+	m_lock.lock();
+	it = m_watches.find(wd);
+	found = it != m_watches.end();
+	if (found)
+		snprintf(buf, len, "%s", it->second.path);
+	m_lock.unlock();
+
+	return found;
+}
+
+void DirScanner::update(void)
+{
+	char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+	std::map<uint32_t, std::pair<char *, bool> > moves;
+	bool changed = false;
+	char name[4096];
+	ssize_t n;
+
+	if (m_inotify == -1)
+		return;
+
+	while ((n = read(m_inotify, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + n; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			bool dir = ev->mask & IN_ISDIR;
+			std::map<uint32_t, std::pair<char *, bool> >::iterator move;
+			struct stat st;
+
+			p += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				fprintf(stderr, "Lost track of watched directories, "
+						"the playlist may be out of date\n");
+				continue;
+			}
+			if (ev->mask & IN_IGNORED) {
+				m_lock.lock();
+				if (m_watches.count(ev->wd)) {
+					free(m_watches[ev->wd].path);
+					m_watches.erase(ev->wd);
+				}
+				m_lock.unlock();
+				continue;
+			}
+			if (ev->len == 0 || !watched(ev->wd, name, sizeof(name)))
+				continue;
+			snprintf(name + strlen(name), sizeof(name) - strlen(name), "/%s", ev->name);
+			changed = true;
+
+			if (ev->mask & IN_CREATE) {
+				/* files are picked up once written; links never are */
+				if (!dir && (lstat(name, &st) || !S_ISLNK(st.st_mode)))
+					continue;
+				if (dir || is_dir(AT_FDCWD, name) > 0)
+					spawn(name, false);
+				else
+					m_im.refreshPath(name);
+			} else if (ev->mask & IN_CLOSE_WRITE) {
+				m_im.refreshPath(name);
+			} else if (ev->mask & IN_DELETE) {
+				m_im.removePath(name, dir);
+				if (dir)
+					forget(name);
+			} else if (ev->mask & IN_MOVED_FROM) {
+				moves[ev->cookie] = std::make_pair(strdup(name), dir);
+			} else if (ev->mask & IN_MOVED_TO) {
+				move = moves.find(ev->cookie);
+				if (move == moves.end()) {
+					if (dir)
+						spawn(name, false);
+					else
+						m_im.refreshPath(name);
+					continue;
+				}
+				if (dir) {
+					/* a directory keeps its inode, but everything in it moved */
+					m_im.removePath(move->second.first, true);
+					forget(move->second.first);
+					spawn(name, false);
+				} else {
+					m_im.renamePath(move->second.first, name);
+				}
+				free(move->second.first);
+				moves.erase(move);
+			}
+		}
+	}
+
+	/* moved out of sight */
+	for (std::map<uint32_t, std::pair<char *, bool> >::iterator it = moves.begin();
+			it != moves.end(); ++it) {
+		m_im.removePath(it->second.first, it->second.second);
+		if (it->second.second)
+			forget(it->second.first);
+		free(it->second.first);
+	}
+
+	if (changed)
+		m_im.commit();
+}
+
+void DirScanner::walk(const char *path, bool root)
+{
+	char buf[DENTS_BUF_SIZE];
+	char name[4096];
+	std::string names, files;
+	struct stat st;
+	bool indexed, complete = true;
+	int index;
+	int found = 0;
+	int fd;
+
+	if (__atomic_load_n(&m_quit, __ATOMIC_ACQUIRE))
+		goto out;
+
+	if (root) {
+		int dir = is_dir(AT_FDCWD, path);
+
+		if (dir < 0) {
+			perror(path);
+			goto out;
+		}
+		if (!dir) {
+			if (m_meta == NULL || !m_meta->rejected(path)) {
+				m_im.append(path);
+				found++;
+			}
+			goto out;
+		}
+	}
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		perror(path);
+		goto out;
+	}
+	if (!visit(fd, &st)) {
+		close(fd);
+		goto out;
+	}
+	/* before reading, so nothing created meanwhile slips through */
+	if (m_inotify != -1)
+		addWatch(path, &st);
+
+	index = snprintf(name, sizeof(name), "%s", path);
+	indexed = m_meta != NULL && m_meta->list(path, &st, names);
+	while (!indexed) {
+		long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+
+		if (n <= 0) {
+			if (n < 0) {
+				perror(path);
+				complete = false;
+			}
+			break;
+		}
+
+		for (long pos = 0; pos < n; ) {
+			struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+			int dir;
+
+			pos += d->d_reclen;
+			if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+				continue;
+
+			switch (d->d_type) {
+			case DT_DIR:
+				dir = 1;
+				break;
+			case DT_UNKNOWN:
+			case DT_LNK:
+				dir = is_dir(fd, d->d_name);
+				if (dir < 0) {
+					snprintf(name + index, sizeof(name) - index, "/%s", d->d_name);
+					perror(name);
+					complete = false;
+					continue;
+				}
+				break;
+			default:
+				dir = 0;
+				break;
+			}
+			names += dir ? 'd' : 'f';
+			names.append(d->d_name, strlen(d->d_name) + 1);
+		}
+
+		if (__atomic_load_n(&m_quit, __ATOMIC_ACQUIRE)) {
+			complete = false;
+			break;
+		}
+	}
+	close(fd);
+	if (!indexed && complete && m_meta != NULL)
+		m_meta->setListing(path, &st, names);
+
+	/* failed loads are left out for as long as the files stay the same */
+	for (size_t pos = 0; pos < names.size(); pos += strlen(&names[pos]) + 1) {
+		char type = names[pos++];
+
+		snprintf(name + index, sizeof(name) - index, "/%s", &names[pos]);
+		if (type == 'd') {
+			spawn(name, false);
+		} else if ((type == 'f' && indexed) || m_meta == NULL || !m_meta->rejected(name)) {
+			files.append(name, strlen(name) + 1);
+			found++;
+		}
+	}
+	m_im.appendList(files.data(), files.size(), 0);
+
+out:
+	if (found != 0) {
+		__atomic_add_fetch(&m_found, found, __ATOMIC_ACQ_REL);
+		commit(false);
+	}
+	release();
+}
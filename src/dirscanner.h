@@ -0,0 +1,78 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <utility>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "thread.h"
+#include "imagemanager.h"
+
+/*
+ * Walks directory trees on its own pool, one task per directory, and
+ * appends the files it finds to an ImageManager as it goes.  Entry
+ * types come from getdents64 where the filesystem reports them; only
+ * the rest are stat'ed, and directories that are unchanged since the
+ * metadata index listed them aren't read at all.  Files that failed to
+ * load before are left out.  Batches are committed early and then at a
+ * rate that keeps republishing the playlist cheap, so the first images
+ * can be shown long before a large tree has been walked.
+ */
+class DirScanner {
+public:
+	DirScanner(ImageManager &im);
+	~DirScanner();
+
+	/* files are added as they are, directories walked recursively */
+	void add(const char *path);
+	/* no more add()s; fd() becomes readable once everything is walked */
+	void finish(void);
+	bool done(void) const;
+	int  fd(void) const;
+	int  count(void) const;
+
+	/*
+	 * Keeps the playlist in step with the walked directories through
+	 * inotify; call before the first add().  Once watchFd() is
+	 * readable, update() applies what changed, without rescanning.
+	 */
+	int  watch(void);
+	int  watchFd(void) const;
+	void update(void);
+
+private:
+	class Walk;
+
+	struct Watch {
+		char  *path;
+		dev_t  dev;
+		ino_t  ino;
+	};
+
+	void walk(const char *path, bool root);
+	void spawn(const char *path, bool root);
+	void release(void);
+	void commit(bool force);
+	bool visit(int fd, struct stat *st);
+	void addWatch(const char *path, const struct stat *st);
+	void forget(const char *path);
+	bool watched(int wd, char *buf, int len);
+
+	ImageManager &m_im;
+	MetaIndex    *m_meta;
+	ThreadPool   *m_pool;
+	Mutex         m_lock;   /* guards m_visited and m_watches */
+	std::set<std::pair<dev_t, ino_t> > m_visited;
+	std::map<int, Watch> m_watches;
+	int           m_inotify;
+	EventCount    m_idle;
+	int           m_fd;
+	int           m_outstanding;
+	int           m_found;
+	int           m_committed;
+	int           m_committing;
+	Timestamp     m_lastcommit;
+	bool          m_finished;
+	bool          m_done;
+	bool          m_quit;
+};
@@ -0,0 +1,159 @@
+#include <string.h>
+
+#include "exif.h"
+
+#define EXIF_ORIENTATION 0x0112
+#define EXIF_IFD         0x8769
+#define EXIF_DATE        0x9003   /* DateTimeOriginal */
+#define TIFF_ASCII       2
+#define TIFF_SHORT       3
+#define TIFF_LONG        4
+
+/* the TIFF structure EXIF data is kept in */
+struct tiff {
+	const unsigned char *base;
+	unsigned int len;
+	int big;
+};
+
+static unsigned int get16(const struct tiff *t, unsigned int off)
+{
+	const unsigned char *p = t->base + off;
+
+	if (off + 2 > t->len)
+		return 0;
+	return t->big ? (p[0] << 8 | p[1]) : (p[1] << 8 | p[0]);
+}
+
+static unsigned int get32(const struct tiff *t, unsigned int off)
+{
+	if (off + 4 > t->len)
+		return ~0u;
+	return t->big ? (get16(t, off) << 16 | get16(t, off + 2)) :
+		(get16(t, off + 2) << 16 | get16(t, off));
+}
+
+/* finds the APP1 segment holding EXIF data, which comes before any image data */
+static int exif_find(const unsigned char *p, int len, struct tiff *t)
+{
+	int pos = 2;
+
+	if (len < 4 || p[0] != 0xff || p[1] != 0xd8)
+		return -1;
+
+	while (pos + 4 <= len) {
+		int marker, seglen;
+
+		if (p[pos] != 0xff)
+			return -1;
+		marker = p[pos + 1];
+		if (marker == 0xff) {
+			pos++;
+			continue;
+		}
+		/* start of scan or end of image */
+		if (marker == 0xda || marker == 0xd9)
+			return -1;
+
+		seglen = p[pos + 2] << 8 | p[pos + 3];
+		if (seglen < 2 || pos + 2 + seglen > len)
+			return -1;
+		if (marker == 0xe1 && seglen >= 16 && !memcmp(p + pos + 4, "Exif\0\0", 6)) {
+			t->base = p + pos + 10;
+			t->len = seglen - 8;
+			if (!memcmp(t->base, "MM\0*", 4))
+				t->big = 1;
+			else if (!memcmp(t->base, "II*\0", 4))
+				t->big = 0;
+			else
+				return -1;
+			return 0;
+		}
+		pos += 2 + seglen;
+	}
+
+	return -1;
+}
+
+/* the offset of tag's entry in the IFD at ifd, or 0 */
+static unsigned int ifd_entry(const struct tiff *t, unsigned int ifd, unsigned int tag)
+{
+	unsigned int n, i;
+
+	if (ifd > t->len || ifd + 2 > t->len)
+		return 0;
+
+	n = get16(t, ifd);
+	for (i = 0; i < n; ++i) {
+		unsigned int entry = ifd + 2 + i * 12;
+
+		if (entry + 12 > t->len)
+			return 0;
+		if (get16(t, entry) == tag)
+			return entry;
+	}
+
+	return 0;
+}
+
+/* a SHORT valued tag in the first IFD, or -1 */
+static int ifd0_short(const struct tiff *t, unsigned int tag)
+{
+	unsigned int entry = ifd_entry(t, get32(t, 4), tag);
+
+	if (entry == 0 || get16(t, entry + 2) != TIFF_SHORT)
+		return -1;
+	return get16(t, entry + 8);
+}
+
+int exif_orientation(const void *data, int len)
+{
+	struct tiff t;
+	int orientation;
+
+	if (exif_find((const unsigned char *)data, len, &t))
+		return 1;
+
+	orientation = ifd0_short(&t, EXIF_ORIENTATION);
+
+	return (orientation >= 1 && orientation <= 8) ? orientation : 1;
+}
+
+int64_t exif_date(const void *data, int len)
+{
+	static const char format[] = "dddd:dd:dd dd:dd:dd";
+	const char *s;
+	unsigned int entry, off;
+	struct tiff t;
+	int64_t date = 0;
+	int i;
+
+	if (exif_find((const unsigned char *)data, len, &t))
+		return 0;
+
+	/* it is kept in the EXIF IFD, which the first one points to */
+	entry = ifd_entry(&t, get32(&t, 4), EXIF_IFD);
+	if (entry == 0 || get16(&t, entry + 2) != TIFF_LONG)
+		return 0;
+	entry = ifd_entry(&t, get32(&t, entry + 8), EXIF_DATE);
+	if (entry == 0 || get16(&t, entry + 2) != TIFF_ASCII || get32(&t, entry + 4) < 19)
+		return 0;
+	off = get32(&t, entry + 8);
+	if (off > t.len || off + 19 > t.len)
+		return 0;
+
+	s = (const char *)t.base + off;
+	for (i = 0; format[i]; ++i) {
+		if (format[i] != 'd') {
+			if (s[i] != format[i])
+				return 0;
+		} else if (s[i] >= '0' && s[i] <= '9') {
+			date = date * 10 + s[i] - '0';
+		} else {
+			/* some cameras leave it blank */
+			return 0;
+		}
+	}
+
+	return date;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the EXIF orientation (1-8) of a JPEG; 1, upright, if it has none */
+int exif_orientation(const void *data, int len);
+/*
+ * When a JPEG was taken (DateTimeOriginal) as the number YYYYMMDDhhmmss,
+ * which orders like the dates do; 0 if it doesn't say.
+ */
+int64_t exif_date(const void *data, int len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -8,11 +8,15 @@ public:
 		enum Type {
 			Next,
 			Prev,
+			First,
+			Last,
 			Quit,
 			HaltToggle,
 			FullscreenToggle,
 			FilterToggle,
 			TextToggle,
+			LoaderStatus,
+			Search,
 		};
 
 		Type type;
@@ -81,6 +85,10 @@ public:
 	void render(void);
 
 	int pollEvent(Event &ev);
+	/* readable when input arrives, -1 if the backend has no such fd */
+	int eventFd(void);
+	/* true if pollEvent() would return something right now */
+	bool eventsPending(void);
 private:
 
 	void renderTexture(const Texture *texture);
@@ -219,6 +219,12 @@ int GRE::pollEvent(GRE::Event &oev)
 		case SDLK_RIGHT:
 			oev.type = GRE::Event::Next;
 			break;
+		case SDLK_HOME:
+			oev.type = GRE::Event::First;
+			break;
+		case SDLK_END:
+			oev.type = GRE::Event::Last;
+			break;
 		case SDLK_RETURN:
 			if (m_keystate[0][3] || m_keystate[1][3])
 				oev.type = GRE::Event::FullscreenToggle;
@@ -231,6 +237,9 @@ int GRE::pollEvent(GRE::Event &oev)
 		case SDLK_h:
 			oev.type = GRE::Event::HaltToggle;
 			break;
+		case SDLK_i:
+			oev.type = GRE::Event::LoaderStatus;
+			break;
 		case SDLK_q:
 			oev.type = GRE::Event::Quit;
 			break;
@@ -293,3 +302,15 @@ int GRE::pollEvent(GRE::Event &oev)
 
 	return 0;
 }
+
+/* SDL has no descriptor to wait on; callers have to poll */
+int GRE::eventFd(void)
+{
+	return -1;
+}
+
+bool GRE::eventsPending(void)
+{
+	SDL_PumpEvents();
+	return SDL_PeepEvents(NULL, 1, SDL_PEEKEVENT, SDL_ALLEVENTS) > 0;
+}
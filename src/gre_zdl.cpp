@@ -661,6 +661,12 @@ int GRE::pollEvent(GRE::Event &oev)
 			case ZDL_KEYSYM_RIGHT:
 				oev.type = GRE::Event::Next;
 				break;
+			case ZDL_KEYSYM_HOME:
+				oev.type = GRE::Event::First;
+				break;
+			case ZDL_KEYSYM_END:
+				oev.type = GRE::Event::Last;
+				break;
 			case ZDL_KEYSYM_RETURN:
 				if (ev.key.modifiers & ZDL_KEYMOD_ALT)
 					oev.type = GRE::Event::FullscreenToggle;
@@ -676,6 +682,9 @@ int GRE::pollEvent(GRE::Event &oev)
 			case ZDL_KEYSYM_H:
 				oev.type = GRE::Event::HaltToggle;
 				break;
+			case ZDL_KEYSYM_I:
+				oev.type = GRE::Event::LoaderStatus;
+				break;
 			case ZDL_KEYSYM_Q:
 				oev.type = GRE::Event::Quit;
 				break;
@@ -718,3 +727,17 @@ int GRE::pollEvent(GRE::Event &oev)
 
 	return 0;
 }
+
+int GRE::eventFd(void)
+{
+	ZDL::Window *m_window = static_cast<ZDL::Window *>(m_priv);
+
+	return m_window->getFd();
+}
+
+bool GRE::eventsPending(void)
+{
+	ZDL::Window *m_window = static_cast<ZDL::Window *>(m_priv);
+
+	return m_window->pending() != 0;
+}
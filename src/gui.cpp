@@ -2,6 +2,11 @@
 #include <stdio.h>
 #include "gui.h"
 
+/* frame interval while something is moving on screen */
+#define FRAME_MS 33
+/* how long loader status and other info stays up */
+#define INFO_MS  2000
+
 class GUIAnimation : public Animation {
 public:
 	GUIAnimation(GUI &gui, GRE::Texture *p[2], Timestamp ms)
@@ -29,6 +34,8 @@ public:
 		m_gui.setDirty();
 	}
 
+	bool finished(void) const { return m_finished; }
+
 private:
 	GUI          &m_gui;
 	bool          m_finished;
@@ -67,14 +74,17 @@ private:
 };
 
 GUI::GUI(const GRE::Dimensions &dims, bool fullscreen)
- : m_gre(dims, fullscreen), m_im(m_gre), m_first(false), m_started(false), m_dirty(true), m_text(false)
+ : m_gre(dims, fullscreen), m_im(m_gre), m_scanner(NULL), m_first(false), m_started(false), m_dirty(true), m_text(false)
 {
 	m_infoshown = false;
 	m_infoupdated = false;
 	m_textupdated = false;
+	m_version = 0;
+	m_lastframe = 0;
 	m_spinning = true;
 	m_textures[0] = NULL;
 	m_textures[1] = NULL;
+	m_preview = 0;
 	m_animation = NULL;
 	m_spinner = NULL;
 	m_infoanim = NULL;
@@ -92,6 +102,8 @@ GUI::GUI(const GRE::Dimensions &dims, bool fullscreen)
 
 GUI::~GUI()
 {
+	delete m_scanner;
+
 	if (m_animation != NULL) {
 		m_anim.remove(m_animation);
 		delete m_animation;
@@ -115,6 +127,7 @@ GUI::~GUI()
 void GUI::setVideoMode(const GRE::Dimensions &dims, bool fullscreen)
 {
 	m_gre.setVideoMode(dims, fullscreen);
+	dropPreview();
 	m_textures[1] = NULL;
 	m_textures[0] = m_im.reload();
 	m_gre.clearTexturePasses();
@@ -136,7 +149,52 @@ void GUI::updateText(void)
 void GUI::addImage(const char *str)
 {
 	m_im.append(str);
-	updateText();
+}
+
+void GUI::addImages(const char *list, size_t len, char separator)
+{
+	m_im.appendList(list, len, separator);
+}
+
+void GUI::scanImages(const char *path)
+{
+	if (m_scanner == NULL)
+		m_scanner = new DirScanner(m_im);
+	m_scanner->add(path);
+}
+
+void GUI::finishScan(void)
+{
+	if (m_scanner != NULL)
+		m_scanner->finish();
+}
+
+bool GUI::scanning(void) const
+{
+	return m_scanner != NULL && !m_scanner->done();
+}
+
+int GUI::scanFd(void) const
+{
+	return m_scanner != NULL ? m_scanner->fd() : -1;
+}
+
+int GUI::watchImages(void)
+{
+	if (m_scanner == NULL)
+		m_scanner = new DirScanner(m_im);
+	return m_scanner->watch();
+}
+
+int GUI::watchFd(void) const
+{
+	return m_scanner != NULL ? m_scanner->watchFd() : -1;
+}
+
+void GUI::updateWatched(void)
+{
+	if (m_scanner != NULL)
+		m_scanner->update();
 }
 
 void GUI::restartAnimation(void)
@@ -146,7 +204,7 @@ void GUI::restartAnimation(void)
 		delete m_animation;
 		m_animation = NULL;
 	}
-	if (m_duration != 0) {
+	if (m_duration != 0 && m_im.hasPrevious()) {
 		m_animation = new GUIAnimation(*this, m_textures, m_duration);
 		m_anim.add(m_animation);
 	} else {
@@ -200,6 +258,14 @@ void GUI::enableFiltering(bool enabled)
 	m_dirty = true;
 }
 
+void GUI::showLoaderStatus(void)
+{
+	char buf[128];
+
+	m_im.loaderStatus(buf, sizeof(buf));
+	debugPrintf("loader: %s", buf);
+}
+
 void GUI::enableSpinner(bool enabled)
 {
 	if (m_spinning == enabled)
@@ -224,34 +290,152 @@ void GUI::start(void)
 
 int GUI::next(void)
 {
-	GRE::Texture *tex = m_im.next();
+	return advance(1);
+}
+
+int GUI::prev(void)
+{
+	return advance(-1);
+}
+
+/* takes a shown preview back off screen, the image underneath is still live */
+void GUI::dropPreview(void)
+{
+	if (m_preview == 0)
+		return;
+
+	if (m_animation != NULL) {
+		m_anim.remove(m_animation);
+		delete m_animation;
+		m_animation = NULL;
+	}
+	m_gre.remTexturePass(m_textures[0]);
+	m_textures[0] = m_textures[1];
+	m_textures[1] = NULL;
+	if (m_textures[0] != NULL)
+		m_textures[0]->setAlpha(1.0);
+	m_preview = 0;
+	m_dirty = true;
+}
+
+int GUI::advance(int dir)
+{
+	GRE::Texture *tex = (dir > 0) ? m_im.next() : m_im.prev();
+
+	if (tex != NULL)
+		return show(tex, false);
+
+	/* show the thumbnail, if there is one, until the image is ready */
+	if (m_preview == dir)
+		return -1;
+	dropPreview();
+	tex = m_im.preview(dir, true);
 	if (tex == NULL)
 		return -1;
+	m_preview = dir;
+
+	return show(tex, true);
+}
+
+/* fades tex in; returns 0 once a real image (not a preview) is up */
+int GUI::show(GRE::Texture *tex, bool preview)
+{
+	if (!preview && m_preview != 0) {
+		/* the manager released the preview; swap the image in place */
+		if (m_animation != NULL) {
+			m_anim.remove(m_animation);
+			delete m_animation;
+			m_animation = NULL;
+		}
+		m_gre.remTexturePass(m_textures[0]);
+		m_gre.remTexturePass(m_textures[1]);
+		m_textures[1] = NULL;
+		m_textures[0] = tex;
+		tex->setAlpha(1.0);
+		m_gre.addTexturePass(m_textures[0]);
+		m_preview = 0;
+		m_dirty = m_first = m_started = true;
+		updateText();
+		return 0;
+	}
+
 	if (m_textures[1] != NULL)
 		m_gre.remTexturePass(m_textures[1]);
 	m_textures[1] = m_textures[0];
 	m_textures[0] = tex;
 	restartAnimation();
 	m_gre.addTexturePass(m_textures[0]);
-	m_dirty = m_first = m_started = true;
+	m_dirty = m_started = true;
+	if (preview)
+		return -1;
+	m_first = true;
 	updateText();
 	return 0;
 }
 
-int GUI::prev(void)
+void GUI::scrub(int steps)
 {
-	GRE::Texture *tex = m_im.prev();
-	if (tex == NULL)
+	scrubTo(m_im.currentImage() - 1 + steps);
+}
+
+void GUI::jump(int index)
+{
+	scrubTo(index);
+}
+
+int GUI::find(const char *text)
+{
+	int index = m_im.find(text);
+
+	if (index < 0)
 		return -1;
+	scrubTo(index);
+
+	return 0;
+}
+
+/*
+ * Moves the cursor without loading anything, showing a thumbnail if one
+ * is on disk.  Images only scrolled past are not decoded, not even small.
+ */
+void GUI::scrubTo(int index)
+{
+	GRE::Texture *tex;
+
+	dropPreview();
+	m_im.scrub(index);
+	updateText();
+
+	tex = m_im.preview(0, false);
+	if (tex == NULL)
+		return;
+
+	/* no fading while scrubbing; the last real image waits underneath */
+	if (m_animation != NULL) {
+		m_anim.remove(m_animation);
+		delete m_animation;
+		m_animation = NULL;
+	}
 	if (m_textures[1] != NULL)
 		m_gre.remTexturePass(m_textures[1]);
 	m_textures[1] = m_textures[0];
+	if (m_textures[1] != NULL)
+		m_textures[1]->setAlpha(1.0);
 	m_textures[0] = tex;
-	restartAnimation();
+	tex->setAlpha(1.0);
 	m_gre.addTexturePass(m_textures[0]);
-	m_dirty = m_first = m_started = true;
-	updateText();
-	return 0;
+	m_preview = 1;
+	m_dirty = m_started = true;
+}
+
+int GUI::settle(void)
+{
+	GRE::Texture *tex = m_im.seek(m_im.currentImage() - 1);
+
+	if (tex == NULL)
+		return -1;
+
+	return show(tex, false);
 }
 
 void GUI::render(void)
@@ -260,9 +444,19 @@ void GUI::render(void)
 		return;
 
 	m_anim.step();
+	if (m_im.playlistVersion() != m_version) {
+		m_version = m_im.playlistVersion();
+		updateText();
+	}
 	if (m_first == false && m_im.getLoadCount() != 0) {
 		GRE::Texture *tex = m_im.reload();
 		if (tex != 0) {
+			if (m_animation != NULL) {
+				m_anim.remove(m_animation);
+				delete m_animation;
+				m_animation = NULL;
+			}
+			m_preview = 0;
 			m_textures[1] = NULL;
 			m_textures[0] = tex;
 			m_gre.clearTexturePasses();
@@ -302,7 +496,7 @@ void GUI::render(void)
 	}
 
 	if (m_infoanim != NULL && m_infoanim->finished()) {
-		if (m_infoshown && Time::MS() - 2000 > m_infoanim->getEnd()) {
+		if (m_infoshown && Time::MS() - INFO_MS > m_infoanim->getEnd()) {
 			m_anim.remove(m_infoanim);
 			delete m_infoanim;
 			m_infoanim = new GUISimpleAnim(*this, m_infotex, false);
@@ -318,19 +512,65 @@ void GUI::render(void)
 	if (m_dirty || m_spinning) {
 		m_gre.render();
 		m_dirty = false;
+		m_lastframe = Time::MS();
 	}
 }
 
+Timestamp GUI::nextFrame(void)
+{
+	if (!m_started)
+		return 0;
+	if (m_dirty || m_textupdated || m_infoupdated)
+		return Time::MS();
+	if (m_spinning || m_anim.active())
+		return m_lastframe + FRAME_MS;
+	/* the info overlay fades out on its own */
+	if (m_infoanim != NULL && m_infoshown)
+		return m_infoanim->getEnd() + INFO_MS + 1;
+
+	return 0;
+}
+
+int GUI::inputFd(void)
+{
+	return m_gre.eventFd();
+}
+
+bool GUI::inputPending(void)
+{
+	return m_gre.eventsPending();
+}
+
+int GUI::loaderFd(void) const
+{
+	return m_im.readyFd();
+}
+
+void GUI::clearLoaderFd(void)
+{
+	m_im.clearReady();
+}
+
 void GUI::setDirty(void)
 {
 	m_dirty = true;
 }
 
+void GUI::setSeed(uint64_t seed)
+{
+	m_im.setSeed(seed);
+}
+
 void GUI::randomSort(void)
 {
 	m_im.randomSort();
 }
 
+void GUI::randomPermutation(void)
+{
+	m_im.randomPermutation();
+}
+
 void GUI::logicalSort(void)
 {
 	m_im.logicalSort();
@@ -341,21 +581,61 @@ void GUI::directorySort(void)
 	m_im.directorySort();
 }
 
+void GUI::dateSort(void)
+{
+	m_im.dateSort();
+}
+
 void GUI::randomOffset(void)
 {
 	m_im.randomOffset();
 }
 
+int GUI::enableSharedCache(unsigned int megabytes)
+{
+	return m_im.enableSharedCache(megabytes);
+}
+
+void GUI::enableThumbnails(bool enabled)
+{
+	m_im.enableThumbnails(enabled);
+}
+
+int GUI::enableIndex(void)
+{
+	return m_im.enableIndex();
+}
+
+void GUI::enableSearch(void)
+{
+	m_im.enableSearch();
+}
+
+void GUI::enableDedup(bool skip)
+{
+	m_im.enableDedup(skip);
+}
+
+void GUI::setDeadline(Timestamp deadline, Timestamp interval)
+{
+	m_im.setDeadline(deadline, interval);
+}
+
 void GUI::setFadeDuration(Timestamp ms)
 {
 	m_duration = ms;
 }
 
-int GUI::imageCount(void) const
+int GUI::imageCount(void)
 {
 	return m_im.imageCount();
 }
 
+void GUI::commitImages(void)
+{
+	m_im.commit();
+}
+
 int GUI::pollEvent(GRE::Event &ev)
 {
 	return m_gre.pollEvent(ev);
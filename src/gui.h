@@ -3,6 +3,7 @@
 #include <stdarg.h>
 #include "gre.h"
 #include "imagemanager.h"
+#include "dirscanner.h"
 #include "animation.h"
 #include "font.h"
 
@@ -13,12 +14,49 @@ public:
 
 	void setVideoMode(const GRE::Dimensions &dims, bool fullscreen);
 	void addImage(const char *str);
+	/* many at once, each ended by separator */
+	void addImages(const char *list, size_t len, char separator);
+	/*
+	 * Like addImage(), but walks directories, in the background.  Images
+	 * are committed as they are found; once finishScan() has been called
+	 * scanFd() becomes readable when all of them are in.
+	 */
+	void scanImages(const char *path);
+	void finishScan(void);
+	bool scanning(void) const;
+	int  scanFd(void) const;
+	/*
+	 * Before scanImages(): keep following the scanned directories.  Call
+	 * updateWatched() when watchFd() is readable.
+	 */
+	int  watchImages(void);
+	int  watchFd(void) const;
+	void updateWatched(void);
 
 	void start(void);
 
 	int  next(void);
 	int  prev(void);
+
+	/*
+	 * Navigation faster than images load: scrub() and jump() move
+	 * straight to the target showing only thumbnails, and settle()
+	 * then loads the image the user stopped at (-1 until it's up).
+	 */
+	void scrub(int steps);
+	void jump(int index);
+	/* jump() to the next image whose name contains text; -1 if none does */
+	int  find(const char *text);
+	int  settle(void);
 	void render(void);
+	/* when render() next has work to do (Time::MS()), 0 if nothing is due */
+	Timestamp nextFrame(void);
+
+	/* for waiting on input and on finished loads */
+	int  inputFd(void);
+	bool inputPending(void);
+	int  loaderFd(void) const;
+	void clearLoaderFd(void);
 
 	void debugVPrintf(const char *fmt, va_list ap);
 	void debugPrintf(const char *fmt, ...);
@@ -26,26 +64,43 @@ public:
 	void enableText(bool enabled);
 	void enableSpinner(bool enabled);
 	void enableFiltering(bool enabled);
+	void showLoaderStatus(void);
 
 	void setFadeDuration(Timestamp ms);
+	void setDeadline(Timestamp deadline, Timestamp interval);
+	void setSeed(uint64_t seed);
 	void randomSort(void);
+	void randomPermutation(void);
 	void logicalSort(void);
 	void directorySort(void);
+	void dateSort(void);
 
 	void randomOffset(void);
+	int  enableSharedCache(unsigned int megabytes);
+	void enableThumbnails(bool enabled);
+	int  enableIndex(void);
+	void enableSearch(void);
+	void enableDedup(bool skip);
 
 	void setDirty(void);
 
-	int imageCount(void) const;
+	int imageCount(void);
+	/* makes images added since the last call visible */
+	void commitImages(void);
 
 	int pollEvent(GRE::Event &ev);
 
 private:
+	int  advance(int dir);
+	int  show(GRE::Texture *tex, bool preview);
+	void scrubTo(int index);
+	void dropPreview(void);
 	void restartAnimation(void);
 	void updateText(void);
 
 	GRE             m_gre;
 	ImageManager    m_im;
+	DirScanner     *m_scanner;
 	Animator        m_anim;
 	Animation      *m_animation;
 	Animation      *m_spinner;
@@ -56,7 +111,9 @@ private:
 	bool            m_spinning;
 	bool            m_text;
 	GRE::Texture   *m_textures[2];
+	int             m_preview;
 	bool            m_textupdated;
+	unsigned int    m_version;
 	GRE::Texture   *m_stringtex;
 	StringDrawable *m_string;
 	bool            m_infoshown;
@@ -65,4 +122,5 @@ private:
 	GRE::Texture   *m_infotex;
 	StringDrawable *m_info;
 	Timestamp       m_duration;
+	Timestamp       m_lastframe;
 };
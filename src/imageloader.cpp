@@ -1,10 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "imageloader.h"
 #include "memorymapper.h"
+#include "thumbnail.h"
 #include "mime.h"
+#include "exif.h"
 
 enum ImageFormat {
   ImageFormat_Invalid = 0,
@@ -18,104 +21,679 @@ extern "C" {
 int LoadPNG(void *pRaw, int rawlen, unsigned int *puWidth, unsigned int *puHeight, void **ppData);
 int LoadTGA(void *pRaw, int rawlen, unsigned int *puWidth, unsigned int *puHeight, void **ppData);
 int LoadJPEG(void *pRaw, int rawlen, unsigned int *puWidth, unsigned int *puHeight, void **ppData);
+int LoadJPEGScaled(void *pRaw, int rawlen, unsigned int uMinDim, unsigned int *puWidth, unsigned int *puHeight, void **ppData);
 }
 
-Image *Image_CreateFromMemory(const void *pMem, ImageFormat fmt, unsigned int len)
+#define MAX_DIMENSION 8192
+
+void *Image_Scale(const void *src, const GRE::Dimensions &from, const GRE::Dimensions &to)
 {
-	unsigned int uWidth, uHeight;
-	void *pData;
+	const unsigned char *pSrc = (const unsigned char *)src;
+	int sw = from.w, sh = from.h;
+	int dw = to.w, dh = to.h;
+	unsigned char *dst = (unsigned char *)malloc((size_t)dw * dh * 4);
 
-	if (pMem == NULL)
+	if (dst == NULL)
 		return NULL;
 
-	switch (fmt) {
-	case ImageFormat_PNG:
-		if (LoadPNG((void *)pMem, len, &uWidth, &uHeight, &pData))
-			return NULL;
-		break;
-	case ImageFormat_JPEG:
-		if (LoadJPEG((void *)pMem, len, &uWidth, &uHeight, &pData))
-			return NULL;
-		break;
-	case ImageFormat_TGA:
-		if (LoadTGA((void *)pMem, len, &uWidth, &uHeight, &pData))
-			return NULL;
-		break;
-	case ImageFormat_Invalid:
-		if (!memcmp(pMem, "\x89PNG", 4))
-			return Image_CreateFromMemory(pMem, ImageFormat_PNG, len);
-		else if (!memcmp(pMem, "\xff\xd8", 2))
-			return Image_CreateFromMemory(pMem, ImageFormat_JPEG, len);
-		else
-			return Image_CreateFromMemory(pMem, ImageFormat_TGA, len);
-		break;
-	default:
+	for (int y = 0; y < dh; ++y) {
+		int y0 = (long long)y * sh / dh;
+		int y1 = (long long)(y + 1) * sh / dh;
+		if (y1 == y0)
+			y1++;
+		for (int x = 0; x < dw; ++x) {
+			int x0 = (long long)x * sw / dw;
+			int x1 = (long long)(x + 1) * sw / dw;
+			unsigned int sum[4] = { 0, 0, 0, 0 };
+			unsigned int n;
+			if (x1 == x0)
+				x1++;
+			n = (x1 - x0) * (y1 - y0);
+			for (int sy = y0; sy < y1; ++sy) {
+				const unsigned char *p = pSrc + ((size_t)sy * sw + x0) * 4;
+				for (int sx = x0; sx < x1; ++sx, p += 4) {
+					sum[0] += p[0];
+					sum[1] += p[1];
+					sum[2] += p[2];
+					sum[3] += p[3];
+				}
+			}
+			for (int c = 0; c < 4; ++c)
+				dst[((size_t)y * dw + x) * 4 + c] = (sum[c] + n / 2) / n;
+		}
+	}
+
+	return dst;
+}
+
+void *Image_Orient(const void *src, GRE::Dimensions &dims, int orientation)
+{
+	const uint32_t *pSrc = (const uint32_t *)src;
+	int w = dims.w, h = dims.h;
+	bool swap = orientation >= 5;
+	int dw = swap ? h : w;
+	uint32_t *dst = (uint32_t *)malloc((size_t)w * h * 4);
+
+	if (dst == NULL)
 		return NULL;
-		break;
+
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			int dx, dy;
+
+			switch (orientation) {
+			case 2: dx = w - 1 - x; dy = y;         break;
+			case 3: dx = w - 1 - x; dy = h - 1 - y; break;
+			case 4: dx = x;         dy = h - 1 - y; break;
+			case 5: dx = y;         dy = x;         break;
+			case 6: dx = h - 1 - y; dy = x;         break;
+			case 7: dx = h - 1 - y; dy = w - 1 - x; break;
+			case 8: dx = y;         dy = w - 1 - x; break;
+			default: dx = x;        dy = y;         break;
+			}
+			dst[(size_t)dy * dw + dx] = pSrc[(size_t)y * w + x];
+		}
 	}
+	if (swap)
+		dims = GRE::Dimensions(h, w);
 
-	return new Image(pData, GRE::Dimensions(uWidth, uHeight));
+	return dst;
 }
 
-Image *ImageLoader::loadImage(const char *path)
+LoadRequest::LoadRequest(const char *p)
+ : size(0), mtime(0), key(0), hash(0), hashsize(0), hashmtime(0), map(NULL), format(ImageFormat_Invalid), orientation(1),
+   known(false), pixels(NULL), dims(0, 0), cached(false), image(NULL), mindim(0),
+   reduced(false)
 {
-	char mimetype[128];
-	Image *pImage;
-
-	std::list<ImageRef *>::iterator it = m_images.begin();
-	for (; it != m_images.end(); ++it) {
-		ImageRef *ref = *it;
-		if (!strcmp(path, ref->path)) {
-			ref->refcount++;
-			return ref->image;
+	path = strdup(p);
+	id.dev = 0;
+	id.ino = 0;
+}
+
+LoadRequest::~LoadRequest()
+{
+	if (map != NULL)
+		MemoryMapper::unmap(map);
+	if (pixels != NULL)
+		free(pixels);
+	free(path);
+}
+
+static uint64_t image_key(const struct stat *st)
+{
+	uint64_t v[5] = {
+		(uint64_t)st->st_dev, (uint64_t)st->st_ino, (uint64_t)st->st_size,
+		(uint64_t)st->st_mtim.tv_sec, (uint64_t)st->st_mtim.tv_nsec,
+	};
+	uint64_t h = 0x9e3779b97f4a7c15ull;
+
+	for (int i = 0; i < 5; ++i) {
+		h ^= v[i];
+		h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ull;
+		h ^= h >> 27; h *= 0x94d049bb133111ebull;
+		h ^= h >> 31;
+	}
+
+	return h ? h : 1;
+}
+
+static inline uint64_t mix64(uint64_t h)
+{
+	h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 27; h *= 0x94d049bb133111ebull;
+	h ^= h >> 31;
+	return h;
+}
+
+static inline unsigned int id_hash(const ImageId &id)
+{
+	return mix64(id.dev * 0x9e3779b97f4a7c15ull ^ id.ino);
+}
+
+static inline bool id_equal(const ImageId &a, const ImageId &b)
+{
+	return a.dev == b.dev && a.ino == b.ino;
+}
+
+static ImageId url_id(const char *url)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	ImageId id;
+
+	for (; *url; ++url) {
+		h ^= (unsigned char)*url;
+		h *= 0x100000001b3ull;
+	}
+	id.dev = ~0ull;
+	id.ino = mix64(h);
+
+	return id;
+}
+
+static ImageId content_id(uint64_t hash)
+{
+	ImageId id;
+
+	id.dev = ~2ull;
+	id.ino = hash;
+
+	return id;
+}
+
+/* stores a thumbnail on the pool, from a copy of the image */
+class ThumbnailWriter : public Task {
+public:
+	ThumbnailWriter(const char *path, const Image *image)
+	 : m_path(strdup(path)), m_dims(image->getDimensions())
+	{
+		size_t len = (size_t)m_dims.w * m_dims.h * 4;
+
+		m_pixels = malloc(len);
+		if (m_pixels != NULL)
+			memcpy(m_pixels, image->getData(), len);
+	}
+
+	~ThumbnailWriter()
+	{
+		free(m_pixels);
+		free(m_path);
+	}
+
+	void run(void)
+	{
+		Image image(m_pixels, m_dims);
+
+		if (m_pixels != NULL && m_path != NULL)
+			Thumbnails::store(m_path, &image);
+	}
+
+private:
+	char            *m_path;
+	void            *m_pixels;
+	GRE::Dimensions  m_dims;
+};
+
+ImageLoader::ImageLoader()
+ : m_capacity(64), m_used(0), m_retired(0), m_shared(NULL), m_meta(NULL), m_thumbnails(true)
+{
+	m_table = new ImageRef[m_capacity];
+	for (unsigned int i = 0; i < m_capacity; ++i)
+		m_table[i].image = NULL;
+}
+
+ImageLoader::~ImageLoader()
+{
+	if (m_shared != NULL)
+		delete m_shared;
+	delete[] m_table;
+}
+
+ImageLoader::ImageRef *ImageLoader::find(const ImageId &id)
+{
+	unsigned int mask = m_capacity - 1;
+
+	for (unsigned int i = id_hash(id) & mask; m_table[i].image != NULL; i = (i + 1) & mask) {
+		if (id_equal(m_table[i].id, id))
+			return &m_table[i];
+	}
+
+	return NULL;
+}
+
+void ImageLoader::grow(void)
+{
+	ImageRef *old = m_table;
+	unsigned int n = m_capacity;
+
+	m_capacity <<= 1;
+	m_table = new ImageRef[m_capacity];
+	for (unsigned int i = 0; i < m_capacity; ++i)
+		m_table[i].image = NULL;
+
+	m_used = 0;
+	for (unsigned int i = 0; i < n; ++i) {
+		if (old[i].image != NULL) {
+			insert(old[i].id, old[i].image);
+			find(old[i].id)->refcount = old[i].refcount;
 		}
 	}
+	delete[] old;
+}
+
+void ImageLoader::insert(const ImageId &id, Image *image)
+{
+	unsigned int mask;
+	unsigned int i;
+
+	if ((m_used + 1) * 4 > m_capacity * 3)
+		grow();
+
+	mask = m_capacity - 1;
+	for (i = id_hash(id) & mask; m_table[i].image != NULL; i = (i + 1) & mask)
+		;
+	m_table[i].id = id;
+	m_table[i].image = image;
+	m_table[i].refcount = 1;
+	m_used++;
+}
+
+void ImageLoader::remove(ImageRef *ref)
+{
+	unsigned int mask = m_capacity - 1;
+	unsigned int i = ref - m_table;
+	unsigned int j = i;
+
+	/* backward shift deletion, so lookups never need tombstones */
+	for (;;) {
+		unsigned int h;
+
+		j = (j + 1) & mask;
+		if (m_table[j].image == NULL)
+			break;
+		h = id_hash(m_table[j].id) & mask;
+		if (((j - h) & mask) >= ((j - i) & mask)) {
+			m_table[i] = m_table[j];
+			i = j;
+		}
+	}
+	m_table[i].image = NULL;
+	m_used--;
+}
+
+/*
+ * Moves a resident image out of the way under an id nothing will look
+ * up, so holders can still unload it.  Called with m_lock held.
+ */
+void ImageLoader::retire(const ImageId &id)
+{
+	ImageRef *ref = find(id);
+	ImageId dead;
+	Image *image;
+	int refcount;
+
+	if (ref == NULL)
+		return;
+	image = ref->image;
+	refcount = ref->refcount;
+	remove(ref);
+
+	dead.dev = ~1ull;
+	dead.ino = m_retired++;
+	insert(dead, image);
+	find(dead)->refcount = refcount;
+	image->m_id = dead;
+}
+
+void ImageLoader::invalidate(const char *path)
+{
+	struct stat st;
+	ImageId id;
 
+	/*
+	 * The shared cache and thumbnails are keyed on mtime already, and
+	 * what is resident by content still is what other copies have.
+	 */
 	if (!strncmp(path, "http://", 7)) {
+		id = url_id(path);
+	} else {
+		if (stat(path, &st))
+			return;
+		id.dev = st.st_dev;
+		id.ino = st.st_ino;
+	}
+
+	m_lock.lock();
+	retire(id);
+	id.dev ^= 1ull << 63;
+	retire(id);
+	m_lock.unlock();
+}
+
+void ImageLoader::setSharedCache(SharedCache *cache)
+{
+	if (m_shared != NULL)
+		delete m_shared;
+	m_shared = cache;
+}
+
+void ImageLoader::setMetaIndex(MetaIndex *index)
+{
+	m_meta = index;
+}
+
+/* tells the index what loading found out, unless it knew already */
+void ImageLoader::remember(const LoadRequest &req, int state)
+{
+	MetaIndex::Meta meta;
+
+	if (m_meta == NULL || req.id.dev == ~0ull || (req.known && state == MetaIndex::Valid))
+		return;
+
+	meta.size = req.size;
+	meta.mtime = req.mtime;
+	meta.w = req.reduced ? 0 : req.dims.w;
+	meta.h = req.reduced ? 0 : req.dims.h;
+	meta.state = state;
+	meta.format = req.format;
+	meta.orientation = req.orientation;
+	/* what the index knows about when it was taken, and its hash, stays */
+	meta.dated = 0;
+	meta.taken = 0;
+	meta.hashed = 0;
+	meta.hash = 0;
+	m_meta->record(req.path, meta);
+}
+
+bool ImageLoader::fetch(LoadRequest &req)
+{
+	MetaIndex::Meta meta;
+	char mimetype[128];
+	struct stat st;
+	ImageRef *ref;
+
+	if (!strncmp(req.path, "http://", 7)) {
+		req.id = url_id(req.path);
+	} else {
+		if (stat(req.path, &st))
+			return false;
+		req.id.dev = st.st_dev;
+		req.id.ino = st.st_ino;
+		req.size = st.st_size;
+		req.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+		/* edited since it was hashed; it is just this file now */
+		if (req.size != req.hashsize || req.mtime != req.hashmtime)
+			req.hash = 0;
+		if (req.hash != 0)
+			req.id = content_id(req.hash);
+	}
+
+	m_lock.lock();
+	ref = find(req.id);
+	if (ref != NULL) {
+		ref->refcount++;
+		req.image = ref->image;
+		req.cached = true;
+	}
+	m_lock.unlock();
+	if (req.image != NULL)
+		return true;
+
+	if (!strncmp(req.path, "http://", 7)) {
 		;
-	} else if (!mime_file(path, mimetype, sizeof(mimetype))) {
+	} else if (m_meta != NULL && m_meta->lookup(req.path, &st, meta)) {
+		/* seen before, and unchanged since; no need to probe it again */
+		if (meta.state == MetaIndex::Invalid)
+			return false;
+		req.format = meta.format;
+		req.orientation = meta.orientation;
+		req.known = meta.w != 0;
+	} else if (!mime_file(req.path, mimetype, sizeof(mimetype))) {
 		if (!strcmp(mimetype, "image/png"))
 			;
 		else if (!strcmp(mimetype, "image/jpeg"))
 			;
+		else {
+			remember(req, MetaIndex::Invalid);
+			return false;
+		}
+	}
+
+	if (m_shared != NULL && req.id.dev != ~0ull) {
+		req.key = req.hash != 0 ? mix64(req.hash) : image_key(&st);
+		req.pixels = m_shared->lookup(req.key, req.dims);
+		if (req.pixels != NULL) {
+			req.cached = true;
+			return true;
+		}
+	}
+
+	req.map = MemoryMapper::map(req.path);
+
+	return req.map != NULL;
+}
+
+bool ImageLoader::sniff(LoadRequest &req)
+{
+	const unsigned char *data;
+
+	if (req.image != NULL || req.pixels != NULL || req.format != ImageFormat_Invalid)
+		return true;
+
+	data = (const unsigned char *)req.map->getData();
+	if (req.map->getLength() >= 4 && !memcmp(data, "\x89PNG", 4))
+		req.format = ImageFormat_PNG;
+	else if (req.map->getLength() >= 2 && !memcmp(data, "\xff\xd8", 2))
+		req.format = ImageFormat_JPEG;
+	else
+		req.format = ImageFormat_TGA;
+
+	if (req.format == ImageFormat_JPEG)
+		req.orientation = exif_orientation(data, req.map->getLength());
+
+	return true;
+}
+
+bool ImageLoader::decode(LoadRequest &req)
+{
+	unsigned int uWidth, uHeight;
+	void *pMem;
+	int len;
+	int rc;
+
+	if (req.image != NULL || req.pixels != NULL)
+		return true;
+
+	pMem = req.map->getData();
+	len = req.map->getLength();
+
+	switch (req.format) {
+	case ImageFormat_PNG:
+		rc = LoadPNG(pMem, len, &uWidth, &uHeight, &req.pixels);
+		break;
+	case ImageFormat_JPEG:
+		if (req.mindim != 0) {
+			rc = LoadJPEGScaled(pMem, len, req.mindim, &uWidth, &uHeight, &req.pixels);
+			req.reduced = true;
+		} else {
+			rc = LoadJPEG(pMem, len, &uWidth, &uHeight, &req.pixels);
+		}
+		break;
+	case ImageFormat_TGA:
+		rc = LoadTGA(pMem, len, &uWidth, &uHeight, &req.pixels);
+		break;
+	default:
+		rc = -1;
+		break;
+	}
+
+	MemoryMapper::unmap(req.map);
+	req.map = NULL;
+
+	if (rc) {
+		req.pixels = NULL;
+		remember(req, MetaIndex::Invalid);
+		return false;
+	}
+	req.dims = GRE::Dimensions(uWidth, uHeight);
+	remember(req, MetaIndex::Valid);
+
+	return true;
+}
+
+bool ImageLoader::scale(LoadRequest &req)
+{
+	bool downscaled = req.reduced;
+
+	if (req.image != NULL || req.cached)
+		return true;
+
+	/* keep within what any GL implementation can take as a texture */
+	if (req.dims.w > MAX_DIMENSION || req.dims.h > MAX_DIMENSION) {
+		GRE::Dimensions to(MAX_DIMENSION, MAX_DIMENSION);
+		void *pixels;
+
+		if (req.dims.w > req.dims.h)
+			to.h = (long long)req.dims.h * MAX_DIMENSION / req.dims.w;
 		else
-			return NULL;
+			to.w = (long long)req.dims.w * MAX_DIMENSION / req.dims.h;
+		if (to.w < 1) to.w = 1;
+		if (to.h < 1) to.h = 1;
+
+		pixels = Image_Scale(req.pixels, req.dims, to);
+		if (pixels == NULL)
+			return false;
+		free(req.pixels);
+		req.pixels = pixels;
+		req.dims = to;
+		downscaled = true;
 	}
 
-	MemoryMapper::Map *map = MemoryMapper::map(path);
-	if (map == NULL)
-		return NULL;
+	if (req.orientation > 1) {
+		void *pixels = Image_Orient(req.pixels, req.dims, req.orientation);
 
-	pImage = Image_CreateFromMemory(map->getData(), ImageFormat_Invalid, map->getLength());
+		if (pixels == NULL)
+			return false;
+		free(req.pixels);
+		req.pixels = pixels;
+	}
 
-	MemoryMapper::unmap(map);
+	if (req.key != 0 && !req.reduced)
+		m_shared->store(req.key, req.pixels, req.dims);
+	/* only when a downscaled image came about anyway; a full size one would need scaling for it */
+	if (downscaled && m_thumbnails && !Thumbnails::valid(req.path)) {
+		Image image(req.pixels, req.dims);
+		Thumbnails::store(req.path, &image);
+	}
+
+	return true;
+}
+
+Image *ImageLoader::publish(LoadRequest &req)
+{
+	ImageRef *ref;
+	Image *image;
+
+	if (req.image != NULL)
+		return req.image;
+
+	/* never hand out a reduced decode to someone asking for the real thing */
+	if (req.reduced)
+		req.id.dev ^= 1ull << 63;
 
-	if (pImage == NULL)
+	m_lock.lock();
+	/* someone else may have loaded the same file meanwhile */
+	ref = find(req.id);
+	if (ref != NULL) {
+		ref->refcount++;
+		req.image = ref->image;
+		m_lock.unlock();
+		return req.image;
+	}
+
+	image = new Image(req.pixels, req.dims);
+	image->m_id = req.id;
+	insert(req.id, image);
+	m_lock.unlock();
+
+	req.pixels = NULL;
+	req.image = image;
+
+	return image;
+}
+
+Image *ImageLoader::loadImage(const char *path)
+{
+	LoadRequest req(path);
+
+	if (!fetch(req) || !sniff(req) || !decode(req) || !scale(req))
 		return NULL;
 
-	ImageRef *ref = new ImageRef;
-	ref->image = pImage;
-	ref->path = strdup(path);
-	ref->refcount = 1;
-	m_images.push_back(ref);
+	return publish(req);
+}
 
-	return pImage;
+void ImageLoader::acquire(Image *image)
+{
+	ImageRef *ref;
+
+	m_lock.lock();
+	ref = find(image->m_id);
+	if (ref != NULL && ref->image == image)
+		ref->refcount++;
+	m_lock.unlock();
 }
 
 void ImageLoader::unloadImage(Image *image)
 {
-	std::list<ImageRef *>::iterator it = m_images.begin();
-	for (; it != m_images.end(); ++it) {
-		ImageRef *ref = *it;
-		if (ref->image == image) {
-			if (--ref->refcount == 0) {
-				free((void *)image->getData());
-				delete image;
-				m_images.remove(ref);
-				free(ref->path);
-				delete ref;
-			}
-			break;
-		}
+	ImageRef *ref;
+
+	m_lock.lock();
+	ref = find(image->m_id);
+	if (ref == NULL || ref->image != image || --ref->refcount != 0) {
+		m_lock.unlock();
+		return;
+	}
+	remove(ref);
+	m_lock.unlock();
+
+	free((void *)image->getData());
+	delete image;
+}
+
+void ImageLoader::enableThumbnails(bool enabled)
+{
+	m_thumbnails = enabled;
+}
+
+Image *ImageLoader::loadPreview(const char *path, bool decode)
+{
+	MemoryMapper::Map *map;
+	GRE::Dimensions dims(0, 0);
+	unsigned int w, h;
+	int orientation;
+	void *pixels;
+	Image *image;
+	int rc;
+
+	if (!m_thumbnails || !strncmp(path, "http://", 7))
+		return NULL;
+
+	image = Thumbnails::load(path);
+	if (image != NULL || !decode)
+		return image;
+
+	/* no thumbnail yet; JPEGs can be decoded at 1/8 scale cheaply */
+	map = MemoryMapper::map(path);
+	if (map == NULL)
+		return NULL;
+	if (map->getLength() < 2 || memcmp(map->getData(), "\xff\xd8", 2)) {
+		MemoryMapper::unmap(map);
+		return NULL;
+	}
+	orientation = exif_orientation(map->getData(), map->getLength());
+	rc = LoadJPEGScaled(map->getData(), map->getLength(), 256, &w, &h, &pixels);
+	MemoryMapper::unmap(map);
+	if (rc)
+		return NULL;
+
+	dims = GRE::Dimensions(w, h);
+	if (orientation > 1) {
+		void *upright = Image_Orient(pixels, dims, orientation);
+
+		free(pixels);
+		if (upright == NULL)
+			return NULL;
+		pixels = upright;
 	}
+
+	image = new Image(pixels, dims);
+	/* the caller is drawing; writing the thumbnail can wait */
+	ThreadPool::shared().submit(new ThumbnailWriter(path, image), true);
+
+	return image;
+}
+
+void ImageLoader::unloadPreview(Image *image)
+{
+	free((void *)image->getData());
+	delete image;
 }
@@ -1,13 +1,28 @@
 #pragma once
 
-#include <list>
 #include "gre.h"
+#include "thread.h"
+#include "sharedcache.h"
+#include "memorymapper.h"
+#include "metaindex.h"
+
+/*
+ * device/inode of local files; remote images are identified by URL hash,
+ * and files whose content hash is known by that, so copies share
+ */
+struct ImageId {
+	unsigned long long dev;
+	unsigned long long ino;
+};
 
 class Image {
 public:
 	Image(const void *data, const GRE::Dimensions &dims)
 	 : m_data(data), m_dims(dims)
-	{ }
+	{
+		m_id.dev = 0;
+		m_id.ino = 0;
+	}
 	~Image()
 	{ }
 
@@ -22,19 +37,100 @@ public:
 	}
 
 private:
+	friend class ImageLoader;
+
 	const void *m_data;
 	GRE::Dimensions m_dims;
+	ImageId m_id;
+};
+
+/* area-averaging downscale of RGBA pixels; returns malloc'd data */
+void *Image_Scale(const void *src, const GRE::Dimensions &from, const GRE::Dimensions &to);
+/* turns pixels stored with EXIF orientation upright; returns malloc'd data */
+void *Image_Orient(const void *src, GRE::Dimensions &dims, int orientation);
+
+/* an image on its way through the steps of ImageLoader::loadImage() */
+struct LoadRequest {
+	LoadRequest(const char *path);
+	~LoadRequest();
+
+	char               *path;
+	ImageId             id;
+	uint64_t            size;
+	int64_t             mtime;    /* ns */
+	uint64_t            key;
+	uint64_t            hash;     /* of the content, if known beforehand */
+	uint64_t            hashsize; /* and size and mtime when it was taken */
+	int64_t             hashmtime;
+	MemoryMapper::Map  *map;
+	int                 format;
+	int                 orientation;
+	bool                known;    /* the metadata index had it all */
+	void               *pixels;
+	GRE::Dimensions     dims;
+	bool                cached;   /* resident or from the shared cache */
+	Image              *image;
+
+	/* if set, JPEGs may be decoded at reduced size, down to mindim */
+	unsigned int        mindim;
+	bool                reduced;
 };
 
 class ImageLoader {
 public:
+	ImageLoader();
+	~ImageLoader();
+
 	Image *loadImage(const char *path);
+	/* another reference to an image that is loaded, for unloadImage() */
+	void acquire(Image *);
 	void unloadImage(Image *);
+	/* the file changed; loads from now on won't share what is resident */
+	void invalidate(const char *path);
+
+	/*
+	 * The individual steps of loadImage(), safe to run on any thread.
+	 * Each returns false once the image turns out to be unloadable.
+	 * fetch() stats and maps the file (or downloads it), and completes
+	 * the request right away if the image is resident already.
+	 */
+	bool fetch(LoadRequest &req);
+	bool sniff(LoadRequest &req);
+	bool decode(LoadRequest &req);
+	bool scale(LoadRequest &req);
+	Image *publish(LoadRequest &req);
+
+	void setSharedCache(SharedCache *cache);
+	void setMetaIndex(MetaIndex *index);
+
+	/*
+	 * Cheap low resolution stand-ins, not reference counted.  Without
+	 * decode only a thumbnail already on disk is read.
+	 */
+	Image *loadPreview(const char *path, bool decode);
+	void unloadPreview(Image *);
+	void enableThumbnails(bool enabled);
 private:
 	struct ImageRef {
-		char *path;
+		ImageId id;
 		int refcount;
 		Image *image;
 	};
-	std::list<ImageRef *> m_images;
+
+	/* open addressed, linear probing; empty slots have no image */
+	ImageRef *find(const ImageId &id);
+	void insert(const ImageId &id, Image *image);
+	void remove(ImageRef *ref);
+	void grow(void);
+	void retire(const ImageId &id);
+	void remember(const LoadRequest &req, int state);
+
+	Mutex        m_lock;
+	ImageRef    *m_table;
+	unsigned int m_capacity;
+	unsigned int m_used;
+	unsigned long long m_retired;
+	SharedCache *m_shared;
+	MetaIndex   *m_meta;
+	bool m_thumbnails;
 };
@@ -1,37 +1,34 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <map>
+#include <set>
 
 #include "imagemanager.h"
 
-ImageManager::String::String(const ImageManager::String &str)
-{
-	if (str.m_text != NULL)
-		m_text = strdup(str.m_text);
-	else
-		m_text = NULL;
-}
-ImageManager::String::String(const char *str)
-{
-	m_text = strdup(str);
-}
-ImageManager::String::String()
-{
-	m_text = NULL;
-}
-ImageManager::String::~String()
-{
-	if (m_text != NULL)
-		free(m_text);
-}
-char *ImageManager::String::getText(void)
-{
-	return m_text;
-}
-const char *ImageManager::String::getText(void) const
-{
-	return m_text;
-}
+/* images kept on either side of the cursor when not in a hurry */
+#define PREFETCH_DEPTH 2
+/* long edge of the reduced decodes used when a deadline can't be met */
+#define REDUCED_DIM    1920
+/* images queued per lock by appendList(), so a scan isn't held up for long */
+#define APPEND_BATCH   4096
+/* how often memory pressure is sampled while holding images */
+#define PRESSURE_POLL_MS 1000
+/*
+ * Names find() will compare through the index before it tries looking
+ * around the cursor instead, and how far it looks before it gives in.
+ */
+#define FIND_CANDIDATES 16384
+#define FIND_NEARBY    4096
+/* how long, and how many, images that failed to load may linger before compact() */
+#define COMPACT_MS     500
+#define COMPACT_BATCH  1024
 
 static inline int wrap(int value, int size)
 {
@@ -41,29 +38,56 @@ static inline int wrap(int value, int size)
 	return value;
 }
 
-static int xstrrandcmp(const void *, const void *)
+/* differs between runs, and between instances in one */
+static uint64_t unseeded(void)
 {
-	return (RAND_MAX / 2) - (int)rand();
-}
+	struct timespec ts;
 
-static int xstrverscmp(const void *p1, const void *p2)
-{
-	return strverscmp((*(const ImageManager::String **)p1)->getText(),
-			  (*(const ImageManager::String **)p2)->getText());
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) ^ ((uint64_t)getpid() << 40);
 }
 
 ImageManager::ImageManager(GRE &gre)
- : m_sem(0), m_gre(gre), m_thread(*this)
+ : m_sorter(m_paths), m_pipeline(m_loader), m_gre(gre),
+   m_random(unseeded())
 {
 	m_texture = NULL;
-	m_current = NULL;
 	m_previous = NULL;
-	m_count  = 0;
-	m_size   = 256;
-	m_images = new String*[256];
+	m_preview = NULL;
+	m_meta = NULL;
+	m_search = NULL;
+	m_searchable = 0;
+	m_dates = new DateSorter(m_paths);
+	m_dates->setNotify(&m_wake);
+	m_dedup = NULL;
+	m_playlist = newPlaylist(0);
 	m_index  = 0;
+	m_seeded = false;
+	m_dir    = 1;
 	m_loadcount = 0;
+	m_maxdepth = 8;
+	m_limit = m_maxdepth;
+	m_ahead = PREFETCH_DEPTH;
+	m_behind = PREFETCH_DEPTH;
+	m_deadline = 0;
+	m_interval = 0;
+	m_lastcompact = 0;
+	m_ndead = 0;
+	m_fetchms = 0.0;
+	m_decodems = 0.0;
+	m_window = new Entry[2 * m_maxdepth + 1];
+	m_windowsize = 0;
+	m_lowmem = false;
 	m_started = false;
+	m_quit = false;
+	m_scrubbing = false;
+	m_skipcopies = false;
+	m_pipeline.setNotify(&m_wake);
+	m_readyfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	/* last, so the loader sees everything above */
+	m_thread = new Thread(*this);
 }
 
 ImageManager::~ImageManager()
@@ -72,89 +96,273 @@ ImageManager::~ImageManager()
 		m_gre.unloadTexture(m_previous);
 	if (m_texture != NULL)
 		m_gre.unloadTexture(m_texture);
+	if (m_preview != NULL)
+		m_gre.unloadTexture(m_preview);
+
+	__atomic_store_n(&m_quit, true, __ATOMIC_RELEASE);
+	m_wake.notify();
+	m_thread->join();
+	delete m_thread;
+	if (m_readyfd != -1)
+		close(m_readyfd);
+
+	delete m_search;
+	delete m_dates;
+	delete m_dedup;
+	/* the loader is done with it by now */
+	if (m_meta != NULL) {
+		m_meta->save();
+		delete m_meta;
+	}
+
+	freePlaylist(m_playlist);
+	for (unsigned int i = 0; i < m_changes.size(); ++i) {
+		free(m_changes[i].path);
+		free(m_changes[i].target);
+	}
+
+	delete[] m_window;
+}
+
+ImageManager::Playlist *ImageManager::newPlaylist(int count)
+{
+	Playlist *playlist = new Playlist;
+
+	playlist->version = 0;
+	playlist->count = count;
+	playlist->images = new uint32_t[count > 0 ? count : 1];
+	playlist->dead = NULL;
+
+	return playlist;
+}
+
+void ImageManager::freePlaylist(void *playlist)
+{
+	delete[] ((Playlist *)playlist)->images;
+	delete[] ((Playlist *)playlist)->dead;
+	delete (Playlist *)playlist;
+}
+
+/* the current playlist; only valid while in m_epoch or holding m_lock */
+ImageManager::Playlist *ImageManager::snapshot(void)
+{
+	return __atomic_load_n(&m_playlist, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Replaces the playlist; called with m_lock held.  Up to kept, it has
+ * the same images in the same places as the one it replaces.
+ */
+void ImageManager::publish(Playlist *playlist, int kept)
+{
+	Playlist *old = m_playlist;
+
+	locate(playlist, kept);
+
+	playlist->version = old->version + 1;
+	__atomic_store_n(&m_playlist, playlist, __ATOMIC_SEQ_CST);
+	m_epoch.retire(old, freePlaylist);
+	m_wake.notify();
+}
+
+/*
+ * Once images are being shown, a reordered playlist keeps the cursor,
+ * and what is loaded around it, on the same images.  Called with m_lock
+ * held, before publishing.
+ */
+void ImageManager::follow(const Playlist *playlist)
+{
+	uint32_t current;
+
+	if (!__atomic_load_n(&m_started, __ATOMIC_ACQUIRE) || m_playlist->count == 0)
+		return;
+
+	current = m_playlist->at(m_index);
+	for (int i = 0; i < playlist->count; ++i) {
+		if (playlist->images[i] == current)
+			__atomic_store_n(&m_index, playlist->order.indexOf(i), __ATOMIC_RELAXED);
+		for (int j = 0; j < m_windowsize; ++j) {
+			if (m_window[j].path == playlist->images[i])
+				m_window[j].index = playlist->order.indexOf(i);
+		}
+	}
+}
+
+/*
+ * Window positions become indices into playlist->images and back, for
+ * changes that add or take away images.  Called with m_lock held.
+ */
+void ImageManager::toImages(const Playlist *playlist)
+{
+	for (int i = 0; i < m_windowsize; ++i)
+		m_window[i].index = playlist->order.at(m_window[i].index);
+}
+
+void ImageManager::fromImages(const Playlist *playlist)
+{
+	for (int i = 0; i < m_windowsize; ++i)
+		m_window[i].index = playlist->order.indexOf(m_window[i].index);
+}
+
+/*
+ * Where the images before the cursor are in playlist->images, for a
+ * shuffled order that gains or loses images to keep them in place.
+ * Called with m_lock held.
+ */
+void ImageManager::visited(const Playlist *playlist, std::vector<uint32_t> &seen)
+{
+	if (playlist->order.identity())
+		return;
 
-	m_sem.post();
-	m_thread.join();
+	for (int i = 0; i < m_index && i < playlist->count; ++i)
+		seen.push_back(playlist->order.at(i));
+}
 
-	for (int i = 0; i < m_count; ++i)
-		delete m_images[i];
+/*
+ * The order of old carried over to n, whose images seen and current
+ * (by where they are in n->images) were visited: they keep their
+ * positions, and the rest is shuffled again.  Called with m_lock held.
+ */
+Permutation ImageManager::reshuffle(const Playlist *old, const Playlist *n,
+		std::vector<uint32_t> &seen, int current)
+{
+	if (!old->order.identity() && current < n->count &&
+			std::find(seen.begin(), seen.end(), (uint32_t)current) == seen.end())
+		seen.push_back(current);
 
-	delete[] m_images;
+	return old->order.resized(n->count, seen);
 }
 
 void ImageManager::start(void)
 {
-	if (!m_started) {
-		m_started = true;
-		m_sem.post();
+	if (!__atomic_load_n(&m_started, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&m_started, true, __ATOMIC_RELEASE);
+		m_wake.notify();
 	}
 }
 
+void ImageManager::setSeed(uint64_t seed)
+{
+	m_lock.lock();
+	m_random.seed(seed);
+	m_seeded = true;
+	m_lock.unlock();
+}
+
+/* Fisher-Yates */
 void ImageManager::randomSort(void)
 {
+	Playlist *n;
+
+	m_lock.lock();
+	if (m_ndead > 0)
+		compact();
+	n = newPlaylist(m_playlist->count);
+	memcpy(n->images, m_playlist->images, n->count * sizeof(n->images[0]));
+	/* scans find files in no particular order; a seed should not depend on it */
+	if (m_seeded)
+		m_sorter.sort(n->images, n->count);
+	for (int i = n->count - 1; i > 0; --i)
+		std::swap(n->images[i], n->images[m_random.below(i + 1)]);
+	follow(n);
+	publish(n, 0);
+	m_lock.unlock();
+}
+
+void ImageManager::randomPermutation(void)
+{
+	Playlist *n;
+
 	m_lock.lock();
-	qsort(m_images, m_count, sizeof(m_images[0]), xstrrandcmp);
+	if (m_ndead > 0)
+		compact();
+	n = newPlaylist(m_playlist->count);
+	memcpy(n->images, m_playlist->images, n->count * sizeof(n->images[0]));
+	if (m_seeded)
+		m_sorter.sort(n->images, n->count);
+	n->order = Permutation(n->count, m_random.next());
+	follow(n);
+	publish(n, m_seeded ? 0 : n->count);
 	m_lock.unlock();
 }
 
 void ImageManager::logicalSort(void)
 {
+	Playlist *n;
+
+	m_lock.lock();
+	if (m_ndead > 0)
+		compact();
+	n = newPlaylist(m_playlist->count);
+	memcpy(n->images, m_playlist->images, n->count * sizeof(n->images[0]));
+	m_sorter.sort(n->images, n->count);
+	follow(n);
+	publish(n, 0);
+	m_lock.unlock();
+}
+
+void ImageManager::dateSort(void)
+{
+	Playlist *n;
+
 	m_lock.lock();
-	qsort(m_images, m_count, sizeof(m_images[0]), xstrverscmp);
+	if (m_ndead > 0)
+		compact();
+	n = newPlaylist(m_playlist->count);
+	memcpy(n->images, m_playlist->images, n->count * sizeof(n->images[0]));
+	m_sorter.sort(n->images, n->count);
+	m_dates->sort(n->images, n->count);
+	follow(n);
+	publish(n, 0);
+	/* run() sorts again once these are in */
+	m_dates->request(n->images, n->count);
 	m_lock.unlock();
 }
 
 void ImageManager::directorySort(void)
 {
 	m_lock.lock();
-	if (m_count <= 1) {
+	if (m_ndead > 0)
+		compact();
+	int count = m_playlist->count;
+	if (count <= 1) {
 		m_lock.unlock();
 		return;
 	}
 	struct dirid {
 		int index;
 		int count;
-	} *dirid = new struct dirid[m_count];
-	const char *l, *r, *le, *re;
+	} *dirid = new struct dirid[count];
 	int di = 0;
-	qsort(m_images, m_count, sizeof(m_images[0]), xstrverscmp);
-	l = m_images[0]->getText();
-	le = strrchr(l, '/');
+	uint32_t *images = new uint32_t[count];
+	memcpy(images, m_playlist->images, count * sizeof(images[0]));
+	m_sorter.sort(images, count);
 	dirid[0].index = 0;
 	dirid[0].count = 1;
-	for (int i = 1; i < m_count; ++i) {
-		r = m_images[i]->getText();
-		re = strrchr(r, '/');
-		if (le == NULL || re == NULL) {
-			if (le == re)
-				dirid[di].count++;
-			else {
-				dirid[++di].index = i;
-				dirid[di].count = 1;
-			}
-		} else {
-			if (!strncmp(l, r, le - l))
-				dirid[di].count++;
-			else {
-				dirid[++di].index = i;
-				dirid[di].count = 1;
-			}
+	for (int i = 1; i < count; ++i) {
+		if (m_paths.dir(images[i]) == m_paths.dir(images[i - 1]))
+			dirid[di].count++;
+		else {
+			dirid[++di].index = i;
+			dirid[di].count = 1;
 		}
-		le = re;
-		l = r;
 	}
+	Playlist *n = newPlaylist(count);
 	if (di++ != 0) {
-		qsort(dirid, di, sizeof(dirid[0]), xstrrandcmp);
-		String **n = new String*[m_size];
+		for (int i = di - 1; i > 0; --i)
+			std::swap(dirid[i], dirid[m_random.below(i + 1)]);
 		int idx = 0;
 		for (int i = 0; i < di; ++i) {
 			for (int j = 0; j < dirid[i].count; ++j)
-				n[idx++] = m_images[dirid[i].index + j];
+				n->images[idx++] = images[dirid[i].index + j];
 		}
-		delete[] m_images;
-		m_images = n;
+	} else {
+		memcpy(n->images, images, count * sizeof(images[0]));
 	}
+	follow(n);
+	publish(n, 0);
 
+	delete[] images;
 	delete[] dirid;
 	m_lock.unlock();
 }
@@ -162,168 +370,1371 @@ void ImageManager::directorySort(void)
 void ImageManager::randomOffset(void)
 {
 	m_lock.lock();
-	m_index = wrap(m_index + rand(), m_count);
+	if (m_playlist->count > 0) {
+		__atomic_store_n(&m_index, m_random.below(m_playlist->count), __ATOMIC_RELAXED);
+		if (m_playlist->isDead(m_index))
+			__atomic_store_n(&m_index, neighbour(m_index, 1), __ATOMIC_RELAXED);
+	}
 	m_lock.unlock();
 }
 
 void ImageManager::append(const char *image)
 {
-	m_lock.lock();
-	if (m_count == m_size) {
-		String **n = new String*[m_size << 1];
-		for (int i = 0; i < m_count; ++i)
-			n[i] = m_images[i];
-		delete[] m_images;
-		m_images = n;
-		m_size <<= 1;
-	}
-	m_images[m_count++] = new String(image);
-	m_lock.unlock();
+	uint32_t id;
+
+	m_pendinglock.lock();
+	id = m_paths.add(image);
+	if (id != PathArena::None)
+		m_pending.push_back(id);
+	m_pendinglock.unlock();
+
+	if (id == PathArena::None)
+		fprintf(stderr, "Unable to add \"%s\"\n", image);
 }
 
-GRE::Texture *ImageManager::index(int dir)
+void ImageManager::appendList(const char *list, size_t len, char separator)
 {
-	Image *image = cacheDir(dir);
-	if (image == NULL)
-		return NULL;
+	const char *end = list + len;
+	const char *p = list;
 
-	if (m_previous != NULL)
-		m_gre.unloadTexture(m_previous);
-	m_previous = m_texture;
-	m_texture = m_gre.loadTexture(image->getData(), image->getDimensions());
+	while (p < end) {
+		m_pendinglock.lock();
+		for (int i = 0; i < APPEND_BATCH && p < end; ++i) {
+			const char *eol = (const char *)memchr(p, separator, end - p);
+			uint32_t id;
 
-	return m_texture;
+			if (eol == NULL)
+				eol = end;
+			if (eol == p) {
+				p++;
+				continue;
+			}
+			id = m_paths.add(p, eol - p);
+			if (id != PathArena::None)
+				m_pending.push_back(id);
+			else
+				fprintf(stderr, "Unable to add \"%.*s\"\n", (int)(eol - p), p);
+			p = eol + 1;
+		}
+		m_pendinglock.unlock();
+	}
 }
 
-GRE::Texture *ImageManager::next(void)
+void ImageManager::queueChange(int type, const char *path, const char *target)
 {
-	return index(1);
+	Change change;
+
+	change.type = type;
+	change.path = strdup(path);
+	change.target = target != NULL ? strdup(target) : NULL;
+	change.id = PathArena::None;
+	change.matched = false;
+
+	m_pendinglock.lock();
+	if (target != NULL)
+		change.id = m_paths.add(target);
+	if (target == NULL || change.id != PathArena::None)
+		m_changes.push_back(change);
+	m_pendinglock.unlock();
+
+	if (target != NULL && change.id == PathArena::None) {
+		fprintf(stderr, "Unable to add \"%s\"\n", target);
+		free(change.path);
+		free(change.target);
+	}
 }
 
-GRE::Texture *ImageManager::reload(void)
+void ImageManager::removePath(const char *path, bool dir)
 {
-	return index(0);
+	queueChange(dir ? Change::RemoveDir : Change::Remove, path, NULL);
 }
 
-GRE::Texture *ImageManager::prev(void)
+void ImageManager::renamePath(const char *from, const char *to)
 {
-	return index(-1);
+	queueChange(Change::Rename, from, to);
 }
 
-int ImageManager::currentImage(void) const
+void ImageManager::refreshPath(const char *path)
 {
-	return m_index + 1;
+	queueChange(Change::Refresh, path, NULL);
 }
 
-int ImageManager::imageCount(void) const
+/* splits path into a directory id and a name; m_paths can't change meanwhile */
+static void split(const PathArena &paths, const char *path, uint32_t *dir, const char **name)
 {
-	return m_count;
+	const char *slash = strrchr(path, '/');
+
+	if (slash == NULL) {
+		*dir = 0;
+		*name = path;
+	} else {
+		*dir = paths.findDir(path, slash - path);
+		*name = slash + 1;
+	}
 }
 
-void ImageManager::currentImageName(char *buf, int len)
+/* called with m_pendinglock held */
+void ImageManager::resolve(Change &change)
 {
-	m_lock.lock();
-	strncpy(buf, m_images[m_index]->getText(), len);
-	buf[len-1]=0;
-	m_lock.unlock();
+	if (change.type == Change::RemoveDir) {
+		int len = strlen(change.path);
+
+		while (len > 1 && change.path[len - 1] == '/')
+			len--;
+		change.dir = m_paths.findDir(change.path, len);
+		change.name = NULL;
+		return;
+	}
+
+	split(m_paths, change.path, &change.dir, &change.name);
+	if (change.target != NULL)
+		split(m_paths, change.target, &change.targetdir, &change.targetname);
 }
 
-int ImageManager::getLoadCount(void) const
+struct FileKey {
+	FileKey(uint32_t dir, const char *name)
+	 : dir(dir), name(name)
+	{ }
+
+	bool operator<(const FileKey &o) const
+	{
+		if (dir != o.dir)
+			return dir < o.dir;
+		return strcmp(name, o.name) < 0;
+	}
+
+	uint32_t    dir;
+	const char *name;
+};
+
+struct PathLess {
+	bool operator()(const char *a, const char *b) const
+	{
+		return strcmp(a, b) < 0;
+	}
+};
+
+/* true if path is below one of dirs */
+static bool below(const std::vector<const char *> &dirs, const char *path)
 {
-	return m_loadcount;
+	for (unsigned int i = 0; i < dirs.size(); ++i) {
+		int len = strlen(dirs[i]);
+
+		while (len > 1 && dirs[i][len - 1] == '/')
+			len--;
+		if (!strncmp(path, dirs[i], len) && path[len] == '/')
+			return true;
+	}
+
+	return false;
 }
 
-void ImageManager::run(void)
+/*
+ * Builds playlist from m_playlist and pending with every queued change
+ * applied, in one pass however many there are, and moves the cursor and
+ * the window along.  Both are indices into images here, see toImages().
+ * Called with m_lock held; playlist has room for anything that ends up
+ * appended.
+ */
+void ImageManager::applyChanges(std::vector<Change> &changes, const std::vector<uint32_t> &pending,
+		Playlist *playlist, int &current, std::vector<uint32_t> &seen)
 {
-	unsigned int waittime = 10;
+	Playlist *old = m_playlist;
+	int total = old->count + pending.size();
+	std::map<FileKey, Change *> files;
+	std::set<const char *, PathLess> later;
+	std::vector<const char *> gone;
+	std::vector<bool> stale(changes.size());
+	std::vector<uint32_t> subtrees;
+	std::vector<uint32_t> refreshed;
+	std::vector<uint32_t> fresh;
+	std::vector<uint32_t> dropped;
+	std::vector<int> removed;
+	bool cancel = false;
+	unsigned int kept;
 
-	while (m_sem.wait(waittime) != 0);
+	/* a path that changes again, or whose directory goes, later on is stale */
+	for (int i = changes.size() - 1; i >= 0; --i) {
+		Change &c = changes[i];
 
-	waittime = 0;
-	while (m_sem.wait(waittime) != 0) {
-		waittime = 100;
-		m_lock.lock();
-		if (m_count == 0) {
-			m_lock.unlock();
+		if (c.type == Change::RemoveDir) {
+			gone.push_back(c.path);
 			continue;
 		}
-		if (m_current == NULL && m_count > 0) {
-			m_current = m_loader.loadImage(m_images[m_index]->getText());
-			waittime = 0;
-			m_loadcount += (m_current != NULL);
+		stale[i] = !later.insert(c.target != NULL ? c.target : c.path).second ||
+			below(gone, c.target != NULL ? c.target : c.path);
+		later.insert(c.path);
+	}
+
+	/* the last change to a name wins */
+	for (unsigned int i = 0; i < changes.size(); ++i) {
+		Change &c = changes[i];
+
+		if (c.type == Change::RemoveDir) {
+			if (c.dir != PathArena::None)
+				subtrees.push_back(c.dir);
+			continue;
 		}
-		m_lock.unlock();
+		if (c.dir != PathArena::None)
+			files[FileKey(c.dir, c.name)] = &c;
+		/* whatever the rename lands on goes */
+		if (c.type == Change::Rename && c.targetdir != PathArena::None)
+			files[FileKey(c.targetdir, c.targetname)] = &c;
+	}
 
-		for (int i = 0; i < 2; ++i) {
-			m_lock.lock();
-			if (m_count == 0) {
-				m_lock.unlock();
-				continue;
-			}
-			int n = m_cache[i].count();
-			int s = i == 0 ? -1 : 1;
-			if (n > 2) {
-				m_loader.unloadImage(m_cache[i].popBack());
-				waittime = 0;
-				m_loadcount--;
-			} else if (n < 2) {
-				const char *name;
-				Image *image;
-				int index;
-
-				index = wrap(m_index + (n + 1) * s, m_count);
-				//printf("Loading (%d + %d = %d), \"%s\"...", m_index, (n + 1) * s, index, m_images[index]->getText());
-				//fflush(stdout);
-				name = m_images[index]->getText();
-				m_lock.unlock();
-				image = m_loader.loadImage(name);
-				m_lock.lock();
-				//printf(" done\n");
-				waittime = 0;
-				if (image != NULL) {
-					m_cache[i].pushBack(image);
-					m_loadcount++;
-				} else {
-					fprintf(stderr, "Removing \"%s\", as it is unloadable\n",
-						m_images[index]->getText());
-					delete m_images[index];
-					memmove(&m_images[index],
-						&m_images[index + 1],
-						(m_count - (index + 1)) * sizeof(m_images[0]));
-					m_count--;
+	/* what the scan added meanwhile is subject to the same changes */
+	playlist->count = 0;
+	for (int i = 0; i < total; ++i) {
+		uint32_t id = i < old->count ? old->images[i] : pending[i - old->count];
+		uint32_t dir = m_paths.dir(id);
+		bool drop = false;
+
+		for (unsigned int j = 0; j < subtrees.size() && !drop; ++j)
+			drop = m_paths.under(dir, subtrees[j]);
+
+		if (!drop && !files.empty()) {
+			const char *name = m_paths.name(id);
+			std::map<FileKey, Change *>::iterator it = files.find(FileKey(dir, name));
+
+			if (it != files.end()) {
+				Change *c = it->second;
+
+				switch (c->type) {
+				case Change::Remove:
+					drop = true;
+					break;
+				case Change::Rename:
+					if (dir == c->dir && !strcmp(name, c->name)) {
+						c->matched = true;
+						dropped.push_back(id);
+						id = c->id;
+						fresh.push_back(id);
+					} else {
+						drop = true;
+					}
+					break;
+				case Change::Refresh:
+					c->matched = true;
+					refreshed.push_back(id);
+					break;
 				}
 			}
+		}
+
+		if (drop) {
+			removed.push_back(i);
+			dropped.push_back(id);
+		} else {
+			playlist->images[playlist->count++] = id;
+		}
+	}
+
+	/* the images around the cursor keep their places, or go */
+	for (int i = 0; i < m_windowsize; ) {
+		Entry *entry = &m_window[i];
+
+		if (std::binary_search(removed.begin(), removed.end(), entry->index) ||
+				std::find(refreshed.begin(), refreshed.end(), entry->path) != refreshed.end()) {
+			cancel |= releaseEntry(entry);
+			continue;
+		}
+		entry->index -= std::lower_bound(removed.begin(), removed.end(), entry->index) -
+			removed.begin();
+		entry->path = playlist->images[entry->index];
+		++i;
+	}
+	if (cancel)
+		m_pipeline.reprioritize(*this);
+
+	/* as do those already visited */
+	kept = 0;
+	for (unsigned int i = 0; i < seen.size(); ++i) {
+		if (!std::binary_search(removed.begin(), removed.end(), (int)seen[i]))
+			seen[kept++] = seen[i] - (std::lower_bound(removed.begin(), removed.end(),
+						(int)seen[i]) - removed.begin());
+	}
+	seen.resize(kept);
+
+	/* when the current image goes, the one after it takes its place */
+	current -= std::lower_bound(removed.begin(), removed.end(), current) - removed.begin();
+	if (current >= playlist->count)
+		current = 0;
+
+	for (unsigned int i = 0; i < changes.size(); ++i) {
+		Change &c = changes[i];
+
+		if (c.type == Change::Refresh && c.matched) {
+			m_loader.invalidate(c.path);
+		} else if (stale[i]) {
+			continue;
+		} else if (c.type == Change::Refresh) {
+			uint32_t id;
+
+			m_pendinglock.lock();
+			id = m_paths.add(c.path);
+			m_pendinglock.unlock();
+			if (id != PathArena::None) {
+				playlist->images[playlist->count++] = id;
+				fresh.push_back(id);
+			}
+		} else if (c.type == Change::Rename && !c.matched) {
+			/* moved in from somewhere we don't list */
+			playlist->images[playlist->count++] = c.id;
+			fresh.push_back(c.id);
+		}
+	}
+
+	/* what changed may be a copy now, or no longer one; what went is no original */
+	if (m_dedup != NULL) {
+		dropped.insert(dropped.end(), refreshed.begin(), refreshed.end());
+		for (unsigned int i = 0; i < dropped.size(); ++i)
+			m_dedup->forget(dropped[i]);
+		fresh.insert(fresh.end(), refreshed.begin(), refreshed.end());
+		if (!fresh.empty())
+			m_dedup->request(&fresh[0], fresh.size());
+	}
+}
+
+/* publishes everything queued since the last commit as one snapshot */
+void ImageManager::commit(void)
+{
+	std::vector<uint32_t> pending;
+	std::vector<Change> changes;
+	std::vector<uint32_t> seen;
+	uint32_t limit;
+	Playlist *n;
+	int current;
+
+	m_pendinglock.lock();
+	pending.swap(m_pending);
+	changes.swap(m_changes);
+	for (unsigned int i = 0; i < changes.size(); ++i)
+		resolve(changes[i]);
+	limit = m_paths.count();
+	m_pendinglock.unlock();
+	if (pending.empty() && changes.empty())
+		return;
+
+	m_lock.lock();
+	if (m_ndead > 0)
+		compact();
+	n = newPlaylist(m_playlist->count + changes.size() + pending.size());
+	current = m_playlist->count > 0 ? m_playlist->order.at(m_index) : 0;
+	visited(m_playlist, seen);
+	toImages(m_playlist);
+	if (changes.empty()) {
+		memcpy(n->images, m_playlist->images, m_playlist->count * sizeof(n->images[0]));
+		if (!pending.empty())
+			memcpy(n->images + m_playlist->count, &pending[0],
+					pending.size() * sizeof(n->images[0]));
+		n->count = m_playlist->count + pending.size();
+	} else {
+		applyChanges(changes, pending, n, current, seen);
+	}
+	/* a shuffled order takes in what was added, ahead of the cursor */
+	n->order = reshuffle(m_playlist, n, seen, current);
+	fromImages(n);
+	__atomic_store_n(&m_index, n->count > 0 ? n->order.indexOf(current) : 0, __ATOMIC_RELAXED);
+	publish(n, changes.empty() ? m_playlist->count : 0);
+	if (m_search != NULL) {
+		m_searchable = limit;
+		m_search->grow(limit);
+	}
+	if (m_dedup != NULL && !pending.empty())
+		m_dedup->request(&pending[0], pending.size());
+	m_lock.unlock();
+
+	for (unsigned int i = 0; i < changes.size(); ++i) {
+		free(changes[i].path);
+		free(changes[i].target);
+	}
+}
+
+int ImageManager::enableSharedCache(unsigned int megabytes)
+{
+	SharedCache *cache;
+	char name[64];
+
+	snprintf(name, sizeof(name), "/imager-%u", (unsigned int)getuid());
+	cache = SharedCache::open(name, (size_t)megabytes << 20);
+	if (cache == NULL)
+		return -1;
+
+	m_lock.lock();
+	m_loader.setSharedCache(cache);
+	m_lock.unlock();
+
+	return 0;
+}
+
+int ImageManager::enableIndex(void)
+{
+	MetaIndex *index = new MetaIndex;
+
+	if (index->open(NULL)) {
+		delete index;
+		return -1;
+	}
+
+	m_lock.lock();
+	m_meta = index;
+	m_loader.setMetaIndex(index);
+	m_dates->setMetaIndex(index);
+	if (m_dedup != NULL)
+		m_dedup->setMetaIndex(index);
+	m_lock.unlock();
+
+	return 0;
+}
+
+MetaIndex *ImageManager::metaIndex(void) const
+{
+	return m_meta;
+}
+
+void ImageManager::enableSearch(void)
+{
+	m_lock.lock();
+	if (m_search == NULL) {
+		m_search = new SearchIndex(m_paths);
+		m_pendinglock.lock();
+		m_searchable = m_paths.count();
+		m_pendinglock.unlock();
+		m_search->grow(m_searchable);
+		locate(m_playlist, 0);
+	}
+	m_lock.unlock();
+}
+
+void ImageManager::enableDedup(bool skip)
+{
+	m_lock.lock();
+	if (m_dedup == NULL) {
+		m_dedup = new Deduplicator(m_paths);
+		m_dedup->setMetaIndex(m_meta);
+		locate(m_playlist, 0);
+	}
+	m_skipcopies = skip;
+	/* copies only matter to run() if they are skipped */
+	m_dedup->setNotify(skip ? &m_wake : NULL);
+	m_lock.unlock();
+}
+
+/* keeps m_where up to date from position from on; called with m_lock held */
+void ImageManager::locate(const Playlist *playlist, int from)
+{
+	if (m_search == NULL && m_dedup == NULL)
+		return;
+
+	for (int i = from; i < playlist->count; ++i) {
+		uint32_t id = playlist->images[i];
+
+		if (id >= m_where.size())
+			m_where.resize(std::max((size_t)id + 1, m_where.size() * 2));
+		m_where[id] = i;
+	}
+}
+
+int ImageManager::find(const char *text)
+{
+	std::vector<uint32_t> ids;
+	SearchIndex *search;
+	uint32_t limit;
+	int nearby;
+
+	m_lock.lock();
+	search = m_search;
+	limit = m_searchable;
+	m_lock.unlock();
+	/* a few candidates are quicker to check than looking around */
+	if (search != NULL && search->find(text, limit, ids, FIND_CANDIDATES))
+		return nearest(ids);
+
+	m_lock.lock();
+	/* without an index, look all the way round */
+	nearby = search != NULL ? std::min(FIND_NEARBY, m_playlist->count) : m_playlist->count;
+	for (int i = 1, index = m_index; i <= nearby; ++i) {
+		index = wrap(index + 1, m_playlist->count);
+		if (!m_playlist->isDead(index) &&
+				SearchIndex::matches(m_paths.name(m_playlist->at(index)), text)) {
 			m_lock.unlock();
+			return index;
 		}
 	}
+	m_lock.unlock();
+	if (search == NULL)
+		return -1;
 
-	while (m_cache[0].count() > 0)
-		m_loader.unloadImage(m_cache[0].popBack());
-	while (m_cache[1].count() > 0)
-		m_loader.unloadImage(m_cache[1].popBack());
-	if (m_current != NULL)
-		m_loader.unloadImage(m_current);
+	search->find(text, limit, ids, limit);
+
+	return nearest(ids);
 }
 
-Image *ImageManager::cacheDir(int dir)
+/* the first of ids after the cursor; the playlist may have changed since */
+int ImageManager::nearest(const std::vector<uint32_t> &ids)
 {
-	Image *ret;
-	int idx = (dir + 1) >> 1;
+	unsigned int distance;
+	int best = -1;
 
-	if (m_count == 0)
-		return NULL;
-	if (dir == 0)
-		return m_current;
+	m_lock.lock();
+	distance = m_playlist->count;
+	for (unsigned int i = 0; i < ids.size(); ++i) {
+		uint32_t p = ids[i] < m_where.size() ? m_where[ids[i]] : 0;
+		int index;
+
+		if (p >= (uint32_t)m_playlist->count || m_playlist->images[p] != ids[i])
+			continue;
+		index = m_playlist->order.indexOf(p);
+		if (m_playlist->isDead(index))
+			continue;
+		/* the current image comes last */
+		if ((unsigned int)wrap(index - m_index - 1, m_playlist->count) < distance) {
+			distance = wrap(index - m_index - 1, m_playlist->count);
+			best = index;
+		}
+	}
+	m_lock.unlock();
+
+	return best;
+}
 
-	ret = m_cache[idx].popFront(0);
-	if (ret == NULL)
+GRE::Texture *ImageManager::index(int dir)
+{
+	GRE::Texture *texture;
+	Image *image = cacheDir(dir);
+	if (image == NULL)
 		return NULL;
 
-	m_lock.lock();
-	if (m_current != NULL)
-		m_cache[!idx].pushFront(m_current);
-	m_current = ret;
-	m_index = wrap(m_index + dir, m_count);
+	texture = upload(image);
+	m_loader.unloadImage(image);
+
+	return texture;
+}
+
+GRE::Texture *ImageManager::upload(Image *image)
+{
+	if (m_preview != NULL)
+		m_gre.unloadTexture(m_preview);
+	m_preview = NULL;
+
+	if (m_previous != NULL)
+		m_gre.unloadTexture(m_previous);
+	m_previous = NULL;
+	/* under memory pressure, don't keep the old texture around to fade */
+	if (m_lowmem) {
+		if (m_texture != NULL)
+			m_gre.unloadTexture(m_texture);
+	} else {
+		m_previous = m_texture;
+	}
+	m_texture = m_gre.loadTexture(image->getData(), image->getDimensions());
+
+	return m_texture;
+}
+
+GRE::Texture *ImageManager::preview(int dir, bool decode)
+{
+	char name[4096];
+	Image *image;
+
+	if (m_preview != NULL)
+		m_gre.unloadTexture(m_preview);
+	m_preview = NULL;
+
+	{
+		EpochGuard guard(m_epoch);
+		Playlist *playlist = snapshot();
+
+		if (playlist->count == 0)
+			return NULL;
+		m_paths.path(playlist->at(wrap(__atomic_load_n(&m_index, __ATOMIC_RELAXED) + dir,
+				playlist->count)), name, sizeof(name));
+	}
+
+	image = m_loader.loadPreview(name, decode);
+	if (image == NULL)
+		return NULL;
+
+	m_preview = m_gre.loadTexture(image->getData(), image->getDimensions());
+	m_loader.unloadPreview(image);
+
+	return m_preview;
+}
+
+/* called with m_lock held; true if the cursor moved */
+bool ImageManager::moveTo(int index)
+{
+	int ahead;
+
+	index = wrap(index, m_playlist->count);
+	if (m_playlist->isDead(index))
+		index = neighbour(index, 1);
+	if (index == m_index)
+		return false;
+
+	/* the direction of travel is the shorter way round */
+	ahead = wrap(index - m_index, m_playlist->count);
+	m_dir = (ahead <= m_playlist->count / 2) ? 1 : -1;
+	__atomic_store_n(&m_index, index, __ATOMIC_RELAXED);
+	evict();
+
+	return true;
+}
+
+GRE::Texture *ImageManager::seek(int index)
+{
+	GRE::Texture *texture;
+	Image *image = NULL;
+	Entry *entry;
+	bool moved;
+
+	m_lock.lock();
+	if (m_playlist->count == 0) {
+		m_lock.unlock();
+		return NULL;
+	}
+
+	moved = moveTo(index) || m_scrubbing;
+	m_scrubbing = false;
+	entry = findEntry(m_index);
+	if (entry != NULL)
+		image = entry->image;
+	/* the window may let go of it before it is uploaded */
+	if (image != NULL)
+		m_loader.acquire(image);
+	if (moved) {
+		m_pipeline.reprioritize(*this);
+		m_wake.notify();
+	}
+	m_lock.unlock();
+
+	if (image == NULL)
+		return NULL;
+
+	texture = upload(image);
+	m_loader.unloadImage(image);
+
+	return texture;
+}
+
+void ImageManager::scrub(int index)
+{
+	m_lock.lock();
+	if (m_playlist->count == 0) {
+		m_lock.unlock();
+		return;
+	}
+
+	moveTo(index);
+	/* anything still queued is for an image the user is flying past */
+	m_scrubbing = true;
+	m_pipeline.reprioritize(*this);
+	m_lock.unlock();
+}
+
+void ImageManager::enableThumbnails(bool enabled)
+{
+	m_lock.lock();
+	m_loader.enableThumbnails(enabled);
+	m_lock.unlock();
+}
+
+GRE::Texture *ImageManager::next(void)
+{
+	return index(1);
+}
+
+GRE::Texture *ImageManager::reload(void)
+{
+	return index(0);
+}
+
+GRE::Texture *ImageManager::prev(void)
+{
+	return index(-1);
+}
+
+int ImageManager::currentImage(void) const
+{
+	return __atomic_load_n(&m_index, __ATOMIC_RELAXED) + 1;
+}
+
+int ImageManager::imageCount(void)
+{
+	EpochGuard guard(m_epoch);
+
+	return snapshot()->count;
+}
+
+void ImageManager::currentImageName(char *buf, int len)
+{
+	EpochGuard guard(m_epoch);
+	Playlist *playlist = snapshot();
+
+	if (playlist->count == 0) {
+		buf[0] = 0;
+		return;
+	}
+	/* the cursor may be a step behind the playlist; it only moves with m_lock */
+	m_paths.path(playlist->at(wrap(__atomic_load_n(&m_index, __ATOMIC_RELAXED),
+				playlist->count)), buf, len);
+}
+
+unsigned int ImageManager::playlistVersion(void)
+{
+	EpochGuard guard(m_epoch);
+
+	return snapshot()->version;
+}
+
+int ImageManager::readyFd(void) const
+{
+	return m_readyfd;
+}
+
+void ImageManager::clearReady(void)
+{
+	uint64_t count;
+
+	/* non-blocking, so this fails harmlessly if nothing finished */
+	if (m_readyfd != -1)
+		while (read(m_readyfd, &count, sizeof(count)) == -1 && errno == EINTR);
+}
+
+int ImageManager::getLoadCount(void) const
+{
+	return m_loadcount;
+}
+
+void ImageManager::loaderStatus(char *buf, int len) const
+{
+	m_pipeline.status(buf, len);
+}
+
+bool ImageManager::hasPrevious(void) const
+{
+	return m_previous != NULL;
+}
+
+void ImageManager::updatePressure(void)
+{
+	MemoryMonitor::Level old = m_memory.level();
+	MemoryMonitor::Level level = m_memory.poll();
+	int depth;
+
+	if (level == old)
+		return;
+
+	switch (level) {
+	case MemoryMonitor::Critical:
+		depth = 1;
+		break;
+	case MemoryMonitor::Moderate:
+		depth = m_maxdepth / 2;
+		break;
+	default:
+		depth = m_maxdepth;
+		break;
+	}
+	if (depth < 1)
+		depth = 1;
+
+	m_lock.lock();
+	m_limit = depth;
+	m_lowmem = (level == MemoryMonitor::Critical);
+	m_lock.unlock();
+
+	fprintf(stderr, "Memory pressure %s, prefetching at most %d image(s)\n",
+			MemoryMonitor::levelName(level), depth);
+}
+
+/*
+ * Size the window so that, at the measured load latency, enough images
+ * are in flight to keep up with the slideshow, and only use as many
+ * decoders as that takes.  Called with m_lock held.
+ */
+void ImageManager::updateDepth(void)
+{
+	int cpus = ThreadPool::shared().size();
+	int ahead = PREFETCH_DEPTH;
+	int decoders = cpus;
+
+	if (m_deadline != 0 && m_interval != 0 && m_decodems > 0.0) {
+		double latency = m_fetchms + m_decodems;
+
+		ahead = (int)(latency / m_interval) + 2;
+		if (ahead < PREFETCH_DEPTH)
+			ahead = PREFETCH_DEPTH;
+		decoders = (int)(m_decodems / m_interval) + 1;
+	}
+	if (ahead > m_maxdepth)
+		ahead = m_maxdepth;
+	if (ahead > m_limit)
+		ahead = m_limit;
+
+	m_ahead = ahead;
+	m_behind = PREFETCH_DEPTH < m_limit ? PREFETCH_DEPTH : m_limit;
+
+	if (decoders > cpus)
+		decoders = cpus;
+	if (decoders != m_pipeline.parallelism(LoadPipeline::Decode)) {
+		m_pipeline.setParallelism(LoadPipeline::Decode, decoders);
+		m_pipeline.setParallelism(LoadPipeline::Scale, decoders);
+	}
+}
+
+void ImageManager::setDeadline(Timestamp deadline, Timestamp interval)
+{
+	m_lock.lock();
+	if (deadline == m_deadline && interval == m_interval) {
+		m_lock.unlock();
+		return;
+	}
+	m_deadline = deadline;
+	m_interval = interval;
+	m_lock.unlock();
+
+	m_wake.notify();
+}
+
+ImageManager::Entry *ImageManager::findEntry(int index)
+{
+	for (int i = 0; i < m_windowsize; ++i) {
+		if (m_window[i].index == index)
+			return &m_window[i];
+	}
+	return NULL;
+}
+
+ImageManager::Entry *ImageManager::findJob(const LoadPipeline::Job *job)
+{
+	for (int i = 0; i < m_windowsize; ++i) {
+		if (m_window[i].job == job)
+			return &m_window[i];
+	}
+	return NULL;
+}
+
+void ImageManager::dropEntry(Entry *entry)
+{
+	*entry = m_window[--m_windowsize];
+}
+
+/*
+ * Load order around the cursor: the current image, then alternately
+ * ahead and behind in the direction of travel.  -1 if out of the window.
+ * Buried images take up no room in it.
+ */
+int ImageManager::priority(int index) const
+{
+	int ahead = wrap((index - m_index) * m_dir, m_playlist->count);
+	int behind = wrap((m_index - index) * m_dir, m_playlist->count);
+	int ret = -1;
+
+	if (ahead == 0)
+		return 0;
+	if (m_ndead > 0) {
+		int p = m_index;
+
+		for (int i = 1; i <= m_ahead && ret < 0; ++i) {
+			p = neighbour(p, m_dir);
+			if (p == index)
+				ret = 2 * i - 1;
+		}
+		p = m_index;
+		for (int i = 1; i <= m_behind && (ret < 0 || 2 * i < ret); ++i) {
+			p = neighbour(p, -m_dir);
+			if (p == index)
+				ret = 2 * i;
+		}
+		return ret;
+	}
+	if (ahead <= m_ahead)
+		ret = 2 * ahead - 1;
+	if (behind <= m_behind && (ret < 0 || 2 * behind < ret))
+		ret = 2 * behind;
+
+	return ret;
+}
+
+/* called by the pipeline, with m_lock held */
+int ImageManager::rank(const LoadPipeline::Job *job)
+{
+	Entry *entry = findJob(job);
+
+	if (entry == NULL || m_scrubbing)
+		return -1;
+	return priority(entry->index);
+}
+
+/* unloads or abandons entry and drops it; true if a load was abandoned */
+bool ImageManager::releaseEntry(Entry *entry)
+{
+	bool cancel = false;
+
+	if (entry->image != NULL) {
+		m_loader.unloadImage(entry->image);
+		m_loadcount--;
+	} else {
+		cancel = true;
+	}
+	dropEntry(entry);
+
+	return cancel;
+}
+
+/* drops everything outside the window; true if loads were abandoned */
+bool ImageManager::evict(void)
+{
+	bool cancel = false;
+
+	for (int i = 0; i < m_windowsize; ) {
+		Entry *entry = &m_window[i];
+
+		/* reduced decodes only stand in while a deadline is pressing */
+		if (priority(entry->index) >= 0 && !(entry->reduced &&
+				m_deadline == 0 && entry->index != m_index)) {
+			++i;
+			continue;
+		}
+		cancel |= releaseEntry(entry);
+	}
+
+	return cancel;
+}
+
+/* an image that failed to load goes; called with m_lock held */
+void ImageManager::bury(int index)
+{
+	char name[4096];
+
+	m_paths.path(m_playlist->at(index), name, sizeof(name));
+	fprintf(stderr, "Removing \"%s\", as it is unloadable\n", name);
+	hide(index);
+}
+
+/*
+ * Marks an image that is to go, rather than taking it out of the
+ * playlist there and then: that would copy the playlist for each one,
+ * and shift every position after it under the user.  Navigation steps
+ * over it until compact() drops it.  Called with m_lock held.
+ */
+void ImageManager::hide(int index)
+{
+	Playlist *playlist = m_playlist;
+	uint32_t i = playlist->order.at(index);
+
+	if (playlist->dead == NULL) {
+		int words = (playlist->count + 31) / 32;
+
+		playlist->dead = new uint32_t[words];
+		memset(playlist->dead, 0, words * sizeof(playlist->dead[0]));
+	}
+	playlist->dead[i / 32] |= 1u << (i % 32);
+	m_ndead++;
+
+	if (index == m_index)
+		__atomic_store_n(&m_index, neighbour(m_index, m_dir), __ATOMIC_RELAXED);
+}
+
+/*
+ * Copies of images listed earlier go, as they are found.  Former copies
+ * whose original changed or went come back: in place while they are
+ * only hidden, at the end once compact() dropped them.
+ */
+void ImageManager::skipCopies(const std::vector<uint32_t> &copies,
+		const std::vector<uint32_t> &restored)
+{
+	std::vector<uint32_t> gone;
+
+	m_lock.lock();
+	for (unsigned int i = 0; i < copies.size(); ++i) {
+		uint32_t p = copies[i] < m_where.size() ? m_where[copies[i]] : 0;
+		int index;
+
+		/* unless they went already */
+		if (p >= (uint32_t)m_playlist->count || m_playlist->images[p] != copies[i])
+			continue;
+		index = m_playlist->order.indexOf(p);
+		if (!m_playlist->isDead(index))
+			hide(index);
+	}
+	for (unsigned int i = 0; i < restored.size(); ++i) {
+		uint32_t p = restored[i] < m_where.size() ? m_where[restored[i]] : 0;
+
+		if (p >= (uint32_t)m_playlist->count || m_playlist->images[p] != restored[i]) {
+			gone.push_back(restored[i]);
+		} else if (m_playlist->dead != NULL && (m_playlist->dead[p / 32] >> (p % 32) & 1)) {
+			m_playlist->dead[p / 32] &= ~(1u << (p % 32));
+			m_ndead--;
+		}
+	}
+	m_lock.unlock();
+
+	if (gone.empty())
+		return;
+	m_pendinglock.lock();
+	m_pending.insert(m_pending.end(), gone.begin(), gone.end());
+	m_pendinglock.unlock();
+	commit();
+}
+
+/*
+ * True if a copy of the image at index is on its way for another
+ * position; once it is in, loading this one only takes a reference.
+ */
+bool ImageManager::copyLoading(int index)
+{
+	uint64_t hash;
+
+	if (m_dedup == NULL)
+		return false;
+	hash = m_dedup->hash(m_playlist->at(index));
+	if (hash == 0)
+		return false;
+	for (int i = 0; i < m_windowsize; ++i) {
+		if (m_window[i].job != NULL && m_window[i].index != index &&
+				m_dedup->hash(m_window[i].path) == hash)
+			return true;
+	}
+
+	return false;
+}
+
+/* the first position from index in direction dir that isn't buried */
+int ImageManager::neighbour(int index, int dir) const
+{
+	const Playlist *playlist = m_playlist;
+
+	for (int i = 0; i < playlist->count; ++i) {
+		index = wrap(index + dir, playlist->count);
+		if (!playlist->isDead(index))
+			break;
+		/* unshuffled, a directory of broken files is a run of whole words */
+		if (playlist->order.identity() && playlist->dead[index / 32] == ~0u) {
+			int skip = dir > 0 ? 31 - index % 32 : index % 32;
+
+			index += dir * skip;
+			i += skip;
+		}
+	}
+
+	return index;
+}
+
+/*
+ * Drops everything bury() marked in one pass, and moves the cursor and
+ * the window along with the images that are left.  Called with m_lock
+ * held.
+ */
+void ImageManager::compact(void)
+{
+	Playlist *old = m_playlist;
+	int words = (old->count + 31) / 32;
+	std::vector<int> before(words);
+	std::vector<uint32_t> seen;
+	unsigned int kept = 0;
+	bool cancel = false;
+	int current;
+	Playlist *n;
+
+	n = newPlaylist(old->count - m_ndead);
+	n->count = 0;
+	for (int w = 0; w < words; ++w) {
+		int base = w * 32;
+		int end = std::min(base + 32, old->count);
+
+		before[w] = n->count;
+		if (old->dead[w] == 0) {
+			memcpy(n->images + n->count, old->images + base,
+					(end - base) * sizeof(n->images[0]));
+			n->count += end - base;
+			continue;
+		}
+		for (int i = base; i < end; ++i) {
+			if (!(old->dead[w] >> (i % 32) & 1))
+				n->images[n->count++] = old->images[i];
+		}
+	}
+
+	/* a buried position maps to the first image after it */
+	current = old->order.at(m_index);
+	visited(old, seen);
+	toImages(old);
+	for (int i = 0; i < m_windowsize; ) {
+		Entry *entry = &m_window[i];
+		int p = entry->index;
+
+		if (old->dead[p / 32] >> (p % 32) & 1) {
+			cancel |= releaseEntry(entry);
+			continue;
+		}
+		entry->index = before[p / 32] +
+			__builtin_popcount(~old->dead[p / 32] & ((1u << (p % 32)) - 1));
+		++i;
+	}
+	if (cancel)
+		m_pipeline.reprioritize(*this);
+	current = before[current / 32] +
+		__builtin_popcount(~old->dead[current / 32] & ((1u << (current % 32)) - 1));
+	if (current >= n->count)
+		current = 0;
+	for (unsigned int i = 0; i < seen.size(); ++i) {
+		uint32_t p = seen[i];
+
+		if (!(old->dead[p / 32] >> (p % 32) & 1))
+			seen[kept++] = before[p / 32] +
+				__builtin_popcount(~old->dead[p / 32] & ((1u << (p % 32)) - 1));
+	}
+	seen.resize(kept);
+
+	n->order = reshuffle(old, n, seen, current);
+	fromImages(n);
+	__atomic_store_n(&m_index, n->count > 0 ? n->order.indexOf(current) : 0, __ATOMIC_RELAXED);
+	m_ndead = 0;
+	m_lastcompact = Time::MS();
+	/* the paths stay in m_paths; readers may still find them through the old playlist */
+	publish(n, 0);
+}
+
+bool ImageManager::request(int index)
+{
+	uint32_t path = m_playlist->at(index);
+	LoadPipeline::Job *job;
+	char name[4096];
+	Entry *entry;
+
+	m_paths.path(path, name, sizeof(name));
+	job = new LoadPipeline::Job(name);
+	job->index = index;
+	job->priority = priority(index);
+	/* ids are never reused, so they tell whether the entry has moved */
+	job->cookie = (const void *)(uintptr_t)path;
+	/* copies are loaded once, under their content */
+	if (m_dedup != NULL)
+		job->request.hash = m_dedup->hash(path, job->request.hashsize,
+				job->request.hashmtime);
+
+	/*
+	 * In a slideshow, estimate when this image would be ready, given
+	 * what is queued before it.  If that misses the moment it is due,
+	 * ask for a cheaper reduced resolution decode instead.
+	 */
+	if (m_deadline != 0 && m_decodems > 0.0 && (job->priority & 1)) {
+		int ahead = (job->priority + 1) / 2;
+		int decoders = m_pipeline.parallelism(LoadPipeline::Decode);
+		Timestamp due = m_deadline + (ahead - 1) * m_interval;
+		double ready = Time::MS() + m_fetchms +
+			m_decodems * ((ahead + decoders - 1) / decoders);
+
+		if (ready > due)
+			job->request.mindim = REDUCED_DIM;
+	}
+
+	entry = &m_window[m_windowsize++];
+	entry->index = index;
+	entry->path = path;
+	entry->image = NULL;
+	entry->job = job;
+	entry->reduced = job->request.mindim != 0;
+
+	if (!m_pipeline.submit(job)) {
+		dropEntry(entry);
+		delete job;
+		return false;
+	}
+
+	return true;
+}
+
+void ImageManager::finish(LoadPipeline::Job *job)
+{
+	LoadRequest &req = job->request;
+	Image *image = job->image;
+	Entry *entry;
+
+	m_lock.lock();
+	/* learn from work that was actually done, not from cache hits */
+	if (image != NULL && !req.cached) {
+		double fetch = job->elapsed[LoadPipeline::Fetch];
+		double decode = job->elapsed[LoadPipeline::Sniff] +
+			job->elapsed[LoadPipeline::Decode] +
+			job->elapsed[LoadPipeline::Scale];
+
+		m_fetchms += m_fetchms == 0.0 ? fetch : (fetch - m_fetchms) / 4;
+		if (!req.reduced)
+			m_decodems += m_decodems == 0.0 ? decode : (decode - m_decodems) / 4;
+	}
+
+	entry = findJob(job);
+	if (job->cancelled) {
+		if (entry != NULL)
+			dropEntry(entry);
+	} else if (image == NULL) {
+		int index = entry != NULL ? entry->index : job->index;
+
+		if (entry != NULL)
+			dropEntry(entry);
+		/* the playlist may have changed under the job; match it up again */
+		if (index < m_playlist->count && m_playlist->at(index) == (uintptr_t)job->cookie &&
+				!m_playlist->isDead(index))
+			bury(index);
+	} else if (entry != NULL) {
+		entry->image = image;
+		entry->job = NULL;
+		entry->reduced = req.reduced;
+		image = NULL;
+		m_loadcount++;
+	}
+	m_lock.unlock();
+
+	/* stale: the cursor moved on while it was loading */
+	if (image != NULL)
+		m_loader.unloadImage(image);
+	else if (!job->cancelled && m_readyfd != -1) {
+		uint64_t one = 1;
+		while (write(m_readyfd, &one, sizeof(one)) == -1 && errno == EINTR);
+	}
+	delete job;
+}
+
+void ImageManager::schedule(void)
+{
+	m_lock.lock();
+	/* a directory of broken files compacts a few times, not once per file */
+	if (m_ndead > 0 && (m_ndead >= std::min(m_playlist->count / 16, COMPACT_BATCH) ||
+			Time::MS() - m_lastcompact >= COMPACT_MS))
+		compact();
+	if (m_playlist->count == 0) {
+		m_lock.unlock();
+		return;
+	}
+
+	updateDepth();
+	if (evict())
+		m_pipeline.reprioritize(*this);
+	if (m_scrubbing) {
+		m_lock.unlock();
+		return;
+	}
+
+	for (int p = 0, ahead = m_index, behind = m_index; p <= 2 * m_maxdepth; ++p) {
+		int index;
+
+		if (p == 0)
+			index = m_index;
+		else if (p & 1)
+			index = ahead = neighbour(ahead, m_dir);
+		else
+			index = behind = neighbour(behind, -m_dir);
+
+		if (priority(index) < 0 || findEntry(index) != NULL ||
+				m_playlist->isDead(index) || copyLoading(index))
+			continue;
+		if (!request(index))
+			break;
+	}
+	m_lock.unlock();
+}
+
+/*
+ * Sleeps until something changes: the cursor moved, the playlist or the
+ * deadline changed, the pipeline finished a job, the dates asked for by
+ * dateSort() are all in, or copies to skip turned up.  The only timed
+ * wakeups are for sampling memory pressure while images are held, and
+ * for compacting away images that failed to load.
+ */
+void ImageManager::run(void)
+{
+	std::vector<uint32_t> copies, restored;
+	LoadPipeline::Job *job;
+	unsigned int key;
+
+	Sched::setName("loader");
+	Sched::enterBackground();
+
+	for (;;) {
+		key = m_wake.prepare();
+		if (__atomic_load_n(&m_started, __ATOMIC_ACQUIRE) ||
+				__atomic_load_n(&m_quit, __ATOMIC_ACQUIRE))
+			break;
+		m_wake.wait(key);
+	}
+
+	while (!__atomic_load_n(&m_quit, __ATOMIC_ACQUIRE)) {
+		/* anything notified from here on is picked up next time round */
+		key = m_wake.prepare();
+
+		updatePressure();
+		while ((job = m_pipeline.collect()) != NULL)
+			finish(job);
+		schedule();
+
+		/* what dateSort() didn't know before is in */
+		if (m_dates->collect()) {
+			dateSort();
+			if (m_meta != NULL)
+				m_meta->save();
+		}
+
+		copies.clear();
+		restored.clear();
+		if (m_dedup != NULL && m_dedup->collect(copies, restored) && m_skipcopies)
+			skipCopies(copies, restored);
+
+		if (m_ndead > 0)
+			m_wake.wait(key, COMPACT_MS);
+		else
+			m_wake.wait(key, m_windowsize > 0 ? PRESSURE_POLL_MS : -1);
+	}
+
+	/* every job ends up collectable, which m_wake is notified of */
+	while (m_pipeline.inflight() > 0) {
+		key = m_wake.prepare();
+		job = m_pipeline.collect();
+		if (job == NULL) {
+			m_wake.wait(key);
+			continue;
+		}
+		if (job->image != NULL)
+			m_loader.unloadImage(job->image);
+		delete job;
+	}
+	for (int i = 0; i < m_windowsize; ++i) {
+		if (m_window[i].image != NULL)
+			m_loader.unloadImage(m_window[i].image);
+	}
+	m_windowsize = 0;
+}
+
+Image *ImageManager::cacheDir(int dir)
+{
+	Image *ret = NULL;
+	Entry *entry;
+	int target;
+
+	m_lock.lock();
+	if (m_playlist->count == 0) {
+		m_lock.unlock();
+		return NULL;
+	}
+
+	target = dir == 0 ? m_index : neighbour(m_index, dir);
+	entry = findEntry(target);
+	if (entry != NULL)
+		ret = entry->image;
+	if (ret != NULL)
+		m_loader.acquire(ret);
+
+	if (dir != 0 && (ret != NULL || dir != m_dir)) {
+		if (ret != NULL)
+			__atomic_store_n(&m_index, target, __ATOMIC_RELAXED);
+		m_dir = dir;
+		/* what the user will see next now goes to the front of every queue */
+		evict();
+		m_pipeline.reprioritize(*this);
+		m_wake.notify();
+	}
 	m_lock.unlock();
 
 	return ret;
@@ -1,62 +1,269 @@
 #pragma once
 
+#include <vector>
 #include "gre.h"
 #include "thread.h"
 #include "imageloader.h"
+#include "loadpipeline.h"
+#include "memorymonitor.h"
+#include "patharena.h"
+#include "pathsort.h"
+#include "datesort.h"
+#include "dedup.h"
+#include "searchindex.h"
+#include "shuffle.h"
 
-class ImageManager : public Runnable {
+class ImageManager : public Runnable, public LoadPipeline::Ranker {
 public:
 	ImageManager(GRE &gre);
 	~ImageManager();
 
 	void start(void);
+	/* makes the random orders below repeatable, independent of load order */
+	void setSeed(uint64_t seed);
 	void randomOffset(void);
 	void randomSort(void);
+	/*
+	 * Visits the playlist in a random order without rearranging it:
+	 * each position is mapped through a Permutation on the fly, so
+	 * this costs no memory or time with the size of the playlist.
+	 * Images added later are mixed in with what is ahead of the
+	 * cursor, which is shuffled again; what is behind keeps its order.
+	 */
+	void randomPermutation(void);
 	void logicalSort(void);
 	void directorySort(void);
+	/*
+	 * Orders the playlist by when images were taken, as far as that is
+	 * known, and by name otherwise.  Dates not known yet are read in
+	 * the background, and the playlist is sorted again once they are.
+	 */
+	void dateSort(void);
+	/* queues an image; nothing shows up in the playlist until commit() */
 	void append(const char *image);
+	/*
+	 * Queues every non-empty entry of list[0, len), each ended by
+	 * separator (the last one may not be), taking the locks per batch
+	 * rather than per image.
+	 */
+	void appendList(const char *list, size_t len, char separator);
+	/*
+	 * Changes to what is listed already, also held until commit():
+	 * removePath() drops path, or everything below it if it is a
+	 * directory.  renamePath() renames entries in place, replacing any
+	 * listed under the new name.  refreshPath() reloads path if it is
+	 * listed and appends it otherwise.
+	 */
+	void removePath(const char *path, bool dir);
+	void renamePath(const char *from, const char *to);
+	void refreshPath(const char *path);
+	void commit(void);
+	int  enableSharedCache(unsigned int megabytes);
+	/* remembers what is learnt about files across runs; before any append() */
+	int  enableIndex(void);
+	MetaIndex *metaIndex(void) const;
+	/* indexes names in the background, for find(); before any append() */
+	void enableSearch(void);
+	/*
+	 * Hashes what is listed in the background, so that files with the
+	 * same content are loaded once and shared, or, with skip, only the
+	 * first of them is shown at all.  Before any append().
+	 */
+	void enableDedup(bool skip);
+	/*
+	 * The position of the next image after the cursor whose file name
+	 * contains text, ignoring ASCII case, or -1.  Rare text is found
+	 * through the index, common text by looking around the cursor.
+	 */
+	int  find(const char *text);
 	int currentImage(void) const;
-	int imageCount(void) const;
+	int imageCount(void);
 	void currentImageName(char *buf, int len);
+	/* changes whenever the playlist does */
+	unsigned int playlistVersion(void);
 
 	GRE::Texture *reload(void);
 	GRE::Texture *next(void);
 	GRE::Texture *prev(void);
+	/* decode: make one from the file when there is no thumbnail */
+	GRE::Texture *preview(int dir, bool decode);
+
+	/*
+	 * Moves the cursor straight to index.  Returns its texture if the
+	 * image is loaded, NULL otherwise; reload() picks it up once it is.
+	 * scrub() does the same without returning anything, and holds off
+	 * all loading until the next seek() says where the cursor came to
+	 * rest.
+	 */
+	GRE::Texture *seek(int index);
+	void scrub(int index);
+	void enableThumbnails(bool enabled);
+
+	/* when the slideshow will next advance (Time::MS(), 0 if it won't) */
+	void setDeadline(Timestamp deadline, Timestamp interval);
+
+	/* readable once a load has finished since it was last read */
+	int  readyFd(void) const;
+	void clearReady(void);
 
 	int getLoadCount(void) const;
+	void loaderStatus(char *buf, int len) const;
+	bool hasPrevious(void) const;
 
-	class String {
-	public:
-		String(const String &str);
-		String(const char *str);
-		String();
-		~String();
-		char *getText(void);
-		const char *getText(void) const;
-
-	private:
-		char *m_text;
-	};
 private:
+	/*
+	 * The playlist is replaced as a whole, never modified in place, so
+	 * readers only need to stay in m_epoch while they look at it.  It
+	 * is replaced with m_lock held, and code holding m_lock can use
+	 * m_playlist directly.  Entries are ids in m_paths, which only
+	 * ever grows.  Positions, like m_index, count in the order images
+	 * are visited, which order maps to where they are in images.
+	 * Images that failed to load stay in place, marked in dead (by
+	 * where they are in images), until compact() drops them; only
+	 * m_lock holders look at it.
+	 */
+	struct Playlist {
+		unsigned int version;
+		int          count;
+		uint32_t    *images;
+		uint32_t    *dead;
+		Permutation  order;
+
+		uint32_t at(int index) const
+		{
+			return images[order.at(index)];
+		}
+
+		bool isDead(int index) const
+		{
+			uint32_t i;
+
+			if (dead == NULL)
+				return false;
+			i = order.at(index);
+			return dead[i / 32] >> (i % 32) & 1;
+		}
+	};
+
+	/* a queued removePath(), renamePath() or refreshPath() */
+	struct Change {
+		enum {
+			Remove,
+			RemoveDir,
+			Rename,
+			Refresh,
+		};
+
+		int         type;
+		char       *path;
+		char       *target;
+		uint32_t    id;       /* of target */
+		/* resolved by commit(); dir is PathArena::None if never listed */
+		uint32_t    dir;
+		const char *name;
+		uint32_t    targetdir;
+		const char *targetname;
+		bool        matched;
+	};
+
+	/* an image around the cursor, loaded or on its way */
+	struct Entry {
+		int                index;
+		uint32_t           path;
+		Image             *image;
+		LoadPipeline::Job *job;
+		bool               reduced;
+	};
+
+	static Playlist *newPlaylist(int count);
+	static void freePlaylist(void *playlist);
+	Playlist *snapshot(void);
+	void publish(Playlist *playlist, int kept);
+	void locate(const Playlist *playlist, int from);
+	void follow(const Playlist *playlist);
+	void queueChange(int type, const char *path, const char *target);
+	void resolve(Change &change);
+	void applyChanges(std::vector<Change> &changes, const std::vector<uint32_t> &pending,
+			Playlist *playlist, int &current, std::vector<uint32_t> &seen);
+	void visited(const Playlist *playlist, std::vector<uint32_t> &seen);
+	Permutation reshuffle(const Playlist *old, const Playlist *n,
+			std::vector<uint32_t> &seen, int current);
+	void toImages(const Playlist *playlist);
+	void fromImages(const Playlist *playlist);
+	bool releaseEntry(Entry *entry);
+
 	GRE::Texture *index(int dir);
+	GRE::Texture *upload(Image *image);
+	bool moveTo(int index);
 	void run(void);
 
+	/* the caller unloads what it returns */
 	Image *cacheDir(int dir);
+	void updatePressure(void);
+	void updateDepth(void);
+	void schedule(void);
+	bool request(int index);
+	void finish(LoadPipeline::Job *job);
+	bool evict(void);
+	void bury(int index);
+	void hide(int index);
+	void skipCopies(const std::vector<uint32_t> &copies,
+			const std::vector<uint32_t> &restored);
+	bool copyLoading(int index);
+	void compact(void);
+	int  neighbour(int index, int dir) const;
+	int  priority(int index) const;
+	int  rank(const LoadPipeline::Job *job);
+	int  nearest(const std::vector<uint32_t> &ids);
+	Entry *findEntry(int index);
+	Entry *findJob(const LoadPipeline::Job *job);
+	void dropEntry(Entry *entry);
 
-	Semaphore      m_sem;
+	EventCount     m_wake;
+	int            m_readyfd;
 	Mutex          m_lock;
-	WaitQ<Image *> m_cache[2];
+	EpochDomain    m_epoch;
+	Mutex          m_pendinglock;
+	PathArena      m_paths;   /* written with m_pendinglock held */
+	PathSorter     m_sorter;  /* used with m_lock held */
+	DateSorter    *m_dates;
+	Deduplicator  *m_dedup;
+	std::vector<uint32_t> m_pending;
+	std::vector<Change>   m_changes;
+	Entry         *m_window;
+	int            m_windowsize;
 	GRE::Texture  *m_texture;
 	GRE::Texture  *m_previous;
-	Image         *m_current;
+	GRE::Texture  *m_preview;
+	MetaIndex     *m_meta;
+	SearchIndex   *m_search;
+	uint32_t       m_searchable;   /* ids in m_paths as of the last commit() */
+	std::vector<uint32_t> m_where; /* where ids are in m_playlist->images */
 	ImageLoader    m_loader;
+	LoadPipeline   m_pipeline;
+	MemoryMonitor  m_memory;
 
 	GRE      &m_gre;
-	String  **m_images;
-	int       m_size;
-	int       m_count;
-	int       m_index;
-	Thread    m_thread;
+	Playlist *m_playlist;
+	int       m_index;   /* moves under m_lock, read without it by the GUI */
+	Random    m_random;
+	bool      m_seeded;
+	int       m_dir;
+	Thread   *m_thread;
 	int       m_loadcount;
+	int       m_ahead;
+	int       m_behind;
+	int       m_limit;
+	int       m_maxdepth;
+	Timestamp m_deadline;
+	Timestamp m_interval;
+	Timestamp m_lastcompact;
+	int       m_ndead;      /* marked in m_playlist->dead */
+	double    m_fetchms;
+	double    m_decodems;
+	bool      m_lowmem;
 	bool      m_started;
+	bool      m_quit;
+	bool      m_scrubbing;
+	bool      m_skipcopies;
 };
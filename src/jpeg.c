@@ -89,7 +89,7 @@ static void ljpg_error_exit(j_common_ptr cinfo)
   //jpeg_destroy(cinfo);
 }
 
-static decjpeg_t *jpeg_decode(void *indata,unsigned int indatasize) {
+static decjpeg_t *jpeg_decode(void *indata,unsigned int indatasize,unsigned int mindim) {
   struct jpeg_decompress_struct cinfo;
   struct jpeg_error_mgr         jerr;
   int     w,h;
@@ -110,6 +110,19 @@ static decjpeg_t *jpeg_decode(void *indata,unsigned int indatasize) {
   /* Ask for a pre-defined color format */
   cinfo.out_color_space = JCS_RGB;
 
+  /* Let the IDCT downscale, keeping the longer edge at least mindim */
+  if (mindim != 0) {
+    unsigned int edge = cinfo.image_width > cinfo.image_height ?
+      cinfo.image_width : cinfo.image_height;
+    unsigned int denom = 8;
+
+    while (denom > 1 && edge / denom < mindim)
+      denom >>= 1;
+    cinfo.scale_num   = 1;
+    cinfo.scale_denom = denom;
+    cinfo.dct_method  = JDCT_IFAST;
+  }
+
   jpeg_start_decompress(&cinfo);
   if (cinfo.client_data == NULL) {
     jpeg_destroy_decompress(&cinfo);
@@ -149,7 +162,24 @@ static decjpeg_t *jpeg_decode(void *indata,unsigned int indatasize) {
 int LoadJPEG(void *pRaw, int rawlen, unsigned int *puWidth, unsigned int *puHeight, void **ppData) {
   decjpeg_t *pJPEG;
 
-  pJPEG = jpeg_decode(pRaw,rawlen);
+  pJPEG = jpeg_decode(pRaw,rawlen,0);
+
+  if( pJPEG == NULL )
+    return -1;
+
+  *puWidth  = pJPEG->width;
+  *puHeight = pJPEG->height;
+  *ppData   = pJPEG->pData;
+
+  free(pJPEG);
+
+  return 0;
+}
+
+int LoadJPEGScaled(void *pRaw, int rawlen, unsigned int uMinDim, unsigned int *puWidth, unsigned int *puHeight, void **ppData) {
+  decjpeg_t *pJPEG;
+
+  pJPEG = jpeg_decode(pRaw,rawlen,uMinDim);
 
   if( pJPEG == NULL )
     return -1;
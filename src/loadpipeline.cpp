@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <algorithm>
+
+#include "loadpipeline.h"
+
+#define IO_THREADS 4
+
+/*
+ * Wakes a destructor waiting for the pipeline to go quiet.  Not a member:
+ * the last runner out signals it after the pipeline may be gone.
+ */
+static EventCount pipeline_quiet;
+
+/* heap order: lowest priority value first, then first come first served */
+static bool later(const LoadPipeline::Job *a, const LoadPipeline::Job *b)
+{
+	if (a->priority != b->priority)
+		return a->priority > b->priority;
+	return (int)(a->seq - b->seq) > 0;
+}
+
+class LoadPipeline::Runner : public Task {
+public:
+	Runner(LoadPipeline *pipeline, Stage stage)
+	 : m_pipeline(pipeline), m_stage(stage)
+	{ }
+
+	void run(void)
+	{
+		m_pipeline->drain(m_stage);
+	}
+
+private:
+	LoadPipeline *m_pipeline;
+	Stage         m_stage;
+};
+
+LoadPipeline::LoadPipeline(ImageLoader &loader, int capacity)
+ : m_loader(loader), m_io(IO_THREADS, "fetch"), m_ready(capacity), m_notify(NULL), m_seq(0),
+   m_capacity(capacity), m_inflight(0), m_active(0)
+{
+	ThreadPool &cpu = ThreadPool::shared();
+
+	for (int i = 0; i < Ready; ++i) {
+		m_stages[i].heap.reserve(capacity);
+		m_stages[i].count = 0;
+		m_stages[i].pool = &cpu;
+		m_stages[i].running = 0;
+		m_stages[i].limit = cpu.size();
+	}
+	m_stages[Fetch].pool = &m_io;
+	m_stages[Fetch].limit = m_io.size();
+	/* sniffing is a few compares; one runner keeps up with anything */
+	m_stages[Sniff].limit = 1;
+}
+
+LoadPipeline::~LoadPipeline()
+{
+	unsigned int key;
+	Job *job;
+
+	/* runners hold pointers to us; let everything in flight finish */
+	for (;;) {
+		key = pipeline_quiet.prepare();
+		while ((job = collect()) != NULL) {
+			if (job->image != NULL)
+				m_loader.unloadImage(job->image);
+			delete job;
+		}
+		if (inflight() == 0 && __atomic_load_n(&m_active, __ATOMIC_ACQUIRE) == 0)
+			break;
+		pipeline_quiet.wait(key);
+	}
+}
+
+const char *LoadPipeline::stageName(Stage stage)
+{
+	switch (stage) {
+	case Fetch:
+		return "fetch";
+	case Sniff:
+		return "sniff";
+	case Decode:
+		return "decode";
+	case Scale:
+		return "scale";
+	case Ready:
+		return "ready";
+	default:
+		break;
+	}
+	return "unknown";
+}
+
+void LoadPipeline::setParallelism(Stage stage, int count)
+{
+	Queue &q = m_stages[stage];
+	int spawn = 0;
+
+	if (count < 1)
+		count = 1;
+	if (count > q.pool->size())
+		count = q.pool->size();
+
+	q.lock.lock();
+	q.limit = count;
+	/* put the extra capacity to work on what is already queued */
+	while (q.running < q.limit && spawn < (int)q.heap.size()) {
+		q.running++;
+		spawn++;
+	}
+	q.lock.unlock();
+
+	while (spawn-- > 0) {
+		__atomic_add_fetch(&m_active, 1, __ATOMIC_ACQ_REL);
+		q.pool->submit(new Runner(this, stage), true);
+	}
+}
+
+int LoadPipeline::parallelism(Stage stage) const
+{
+	return m_stages[stage].limit;
+}
+
+int LoadPipeline::depth(Stage stage) const
+{
+	if (stage == Ready)
+		return m_ready.count();
+	return __atomic_load_n(&m_stages[stage].count, __ATOMIC_RELAXED);
+}
+
+int LoadPipeline::inflight(void) const
+{
+	return __atomic_load_n(&m_inflight, __ATOMIC_ACQUIRE);
+}
+
+int LoadPipeline::capacity(void) const
+{
+	return m_capacity;
+}
+
+void LoadPipeline::status(char *buf, int len) const
+{
+	int n = 0;
+
+	buf[0] = 0;
+	for (int i = 0; i < StageCount && n < len; ++i) {
+		n += snprintf(buf + n, len - n, "%s%s %d", i ? " " : "",
+				stageName((Stage)i), depth((Stage)i));
+	}
+}
+
+bool LoadPipeline::submit(Job *job)
+{
+	int n = __atomic_load_n(&m_inflight, __ATOMIC_RELAXED);
+
+	do {
+		if (n >= m_capacity)
+			return false;
+	} while (!__atomic_compare_exchange_n(&m_inflight, &n, n + 1,
+			false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	job->image = NULL;
+	job->cancelled = false;
+	job->seq = __atomic_fetch_add(&m_seq, 1, __ATOMIC_RELAXED);
+	job->submitted = Time::monotonicMS();
+	enqueue(Fetch, job);
+
+	return true;
+}
+
+LoadPipeline::Job *LoadPipeline::collect(void)
+{
+	Job *job;
+
+	if (!m_ready.tryPop(job))
+		return NULL;
+	__atomic_sub_fetch(&m_inflight, 1, __ATOMIC_ACQ_REL);
+
+	return job;
+}
+
+void LoadPipeline::reprioritize(Ranker &ranker)
+{
+	std::vector<Job *> cancelled;
+
+	for (int i = 0; i < Ready; ++i) {
+		Queue &q = m_stages[i];
+		unsigned int n = 0;
+
+		q.lock.lock();
+		for (unsigned int j = 0; j < q.heap.size(); ++j) {
+			Job *job = q.heap[j];
+			int priority = ranker.rank(job);
+
+			if (priority < 0) {
+				cancelled.push_back(job);
+				continue;
+			}
+			job->priority = priority;
+			q.heap[n++] = job;
+		}
+		q.heap.resize(n);
+		std::make_heap(q.heap.begin(), q.heap.end(), later);
+		__atomic_store_n(&q.count, n, __ATOMIC_RELAXED);
+		q.lock.unlock();
+	}
+
+	for (unsigned int i = 0; i < cancelled.size(); ++i)
+		cancel(cancelled[i]);
+}
+
+void LoadPipeline::setNotify(EventCount *notify)
+{
+	m_notify = notify;
+}
+
+void LoadPipeline::cancel(Job *job)
+{
+	/* fetch may already have taken a reference to a resident image */
+	if (job->request.image != NULL) {
+		m_loader.unloadImage(job->request.image);
+		job->request.image = NULL;
+	}
+	job->cancelled = true;
+	enqueue(Ready, job);
+}
+
+void LoadPipeline::enqueue(Stage stage, Job *job)
+{
+	bool spawn = false;
+
+	/* never blocks: no stage can hold more than m_capacity jobs */
+	if (stage == Ready) {
+		job->finished = Time::monotonicMS();
+		m_ready.push(job);
+		if (m_notify != NULL)
+			m_notify->notify();
+		pipeline_quiet.notifyAll();
+		return;
+	}
+
+	Queue &q = m_stages[stage];
+
+	q.lock.lock();
+	q.heap.push_back(job);
+	std::push_heap(q.heap.begin(), q.heap.end(), later);
+	__atomic_store_n(&q.count, (int)q.heap.size(), __ATOMIC_RELAXED);
+	if (q.running < q.limit) {
+		q.running++;
+		spawn = true;
+	}
+	q.lock.unlock();
+
+	if (spawn) {
+		__atomic_add_fetch(&m_active, 1, __ATOMIC_ACQ_REL);
+		q.pool->submit(new Runner(this, stage), true);
+	}
+}
+
+LoadPipeline::Job *LoadPipeline::pop(Queue &q)
+{
+	Job *job;
+
+	std::pop_heap(q.heap.begin(), q.heap.end(), later);
+	job = q.heap.back();
+	q.heap.pop_back();
+	__atomic_store_n(&q.count, (int)q.heap.size(), __ATOMIC_RELAXED);
+
+	return job;
+}
+
+void LoadPipeline::drain(Stage stage)
+{
+	Queue &own = m_stages[stage];
+	Timestamp start;
+	Stage at;
+	Job *job;
+
+	for (;;) {
+		job = NULL;
+
+		/*
+		 * Push work that is further along through first.  Its own
+		 * runner may be stuck behind us in the pool; helping out
+		 * can briefly exceed that stage's parallelism.
+		 */
+		for (int s = Scale; s > stage && job == NULL; --s) {
+			Queue &q = m_stages[s];
+
+			if (q.pool != own.pool)
+				continue;
+			q.lock.lock();
+			if (!q.heap.empty()) {
+				job = pop(q);
+				at = (Stage)s;
+			}
+			q.lock.unlock();
+		}
+
+		if (job == NULL) {
+			own.lock.lock();
+			if (own.heap.empty() || own.running > own.limit) {
+				own.running--;
+				own.lock.unlock();
+				break;
+			}
+			job = pop(own);
+			at = stage;
+			own.lock.unlock();
+		}
+
+		start = Time::monotonicMS();
+		if (process(at, job)) {
+			job->elapsed[at] = Time::monotonicMS() - start;
+			enqueue((Stage)(at + 1), job);
+		} else {
+			job->elapsed[at] = Time::monotonicMS() - start;
+			enqueue(Ready, job);
+		}
+	}
+
+	if (__atomic_sub_fetch(&m_active, 1, __ATOMIC_ACQ_REL) == 0)
+		pipeline_quiet.notifyAll();
+}
+
+bool LoadPipeline::process(Stage stage, Job *job)
+{
+	LoadRequest &req = job->request;
+
+	switch (stage) {
+	case Fetch:
+		return m_loader.fetch(req);
+	case Sniff:
+		return m_loader.sniff(req);
+	case Decode:
+		return m_loader.decode(req);
+	case Scale:
+		if (!m_loader.scale(req))
+			return false;
+		job->image = m_loader.publish(req);
+		return true;
+	default:
+		break;
+	}
+
+	return false;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <vector>
+#include "thread.h"
+#include "imageloader.h"
+
+/*
+ * Runs ImageLoader's steps as separate stages connected by bounded
+ * queues.  Fetching is I/O bound and gets its own pool, so a slow
+ * download can't hold up decoding; the remaining stages run on the
+ * shared CPU pool.  At most capacity() jobs are in flight, which is
+ * also the size of each stage queue, so handing a job to the next
+ * stage never blocks.  Every stage runs its most urgent job (lowest
+ * priority value) first.
+ */
+class LoadPipeline {
+public:
+	enum Stage {
+		Fetch,
+		Sniff,
+		Decode,
+		Scale,
+		Ready,
+		StageCount,
+	};
+
+	struct Job {
+		Job(const char *path)
+		 : request(path), image(NULL), cancelled(false), index(-1),
+		   priority(0), cookie(NULL), seq(0), submitted(0), finished(0)
+		{
+			for (int i = 0; i < Ready; ++i)
+				elapsed[i] = 0;
+		}
+
+		LoadRequest request;
+		Image      *image;   /* NULL if the image could not be loaded */
+		bool        cancelled;
+
+		/* owned by the submitter */
+		int         index;
+		int         priority;
+		const void *cookie;
+
+		/* set by the pipeline; times are Time::monotonicMS() */
+		unsigned int seq;
+		Timestamp    submitted;
+		Timestamp    finished;
+		Timestamp    elapsed[Ready];   /* time spent in each stage */
+	};
+
+	class Ranker {
+	public:
+		virtual ~Ranker() { }
+		/* new priority for a queued job; negative cancels it */
+		virtual int rank(const Job *job) = 0;
+	};
+
+	LoadPipeline(ImageLoader &loader, int capacity = 16);
+	~LoadPipeline();
+
+	/* takes ownership of job; returns false if the pipeline is full */
+	bool submit(Job *job);
+	/* returns a finished (or cancelled) job, or NULL */
+	Job *collect(void);
+	/* re-ranks every job that is still waiting for a stage */
+	void reprioritize(Ranker &ranker);
+	/* notified whenever a job becomes ready to collect */
+	void setNotify(EventCount *notify);
+
+	/* how many jobs a stage may work on at once (1 to its pool size) */
+	void setParallelism(Stage stage, int count);
+	int  parallelism(Stage stage) const;
+
+	int depth(Stage stage) const;
+	int inflight(void) const;
+	int capacity(void) const;
+	/* "fetch 1 sniff 0 ..." */
+	void status(char *buf, int len) const;
+
+	static const char *stageName(Stage stage);
+
+private:
+	class Runner;
+	struct Queue {
+		Mutex              lock;
+		std::vector<Job *> heap;
+		int                count;
+		ThreadPool        *pool;
+		int                running;
+		int                limit;
+	};
+
+	Job *pop(Queue &q);
+	void enqueue(Stage stage, Job *job);
+	void drain(Stage stage);
+	bool process(Stage stage, Job *job);
+	void cancel(Job *job);
+
+	ImageLoader      &m_loader;
+	ThreadPool        m_io;
+	Queue             m_stages[Ready];
+	RingQueue<Job *>  m_ready;
+	EventCount       *m_notify;
+	unsigned int      m_seq;
+	int               m_capacity;
+	int               m_inflight;
+	int               m_active;
+};
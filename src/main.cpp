@@ -2,13 +2,18 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <dirent.h>
 #include <time.h>
 #include <sys/time.h>
-#include <sys/stat.h>
 #include <getopt.h>
 #include <termios.h>
 #include <poll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string>
 
 #include "gui.h"
 #include "thread.h"
@@ -17,6 +22,12 @@ extern "C" {
 }
 
 #define VERSION "0.1"
+/* navigation pause after which a scrub is over and the image loads */
+#define SCRUB_SETTLE_MS 150
+/* input polling interval for backends that can't be waited on */
+#define INPUT_POLL_MS   10
+/* file lists that can't be mapped are read this much at a time */
+#define LIST_CHUNK      (1 << 20)
 
 static void version(const char *name)
 {
@@ -30,16 +41,30 @@ static void usage(const char *name)
 "Display images\n"
 "  -F, --fullscreen     operate in fullscreen mode\n"
 "  -z, --random         randomize files\n"
+"  -Z, --permute        visit files in a random order, computed on the fly\n"
+"  -R, --seed <n>       make random orders repeatable\n"
 "  -s, --sort           sort files\n"
 "  -d, --randir         randomize directories, sort files\n"
+"  -t, --sort-date      sort files by when they were taken (EXIF)\n"
 "  -r, --recurse        recurse directories\n"
-"  -l, --listen <port>  open tcp socket on <port> for adding more files\n"
+"  -w, --watch          recurse directories and follow changes to them\n"
+"  -l, --listen <port>  open tcp socket on <port> for adding more files,\n"
+"                       or for lines of ?<text> to jump to a file by name\n"
 "  -o, --offset         start at random offset\n"
 "  -n, --nofilter       disable filtering by default\n"
+"  -N, --nothumbs       don't use or update the shared thumbnail cache\n"
+"  -I, --noindex        don't use or update the index of known files\n"
+"  -Q, --nosearch       don't index file names for jumping to them\n"
+"  -u, --dedup          load files with the same content once\n"
+"  -U, --skip-copies    show only the first of files with the same content\n"
 "  -S, --stdin          listen on STDIN for key input\n"
-"  -f, --filelist <lst> read file names from list (one file per line)\n"
+"  -f, --filelist <lst> read file names from list (one file per line, - for stdin)\n"
 "  -D, --delay <time>   delay before automatically switching pictures\n"
 "  -a, --fade  <time>   amount of time to dedicate to fading between pictures\n"
+"  -C, --shared-cache <MiB>  share decoded images with other instances, in\n"
+"                       memory until the last of them exits\n"
+"  -P, --loader-priority <idle|batch|nice>  scheduling of background loading\n"
+"  -A, --loader-cpus <list>  run background loading on these CPUs (e.g. 2-3)\n"
 "  -v, --version        output version information and exit\n"
 "  -h, --help           display this help and exit\n"
 "      in-app key support: \n"
@@ -48,10 +73,14 @@ static void usage(const char *name)
 "          alt-enter -  toggle fullscreen\n"
 "          F         -  toggle filtering\n"
 "          d         -  toggle text display\n"
+"          i         -  show loader queue depths\n"
 "          mwheel-up -  prev image\n"
 "          mwheel-dn -  next image\n"
 "          left      -  prev image\n"
 "          right     -  next image\n"
+"          home      -  first image\n"
+"          end       -  last image\n"
+"          /         -  jump to a file by name (-S only)\n"
 "          return    -  next image\n"
 "          spacebar  -  next image\n"
 "          esc       -  quit\n"
@@ -62,9 +91,12 @@ static void usage(const char *name)
 
 struct CharBuffer {
 public:
-	CharBuffer() : read(0),write(0) { }
+	CharBuffer() : count(0),read(0),write(0) { }
 	void push(char ch)
 	{
+		/* typed faster than it's taken; drop it */
+		if (write == (int)sizeof(buf))
+			return;
 		buf[write++] = ch;
 		count++;
 	}
@@ -75,8 +107,11 @@ public:
 	}
 	char pop(void)
 	{
-		count--;
-		return buf[read++];
+		char ch = buf[read++];
+
+		if (--count == 0)
+			read = write = 0;
+		return ch;
 	}
 
 	int size(void) const
@@ -117,7 +152,7 @@ private:
 
 class CLI {
 public:
-	CLI() : m_tty(NULL), m_buffer(NULL), m_enabled(false) { }
+	CLI() : m_tty(NULL), m_buffer(NULL), m_enabled(false), m_typing(false) { }
 	~CLI()
 	{
 		if (m_tty != NULL) delete m_tty;
@@ -134,12 +169,53 @@ public:
 
 	int pollEvent(GRE::Event &ev);
 
+	int fd(void) const
+	{ return m_enabled ? STDIN_FILENO : -1; }
+
+	/* what was typed after a '/', once a Search event says it's done */
+	const char *query(void) const
+	{ return m_query.c_str(); }
+
 private:
+	bool type(char ch);
+
 	TTY *m_tty;
 	CharBuffer *m_buffer;
 	bool m_enabled;
+	bool m_typing;
+	std::string m_query;
 };
 
+/* a key typed into a query; true once there is one to run */
+bool CLI::type(char ch)
+{
+	switch (ch) {
+	case 0xd:
+	case '\n':
+		m_typing = false;
+		fputc('\n', stderr);
+		return !m_query.empty();
+	case 0x1b:
+		m_typing = false;
+		m_query.clear();
+		fputc('\n', stderr);
+		return false;
+	case 0x7f:
+	case 0x8:
+		if (!m_query.empty()) {
+			m_query.erase(m_query.size() - 1);
+			fputs("\b \b", stderr);
+		}
+		return false;
+	default:
+		if ((unsigned char)ch >= 0x20) {
+			m_query += ch;
+			fputc(ch, stderr);
+		}
+		return false;
+	}
+}
+
 
 int CLI::pollEvent(GRE::Event &ev)
 {
@@ -181,8 +257,16 @@ int CLI::pollEvent(GRE::Event &ev)
 	} while (r > 0);
 
 	while (m_buffer->size()) {
+		ch = m_buffer->pop();
+		if (m_typing) {
+			if ((food = type(ch))) {
+				ev.type = GRE::Event::Search;
+				break;
+			}
+			continue;
+		}
 		food = true;
-		switch ((ch = m_buffer->pop())) {
+		switch (ch) {
 		case 0xd:
 		case 0x20:
 			ev.type = GRE::Event::Next;
@@ -196,9 +280,18 @@ int CLI::pollEvent(GRE::Event &ev)
 		case 'F':
 			ev.type = GRE::Event::FilterToggle;
 			break;
+		case 'i':
+			ev.type = GRE::Event::LoaderStatus;
+			break;
 		case 'f':
 			ev.type = GRE::Event::FullscreenToggle;
 			break;
+		case '/':
+			m_typing = true;
+			m_query.clear();
+			fputc('/', stderr);
+			food = false;
+			break;
 		case 0x1b:
 			if (m_buffer->size() < 2) {
 				ev.type = GRE::Event::Quit;
@@ -214,6 +307,16 @@ int CLI::pollEvent(GRE::Event &ev)
 				m_buffer->pop(), m_buffer->pop();
 				break;
 			}
+			if (!memcmp(m_buffer->peek(), "[H", 2)) {
+				ev.type = GRE::Event::First;
+				m_buffer->pop(), m_buffer->pop();
+				break;
+			}
+			if (!memcmp(m_buffer->peek(), "[F", 2)) {
+				ev.type = GRE::Event::Last;
+				m_buffer->pop(), m_buffer->pop();
+				break;
+			}
 			food = false;
 			break;
 		default:
@@ -228,121 +331,249 @@ int CLI::pollEvent(GRE::Event &ev)
 }
 
 
-static int addImage(GUI &gui, const char *name, bool recurse)
+static void addImage(GUI &gui, const char *name, bool recurse)
 {
-	struct stat st;
-	DIR *dir;
+	if (recurse)
+		gui.scanImages(name);
+	else
+		gui.addImage(name);
+}
+
+/* the lines of list[0, len): all in one go, or one by one to be walked */
+static void addList(GUI &gui, const char *list, size_t len, bool recurse)
+{
+	const char *end = list + len;
+	char line[4096];
 
 	if (!recurse) {
-		gui.addImage(name);
-		return 0;
+		gui.addImages(list, len, '\n');
+		return;
+	}
+	for (const char *p = list; p < end; ) {
+		const char *eol = (const char *)memchr(p, '\n', end - p);
+
+		if (eol == NULL)
+			eol = end;
+		if (eol > p && eol - p < (int)sizeof(line)) {
+			memcpy(line, p, eol - p);
+			line[eol - p] = 0;
+			addImage(gui, line, true);
+		}
+		p = eol + 1;
 	}
+}
+
+/* a file list, or stdin for "-"; regular files are mapped, not read */
+static int readList(GUI &gui, const char *path, bool recurse)
+{
+	bool skip = false;
+	struct stat st;
+	size_t len = 0;
+	ssize_t n = 0;
+	char *buf;
+	int fd;
 
-	if (stat(name, &st)) {
-		perror(name);
+	fd = strcmp(path, "-") ? open(path, O_RDONLY | O_CLOEXEC) : 0;
+	if (fd == -1)
 		return -1;
-	}
 
-	if (!S_ISDIR(st.st_mode)) {
-		gui.addImage(name);
-		return 0;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			addList(gui, (const char *)map, st.st_size, recurse);
+			munmap(map, st.st_size);
+			if (fd != 0)
+				close(fd);
+			return 0;
+		}
 	}
 
-	dir = opendir(name);
-	if (dir == NULL) {
-		perror(name);
+	/* pipes and the like: whole lines at a time, the rest waits for more */
+	buf = (char *)malloc(LIST_CHUNK);
+	if (buf == NULL) {
+		if (fd != 0)
+			close(fd);
 		return -1;
 	}
+	for (;;) {
+		const char *eol;
 
-	struct dirent *d;
-	char newname[4096];
-	int index;
-
-	index = snprintf(newname, sizeof(newname), "%s", name);
-
-	while ((d = readdir(dir)) != 0) {
-		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+		n = read(fd, buf + len, LIST_CHUNK - len);
+		if (n < 0 && errno == EINTR)
 			continue;
-
-		snprintf(newname + index, sizeof(newname) - index, "/%s", d->d_name);
-		addImage(gui, newname, recurse);
+		if (n <= 0)
+			break;
+		len += n;
+
+		eol = (const char *)memrchr(buf, '\n', len);
+		if (eol == NULL) {
+			/* no path is this long; drop it */
+			if (len == LIST_CHUNK) {
+				skip = true;
+				len = 0;
+			}
+			continue;
+		}
+		if (skip) {
+			const char *first = (const char *)memchr(buf, '\n', len);
+
+			len -= first + 1 - buf;
+			memmove(buf, first + 1, len);
+			skip = false;
+			eol = (const char *)memrchr(buf, '\n', len);
+			if (eol == NULL)
+				continue;
+		}
+		addList(gui, buf, eol + 1 - buf, recurse);
+		len -= eol + 1 - buf;
+		memmove(buf, eol + 1, len);
 	}
+	if (len > 0 && !skip)
+		addList(gui, buf, len, recurse);
+	free(buf);
+	if (fd != 0)
+		close(fd);
 
-	closedir(dir);
-
-	return 0;
+	return n < 0 ? -1 : 0;
 }
 
-class Server : public Runnable
+/* moves to the next file whose name contains text */
+static bool findImage(GUI &gui, const char *text)
 {
-public:
-	Server(int port, GUI &gui)
-	: m_gui(gui), m_port(port), m_semaphore(0)
-	{
-		m_thread = new Thread(*this);
-	}
+	if (gui.find(text) == 0)
+		return true;
 
-	~Server()
-	{
-		m_semaphore.post();
-		m_thread->join();
-
-		delete m_thread;
-	}
+	fprintf(stderr, "No file named like \"%s\"\n", text);
+	return false;
+}
 
+/* once the playlist is complete */
+static void arrange(GUI &gui, bool random, bool permute, bool sort, bool sortdir,
+		bool sortdate, bool offset)
+{
+	printf("%d images...\n", gui.imageCount());
 
-	void run(void)
-	{
-		server_t *server;
-		char line[4096];
-		int n_wait = 0;
+	if (random) {
+		gui.randomSort();
+	} else if (permute) {
+		gui.randomPermutation();
+	} else if (sort) {
+		gui.logicalSort();
+	} else if (sortdir) {
+		gui.directorySort();
+	} else if (sortdate) {
+		gui.dateSort();
+	}
 
-		server = server_create(m_port);
+	if (offset)
+		gui.randomOffset();
+}
 
-		while (m_semaphore.wait(n_wait) != 0) {
-			if (server_readline(server, line, sizeof(line)) == 0) {
-				int len;
+/* control connections beyond this wait until others close */
+#define MAX_POLLFDS 64
 
-				len = strcspn(line, "\n\r");
-				if (len == 0)
-					continue;
-				line[len] = 0;
-				addImage(m_gui, line, false);
-				n_wait = 0;
-			} else {
-				n_wait = 10;
-			}
+/*
+ * Sleeps until there is input, a load has finished, or due (Time::MS(),
+ * 0 for never) has come.  Everything is a file descriptor, so poll()
+ * covers it all: deadlines through a CLOCK_MONOTONIC timerfd.
+ */
+static void waitEvents(GUI &gui, CLI &cli, server_t *server, int timer, int scanfd,
+		int watchfd, Timestamp due)
+{
+	struct pollfd fds[MAX_POLLFDS];
+	struct itimerspec its;
+	int sfds[MAX_POLLFDS];
+	int timeout = -1;
+	int n = 0;
+	uint64_t count;
+
+	if (gui.inputPending())
+		return;
+
+	memset(&its, 0, sizeof(its));
+	if (due != 0) {
+		Timestamp now = Time::MS();
+
+		if (due <= now)
+			return;
+		its.it_value.tv_sec = (due - now) / 1000;
+		its.it_value.tv_nsec = ((due - now) % 1000) * 1000000;
+	}
+	/* an all zero value disarms it */
+	if (timer != -1)
+		timerfd_settime(timer, 0, &its, NULL);
+	else if (due != 0)
+		timeout = due - Time::MS();
+
+	fds[n].fd = timer;
+	fds[n++].events = POLLIN;
+	fds[n].fd = gui.loaderFd();
+	fds[n++].events = POLLIN;
+	fds[n].fd = gui.inputFd();
+	fds[n++].events = POLLIN;
+	/* without a descriptor for window events, poll for them */
+	if (fds[n - 1].fd < 0 && (timeout < 0 || timeout > INPUT_POLL_MS))
+		timeout = INPUT_POLL_MS;
+	fds[n].fd = cli.fd();
+	fds[n++].events = POLLIN | POLLRDHUP;
+	fds[n].fd = scanfd;
+	fds[n++].events = POLLIN;
+	fds[n].fd = watchfd;
+	fds[n++].events = POLLIN;
+	if (server != NULL) {
+		int ns = server_fds(server, sfds, MAX_POLLFDS - n);
+
+		for (int i = 0; i < ns; ++i) {
+			fds[n].fd = sfds[i];
+			fds[n++].events = POLLIN;
 		}
-		server_destroy(server);
 	}
 
-private:
-	GUI &m_gui;
-	int m_port;
-	Semaphore m_semaphore;
-	Thread *m_thread;
-};
+	/* negative descriptors are ignored by poll() */
+	while (poll(fds, n, timeout) == -1 && errno == EINTR);
+
+	if (fds[0].revents & POLLIN)
+		while (read(timer, &count, sizeof(count)) == -1 && errno == EINTR);
+	if (fds[1].revents & POLLIN)
+		gui.clearLoaderFd();
+}
 
 int main(int argc, char **argv)
 {
 	bool fullscreen = false;
 	bool random = false;
+	bool permute = false;
+	bool seeded = false;
+	uint64_t seed = 0;
 	bool sort = false;
 	bool sortdir = false;
+	bool sortdate = false;
 	bool hasDelay = false;
 	bool hasFade  = false;
 	bool paused = false;
 	bool recurse = false;
+	bool watch = false;
 	bool filtering = true;
+	bool thumbnails = true;
+	bool index = true;
+	bool search = true;
+	bool dedup = false;
+	bool skipcopies = false;
 	bool text = false;
 	int listenport = -1;
+	unsigned int sharedcache = 0;
 	int offset = 0;
 	int currentImage = 0;
-	Server *server = NULL;
+	server_t *server = NULL;
 	Timestamp delay;
 	Timestamp fade;
 	CLI cli;
 	const char *filelist = NULL;
+	Sched::Policy loaderpolicy = Sched::Normal;
+	int loadernice = 0;
+	const char *loadercpus = NULL;
 	int c;
 
 	for (;;) {
@@ -350,38 +581,83 @@ int main(int argc, char **argv)
 		static struct option long_options[] = {
 			{"fullscreen",  0, 0, 'F'},
 			{"random",      0, 0, 'z'},
+			{"permute",     0, 0, 'Z'},
+			{"seed",        1, 0, 'R'},
 			{"sort",        0, 0, 's'},
+			{"sort-date",   0, 0, 't'},
 			{"randir",      0, 0, 'd'},
 			{"delay",       1, 0, 'D'},
 			{"fade",        1, 0, 'a'},
 			{"listen",      1, 0, 'l'},
 			{"recurse",     0, 0, 'r'},
+			{"watch",       0, 0, 'w'},
 			{"offset",      0, 0, 'o'},
 			{"nofilter",    0, 0, 'n'},
+			{"nothumbs",    0, 0, 'N'},
+			{"noindex",     0, 0, 'I'},
+			{"nosearch",    0, 0, 'Q'},
+			{"dedup",       0, 0, 'u'},
+			{"skip-copies", 0, 0, 'U'},
 			{"stdin",       0, 0, 'S'},
 			{"filelist",    1, 0, 'f'},
+			{"shared-cache",1, 0, 'C'},
+			{"loader-priority",1, 0, 'P'},
+			{"loader-cpus", 1, 0, 'A'},
 			{"version",     0, 0, 'v'},
 			{"help",        0, 0, 'h'},
 		};
-		c = getopt_long(argc,argv, "FzvhsordSl:f:a:D:", long_options, &idx);
+		c = getopt_long(argc,argv, "FzZvhstordwnNIQuUSl:f:a:D:C:P:A:R:", long_options, &idx);
 		if (c == -1) break;
 
 		switch (c) {
 		case 'n':
 			filtering = false;
 			break;
+		case 'N':
+			thumbnails = false;
+			break;
+		case 'I':
+			index = false;
+			break;
+		case 'Q':
+			search = false;
+			break;
+		case 'u':
+			dedup = true;
+			break;
+		case 'U':
+			dedup = true;
+			skipcopies = true;
+			break;
 		case 'F':
 			fullscreen = true;
 			break;
 		case 'z':
 			random = true;
 			break;
+		case 'Z':
+			permute = true;
+			break;
+		case 'R': {
+			char *end;
+
+			seed = strtoull(optarg, &end, 0);
+			if (*end || end == optarg) {
+				usage(argv[0]);
+				return 1;
+			}
+			seeded = true;
+			}
+			break;
 		case 's':
 			sort = true;
 			break;
 		case 'd':
 			sortdir = true;
 			break;
+		case 't':
+			sortdate = true;
+			break;
 		case 'S':
 			cli.enable();
 			break;
@@ -406,9 +682,34 @@ int main(int argc, char **argv)
 		case 'r':
 			recurse = true;
 			break;
+		case 'w':
+			watch = true;
+			recurse = true;
+			break;
 		case 'f':
 			filelist = optarg;
 			break;
+		case 'C':
+			sharedcache = strtoul(optarg, 0, 0);
+			break;
+		case 'P':
+			if (!strcmp(optarg, "idle"))
+				loaderpolicy = Sched::Idle;
+			else if (!strcmp(optarg, "batch"))
+				loaderpolicy = Sched::Batch;
+			else {
+				char *end;
+
+				loadernice = strtol(optarg, &end, 0);
+				if (*end || end == optarg) {
+					usage(argv[0]);
+					return 1;
+				}
+			}
+			break;
+		case 'A':
+			loadercpus = optarg;
+			break;
 		case 'v':
 			version(argv[0]);
 			return 0;
@@ -422,49 +723,50 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* before any loader or pool thread exists */
+	if (Sched::setBackground(loaderpolicy, loadernice, loadercpus))
+		fprintf(stderr, "Invalid loader CPU list '%s'\n", loadercpus);
+
 	GUI gui(GRE::Dimensions(1024, 768), fullscreen);
 
-	if (listenport != -1)
-		server = new Server(listenport, gui);
+	if (sharedcache != 0 && gui.enableSharedCache(sharedcache))
+		fprintf(stderr, "Unable to open shared cache\n");
+	gui.enableThumbnails(thumbnails);
+	if (seeded)
+		gui.setSeed(seed);
+	if (index && gui.enableIndex())
+		fprintf(stderr, "Unable to open the index of known files\n");
+	if (search)
+		gui.enableSearch();
+	if (dedup)
+		gui.enableDedup(skipcopies);
+
+	if (listenport != -1) {
+		server = server_create(listenport);
+		if (server == NULL)
+			fprintf(stderr, "Unable to listen on port %d\n", listenport);
+	}
 
-	if (filelist != NULL) {
-		char line[4096];
-		FILE *fp = fopen(filelist, "rt");
-		if (fp == NULL) {
-			perror(filelist);
-			return -1;
-		}
-		while (fgets(line, 4096, fp)) {
-			int len;
+	if (watch && gui.watchImages()) {
+		perror("inotify");
+		watch = false;
+	}
 
-			len = strlen(line);
-			if (len < 2)
-				continue;
-			line[len - 1] = 0;
-			addImage(gui, line, recurse);
-		}
+	if (filelist != NULL && readList(gui, filelist, recurse)) {
+		perror(filelist);
+		return -1;
 	}
 
 	for (int i = optind; i < argc; ++i) {
 		addImage(gui, argv[i], recurse);
 	}
 
-	printf("%d images...\n", gui.imageCount());
-
-	if (random) {
-		srand(time(NULL));
-		gui.randomSort();
-	} else if (sort) {
-		gui.logicalSort();
-	} else if (sortdir) {
-		srand(time(NULL));
-		gui.directorySort();
-	}
-
-	if (offset) {
-		srand(time(NULL));
-		gui.randomOffset();
-	}
+	gui.finishScan();
+	gui.commitImages();
+	/* a scan shows images as they are found and gets arranged once done */
+	bool scanning = gui.scanning();
+	if (!scanning)
+		arrange(gui, random, permute, sort, sortdir, sortdate, offset);
 
 	if (hasFade && fade != 0) {
 		gui.setFadeDuration(fade);
@@ -476,9 +778,52 @@ int main(int argc, char **argv)
 	gui.enableText(text);
 
 	Timestamp lastframetime = Time::MS();
+	Timestamp lastscrub = 0;
+	bool scrubbing = false;
+	int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
 	for (;;) {
 		GRE::Event ev;
 
+		if (scanning && !gui.scanning()) {
+			scanning = false;
+			arrange(gui, random, permute, sort, sortdir, sortdate, offset);
+		}
+		if (watch)
+			gui.updateWatched();
+
+		if (server != NULL) {
+			char line[4096];
+			std::string added;
+
+			/* publish whatever arrived in one go */
+			while (server_readline(server, line, sizeof(line)) == 0) {
+				int len = strcspn(line, "\n\r");
+				if (len == 0)
+					continue;
+				/* a query; what came before it is there to be found */
+				if (line[0] == '?') {
+					line[len] = 0;
+					if (!added.empty()) {
+						gui.addImages(added.data(), added.size(), '\n');
+						gui.commitImages();
+						added.clear();
+					}
+					if (len > 1 && findImage(gui, line + 1)) {
+						currentImage = 0;
+						scrubbing = true;
+						lastscrub = 0;
+					}
+					continue;
+				}
+				added.append(line, len);
+				added += '\n';
+			}
+			if (!added.empty()) {
+				gui.addImages(added.data(), added.size(), '\n');
+				gui.commitImages();
+			}
+		}
+
 		while (gui.pollEvent(ev) == 0 || cli.pollEvent(ev) == 0) {
 			switch (ev.type) {
 			case GRE::Event::Quit:
@@ -493,6 +838,13 @@ int main(int argc, char **argv)
 					currentImage = 0;
 				currentImage--;
 				break;
+			case GRE::Event::First:
+			case GRE::Event::Last:
+				gui.jump(ev.type == GRE::Event::First ? 0 : gui.imageCount() - 1);
+				currentImage = 0;
+				scrubbing = true;
+				lastscrub = 0;
+				break;
 			case GRE::Event::TextToggle:
 				text = !text;
 				gui.enableText(text);
@@ -509,17 +861,47 @@ int main(int argc, char **argv)
 				filtering = !filtering;
 				gui.enableFiltering(filtering);
 				break;
+			case GRE::Event::LoaderStatus:
+				gui.showLoaderStatus();
+				break;
+			case GRE::Event::Search:
+				if (findImage(gui, cli.query())) {
+					currentImage = 0;
+					scrubbing = true;
+					lastscrub = 0;
+				}
+				break;
 			}
 		}
 
 		if (hasDelay && !paused) {
 			Timestamp now = Time::MS();
 			if ((now - lastframetime) >= delay) {
-				if (currentImage == 0)
+				if (currentImage == 0 && !scrubbing)
 					currentImage++;
 			}
 		}
 
+		/*
+		 * Steps queueing up faster than images load: coalesce them into
+		 * one jump and only load where the user stops.
+		 */
+		if (currentImage != 0 && (scrubbing || currentImage > 1 || currentImage < -1)) {
+			gui.scrub(currentImage);
+			currentImage = 0;
+			scrubbing = true;
+			lastscrub = Time::MS();
+		}
+		if (scrubbing && Time::MS() - lastscrub >= SCRUB_SETTLE_MS) {
+			if (gui.settle() == 0) {
+				gui.enableSpinner(false);
+				scrubbing = false;
+				lastframetime = Time::MS();
+			} else {
+				gui.enableSpinner(true);
+			}
+		}
+
 		if (currentImage != 0) {
 			int rc;
 			int way = 0;
@@ -539,12 +921,28 @@ int main(int argc, char **argv)
 				gui.enableSpinner(true);
 			}
 		}
+		/* let the loader plan for the next automatic switch */
+		if (hasDelay && !paused)
+			gui.setDeadline(lastframetime + delay, delay);
+		else
+			gui.setDeadline(0, 0);
 		gui.render();
-		usleep(33000);
+
+		/* nothing to do until one of these, or input */
+		Timestamp due = gui.nextFrame();
+		if (hasDelay && !paused && !scrubbing && currentImage == 0 &&
+				(due == 0 || lastframetime + delay < due))
+			due = lastframetime + delay;
+		/* once settled, the load finishing wakes the loop, not the clock */
+		if (scrubbing && lastscrub + SCRUB_SETTLE_MS > Time::MS() &&
+				(due == 0 || lastscrub + SCRUB_SETTLE_MS < due))
+			due = lastscrub + SCRUB_SETTLE_MS;
+		waitEvents(gui, cli, server, timer, scanning ? gui.scanFd() : -1,
+				watch ? gui.watchFd() : -1, due);
 	}
 
 	if (server != NULL)
-		delete server;
+		server_destroy(server);
 
 	return 0;
 }
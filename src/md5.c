@@ -0,0 +1,140 @@
+#include <string.h>
+#include <stdio.h>
+
+#include "md5.h"
+
+static const unsigned int md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+	0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+	0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+	0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+	0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+	0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+	0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+	0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const unsigned char md5_r[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_block(struct md5 *ctx, const unsigned char *p)
+{
+	unsigned int a, b, c, d, f, t;
+	unsigned int w[16];
+	int i, g;
+
+	for (i = 0; i < 16; ++i)
+		w[i] = p[i * 4] | (p[i * 4 + 1] << 8) |
+			(p[i * 4 + 2] << 16) | ((unsigned int)p[i * 4 + 3] << 24);
+
+	a = ctx->state[0];
+	b = ctx->state[1];
+	c = ctx->state[2];
+	d = ctx->state[3];
+
+	for (i = 0; i < 64; ++i) {
+		if (i < 16) {
+			f = (b & c) | (~b & d);
+			g = i;
+		} else if (i < 32) {
+			f = (d & b) | (~d & c);
+			g = (5 * i + 1) & 15;
+		} else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3 * i + 5) & 15;
+		} else {
+			f = c ^ (b | ~d);
+			g = (7 * i) & 15;
+		}
+		t = d;
+		d = c;
+		c = b;
+		f += a + md5_k[i] + w[g];
+		b += (f << md5_r[i]) | (f >> (32 - md5_r[i]));
+		a = t;
+	}
+
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+}
+
+void md5_init(struct md5 *ctx)
+{
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->length = 0;
+}
+
+void md5_update(struct md5 *ctx, const void *data, unsigned int len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	unsigned int used = ctx->length & 63;
+
+	ctx->length += len;
+
+	if (used) {
+		unsigned int n = 64 - used;
+		if (n > len)
+			n = len;
+		memcpy(ctx->buffer + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		md5_block(ctx, ctx->buffer);
+	}
+
+	for (; len >= 64; p += 64, len -= 64)
+		md5_block(ctx, p);
+
+	memcpy(ctx->buffer, p, len);
+}
+
+void md5_final(struct md5 *ctx, unsigned char digest[16])
+{
+	unsigned long long bits = ctx->length << 3;
+	unsigned char pad[72];
+	unsigned int used = ctx->length & 63;
+	unsigned int n;
+	int i;
+
+	n = (used < 56) ? 56 - used : 120 - used;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; ++i)
+		pad[n + i] = bits >> (i * 8);
+	md5_update(ctx, pad, n + 8);
+
+	for (i = 0; i < 16; ++i)
+		digest[i] = ctx->state[i >> 2] >> ((i & 3) * 8);
+}
+
+void md5_hex(const void *data, unsigned int len, char hex[33])
+{
+	unsigned char digest[16];
+	struct md5 ctx;
+	int i;
+
+	md5_init(&ctx);
+	md5_update(&ctx, data, len);
+	md5_final(&ctx, digest);
+
+	for (i = 0; i < 16; ++i)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct md5 {
+	unsigned int state[4];
+	unsigned long long length;
+	unsigned char buffer[64];
+};
+
+void md5_init(struct md5 *ctx);
+void md5_update(struct md5 *ctx, const void *data, unsigned int len);
+void md5_final(struct md5 *ctx, unsigned char digest[16]);
+
+/* writes 32 lowercase hex digits and a terminator to hex */
+void md5_hex(const void *data, unsigned int len, char hex[33]);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "memorymonitor.h"
+
+#define SAMPLE_INTERVAL_MS 1000
+
+/* levels are entered at the first threshold and left below the second */
+static const double psi_some[2][2] = { { 5.0, 2.0 }, { 20.0, 10.0 } };
+static const double psi_full[2][2] = { { 1.0, 0.2 }, {  5.0,  2.0 } };
+static const double cg_usage[2][2] = { { 0.85, 0.75 }, { 0.95, 0.88 } };
+
+static const char *cgroup_roots[] = {
+	"/sys/fs/cgroup",
+	"/sys/fs/cgroup/unified",
+};
+
+static int read_file(const char *path, char *buf, int len)
+{
+	int fd;
+	int rc;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	rc = read(fd, buf, len - 1);
+	close(fd);
+	if (rc < 0)
+		return -1;
+	buf[rc] = 0;
+
+	return rc;
+}
+
+static int read_u64(const char *path, unsigned long long *value)
+{
+	char buf[64];
+
+	if (read_file(path, buf, sizeof(buf)) <= 0)
+		return -1;
+	if (!strncmp(buf, "max", 3))
+		return 1;
+	*value = strtoull(buf, NULL, 10);
+
+	return 0;
+}
+
+static double pressure_avg10(const char *text, const char *kind)
+{
+	const char *p;
+
+	p = strstr(text, kind);
+	if (p == NULL)
+		return 0.0;
+	p = strstr(p, "avg10=");
+	if (p == NULL)
+		return 0.0;
+
+	return strtod(p + 6, NULL);
+}
+
+static MemoryMonitor::Level classify(double value, const double t[2][2],
+		MemoryMonitor::Level current)
+{
+	if (value >= t[1][0])
+		return MemoryMonitor::Critical;
+	if (current == MemoryMonitor::Critical && value >= t[1][1])
+		return MemoryMonitor::Critical;
+	if (value >= t[0][0])
+		return MemoryMonitor::Moderate;
+	if (current >= MemoryMonitor::Moderate && value >= t[0][1])
+		return MemoryMonitor::Moderate;
+	return MemoryMonitor::Normal;
+}
+
+MemoryMonitor::MemoryMonitor()
+ : m_haspsi(true), m_hascgroup(false), m_last(0), m_level(Normal)
+{
+	char buf[1024];
+	char *p;
+
+	m_cgroup[0] = 0;
+	if (read_file("/proc/self/cgroup", buf, sizeof(buf)) <= 0)
+		return;
+
+	/* the unified hierarchy is the "0::" entry */
+	for (p = buf; p != NULL && *p; p = strchr(p, '\n')) {
+		if (*p == '\n')
+			p++;
+		if (!strncmp(p, "0::", 3)) {
+			int len = strcspn(p + 3, "\n");
+			if (len >= (int)sizeof(m_cgroup))
+				break;
+			memcpy(m_cgroup, p + 3, len);
+			m_cgroup[len] = 0;
+			m_hascgroup = true;
+			break;
+		}
+	}
+}
+
+int MemoryMonitor::readPressure(double *some, double *full)
+{
+	char buf[256];
+
+	if (!m_haspsi)
+		return -1;
+
+	if (read_file("/proc/pressure/memory", buf, sizeof(buf)) <= 0) {
+		m_haspsi = false;
+		return -1;
+	}
+
+	*some = pressure_avg10(buf, "some");
+	*full = pressure_avg10(buf, "full");
+
+	return 0;
+}
+
+int MemoryMonitor::readCgroup(double *usage)
+{
+	char path[512];
+	char group[256];
+	bool found = false;
+
+	if (!m_hascgroup)
+		return -1;
+
+	*usage = 0.0;
+	for (unsigned int i = 0; i < sizeof(cgroup_roots)/sizeof(cgroup_roots[0]); ++i) {
+		strcpy(group, m_cgroup);
+
+		/* limits of ancestors apply as well; report the tightest */
+		for (;;) {
+			unsigned long long max, cur;
+			char *slash;
+
+			snprintf(path, sizeof(path), "%s%s/memory.max",
+					cgroup_roots[i], group);
+			if (read_u64(path, &max) == 0 && max != 0) {
+				snprintf(path, sizeof(path), "%s%s/memory.current",
+						cgroup_roots[i], group);
+				if (read_u64(path, &cur) == 0) {
+					double u = (double)cur / max;
+					if (u > *usage)
+						*usage = u;
+					found = true;
+				}
+			}
+
+			slash = strrchr(group, '/');
+			if (slash == NULL || slash == group)
+				break;
+			*slash = 0;
+		}
+		if (found)
+			return 0;
+	}
+
+	m_hascgroup = false;
+	return -1;
+}
+
+MemoryMonitor::Level MemoryMonitor::poll(void)
+{
+	Timestamp now = Time::MS();
+	double some, full, usage;
+	Level level = Normal;
+	Level l;
+
+	if (m_last != 0 && now - m_last < SAMPLE_INTERVAL_MS)
+		return m_level;
+	m_last = now;
+
+	if (readPressure(&some, &full) == 0) {
+		l = classify(some, psi_some, m_level);
+		if (l > level)
+			level = l;
+		l = classify(full, psi_full, m_level);
+		if (l > level)
+			level = l;
+	}
+
+	if (readCgroup(&usage) == 0) {
+		l = classify(usage, cg_usage, m_level);
+		if (l > level)
+			level = l;
+	}
+
+	m_level = level;
+
+	return m_level;
+}
+
+MemoryMonitor::Level MemoryMonitor::level(void) const
+{
+	return m_level;
+}
+
+const char *MemoryMonitor::levelName(MemoryMonitor::Level level)
+{
+	switch (level) {
+	case Normal:
+		return "normal";
+	case Moderate:
+		return "moderate";
+	case Critical:
+		return "critical";
+	}
+	return "unknown";
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "thread.h"
+
+class MemoryMonitor {
+public:
+	enum Level {
+		Normal,
+		Moderate,
+		Critical,
+	};
+
+	MemoryMonitor();
+
+	/* samples at most once per interval; returns the current level */
+	Level poll(void);
+	Level level(void) const;
+
+	static const char *levelName(Level level);
+
+private:
+	int readPressure(double *some, double *full);
+	int readCgroup(double *usage);
+
+	char      m_cgroup[256];
+	bool      m_haspsi;
+	bool      m_hascgroup;
+	Timestamp m_last;
+	Level     m_level;
+};
@@ -0,0 +1,702 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <vector>
+
+#include "metaindex.h"
+
+#define METAINDEX_MAGIC   0x494d4758u /* 'IMGX' */
+#define METAINDEX_VERSION 3
+/* the directory's entries are all there, as of its mtime */
+#define DIR_LISTED        1
+
+struct MetaIndex::Header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ndirs;
+	uint32_t nfiles;
+	uint32_t nchars;
+	uint32_t reserved[3];
+};
+
+/* sorted by path */
+struct MetaIndex::Dir {
+	uint32_t path;
+	uint32_t first;
+	uint32_t count;
+	uint32_t flags;
+	uint64_t dev;
+	uint64_t ino;
+	int64_t  mtime;
+};
+
+/* sorted by name within their directory; type 0 if only the metadata is known */
+struct MetaIndex::File {
+	uint32_t name;
+	uint8_t  type;
+	uint8_t  state;
+	uint8_t  format;
+	uint8_t  orientation;
+	uint32_t w, h;
+	uint64_t size;
+	int64_t  mtime;
+	int64_t  taken;
+	uint64_t hash;
+	uint32_t dated;
+	uint32_t hashed;
+
+	Meta meta(void) const;
+};
+
+class MetaIndex::Mapping {
+public:
+	Mapping();
+	~Mapping();
+
+	/* an empty mapping if there is no usable index at path */
+	static Mapping *open(const char *path);
+
+	const Dir *findDir(const char *path, int len) const;
+	const File *findFile(const Dir *dir, const char *name) const;
+	const char *string(uint32_t offset) const;
+
+	const Dir  *dirs;
+	const File *files;
+	uint32_t    ndirs;
+
+private:
+	void       *m_base;
+	size_t      m_size;
+	const char *m_chars;
+	uint32_t    m_nchars;
+};
+
+struct CStrLess {
+	bool operator()(const char *a, const char *b) const
+	{
+		return strcmp(a, b) < 0;
+	}
+};
+
+struct Entry {
+	const char     *name;
+	uint8_t         type;
+	MetaIndex::Meta meta;
+
+	bool operator<(const Entry &o) const
+	{
+		return strcmp(name, o.name) < 0;
+	}
+};
+
+static int64_t mtime_ns(const struct stat *st)
+{
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static bool current(const MetaIndex::Meta &meta, const struct stat *st)
+{
+	return meta.state != MetaIndex::Unknown && meta.size == (uint64_t)st->st_size &&
+		meta.mtime == mtime_ns(st);
+}
+
+/* the length of the directory part of path, without the '/' */
+static int dir_length(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+
+	return slash != NULL ? slash - path : 0;
+}
+
+static const char *base_name(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+
+	return slash != NULL ? slash + 1 : path;
+}
+
+static int index_path(char *buf, int len)
+{
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	int rc;
+
+	if (xdg != NULL && xdg[0] == '/')
+		rc = snprintf(buf, len, "%s/imager", xdg);
+	else if (home != NULL)
+		rc = snprintf(buf, len, "%s/.cache/imager", home);
+	else
+		return -1;
+	if (rc >= len)
+		return -1;
+
+	/* the parent usually exists already */
+	mkdir(buf, 0700);
+
+	return (snprintf(buf + rc, len - rc, "/index") < len - rc) ? 0 : -1;
+}
+
+MetaIndex::Mapping::Mapping()
+ : dirs(NULL), files(NULL), ndirs(0), m_base(NULL), m_size(0), m_chars(NULL), m_nchars(0)
+{ }
+
+MetaIndex::Mapping::~Mapping()
+{
+	if (m_base != NULL)
+		munmap(m_base, m_size);
+}
+
+MetaIndex::Mapping *MetaIndex::Mapping::open(const char *path)
+{
+	Mapping *map = new Mapping;
+	const Header *header;
+	const Dir *d;
+	struct stat st;
+	uint64_t need;
+	void *base;
+	int fd;
+
+	/* a missing or unusable index is simply rebuilt */
+	fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return map;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(Header)) {
+		close(fd);
+		return map;
+	}
+	/* a new index replaces the file by rename, so what is mapped never changes */
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return map;
+
+	header = (const Header *)base;
+	need = sizeof(Header) + (uint64_t)header->ndirs * sizeof(Dir) +
+		(uint64_t)header->nfiles * sizeof(File) + header->nchars;
+	if (header->magic != METAINDEX_MAGIC || header->version != METAINDEX_VERSION ||
+			need > (uint64_t)st.st_size || header->nchars == 0)
+		goto bad;
+
+	d = (const Dir *)(header + 1);
+	for (uint32_t i = 0; i < header->ndirs; ++i) {
+		if ((uint64_t)d[i].first + d[i].count > header->nfiles)
+			goto bad;
+	}
+	map->m_chars = (const char *)((const File *)(d + header->ndirs) + header->nfiles);
+	if (map->m_chars[header->nchars - 1] != 0)
+		goto bad;
+
+	map->m_base = base;
+	map->m_size = st.st_size;
+	map->m_nchars = header->nchars;
+	map->dirs = d;
+	map->files = (const File *)(d + header->ndirs);
+	map->ndirs = header->ndirs;
+
+	return map;
+
+bad:
+	munmap(base, st.st_size);
+	map->m_chars = NULL;
+
+	return map;
+}
+
+const char *MetaIndex::Mapping::string(uint32_t offset) const
+{
+	return offset < m_nchars ? m_chars + offset : "";
+}
+
+const MetaIndex::Dir *MetaIndex::Mapping::findDir(const char *path, int len) const
+{
+	uint32_t lo = 0, hi = ndirs;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const char *s = string(dirs[mid].path);
+		int c = strncmp(s, path, len);
+
+		if (c == 0)
+			c = s[len] != 0;
+		if (c == 0)
+			return &dirs[mid];
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+const MetaIndex::File *MetaIndex::Mapping::findFile(const Dir *dir, const char *name) const
+{
+	uint32_t lo = dir->first, hi = dir->first + dir->count;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int c = strcmp(string(files[mid].name), name);
+
+		if (c == 0)
+			return &files[mid];
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+static MetaIndex::Meta file_meta(uint8_t state, uint8_t format, uint8_t orientation,
+		uint32_t w, uint32_t h, uint64_t size, int64_t mtime)
+{
+	MetaIndex::Meta meta;
+
+	meta.size = size;
+	meta.mtime = mtime;
+	meta.w = w;
+	meta.h = h;
+	meta.state = state;
+	meta.format = format;
+	meta.orientation = orientation;
+	meta.dated = 0;
+	meta.taken = 0;
+	meta.hashed = 0;
+	meta.hash = 0;
+
+	return meta;
+}
+
+MetaIndex::Meta MetaIndex::File::meta(void) const
+{
+	Meta meta = file_meta(state, format, orientation, w, h, size, mtime);
+
+	meta.dated = dated;
+	meta.taken = taken;
+	meta.hashed = hashed;
+	meta.hash = hash;
+
+	return meta;
+}
+
+MetaIndex::MetaIndex()
+ : m_path(NULL), m_dirty(false)
+{
+	m_map = new Mapping;
+	m_maps.push_back(m_map);
+}
+
+MetaIndex::~MetaIndex()
+{
+	for (unsigned int i = 0; i < m_maps.size(); ++i)
+		delete m_maps[i];
+	free(m_path);
+}
+
+const MetaIndex::Mapping *MetaIndex::mapping(void) const
+{
+	return __atomic_load_n(&m_map, __ATOMIC_ACQUIRE);
+}
+
+int MetaIndex::open(const char *path)
+{
+	char buf[PATH_MAX];
+	Mapping *map;
+
+	if (path == NULL) {
+		if (index_path(buf, sizeof(buf)))
+			return -1;
+		path = buf;
+	}
+
+	map = Mapping::open(path);
+	m_lock.lock();
+	free(m_path);
+	m_path = strdup(path);
+	m_maps.push_back(map);
+	__atomic_store_n(&m_map, map, __ATOMIC_RELEASE);
+	m_lock.unlock();
+
+	return 0;
+}
+
+bool MetaIndex::list(const char *path, const struct stat *st, std::string &names) const
+{
+	const Mapping *map = mapping();
+	const Dir *dir = map->findDir(path, strlen(path));
+
+	if (dir == NULL || !(dir->flags & DIR_LISTED) || dir->dev != (uint64_t)st->st_dev ||
+			dir->ino != (uint64_t)st->st_ino || dir->mtime != mtime_ns(st))
+		return false;
+
+	for (uint32_t i = dir->first; i < dir->first + dir->count; ++i) {
+		const File &f = map->files[i];
+		const char *name = map->string(f.name);
+
+		if (f.type == 0)
+			continue;
+		names += (f.type == 'f' && f.state == Invalid) ? 'x' : (char)f.type;
+		names.append(name, strlen(name) + 1);
+	}
+
+	return true;
+}
+
+void MetaIndex::setListing(const char *path, const struct stat *st, const std::string &names)
+{
+	struct timespec now;
+	Listing listing;
+
+	listing.dev = st->st_dev;
+	listing.ino = st->st_ino;
+	listing.mtime = mtime_ns(st);
+	listing.names = names;
+
+	/* it may change again within the granularity of its mtime; read it next time */
+	clock_gettime(CLOCK_REALTIME, &now);
+	if ((int64_t)now.tv_sec * 1000000000 + now.tv_nsec - listing.mtime < 1000000000)
+		listing.mtime = -1;
+
+	m_lock.lock();
+	std::swap(m_listings[path], listing);
+	m_dirty = true;
+	m_lock.unlock();
+}
+
+/* the latest on path, whether or not it is still current */
+bool MetaIndex::find(const char *path, Meta &meta)
+{
+	int len = dir_length(path);
+	const char *name = base_name(path);
+	DirMetas::iterator dir;
+	bool found = false;
+
+	m_lock.lock();
+	dir = m_metas.find(std::string(path, len));
+	if (dir != m_metas.end()) {
+		Metas::iterator it = dir->second.find(name);
+
+		if (it != dir->second.end()) {
+			meta = it->second;
+			found = true;
+		}
+	}
+	m_lock.unlock();
+
+	if (!found) {
+		const Mapping *map = mapping();
+		const Dir *d = map->findDir(path, len);
+		const File *f = d != NULL ? map->findFile(d, name) : NULL;
+
+		if (f == NULL)
+			return false;
+		meta = f->meta();
+	}
+
+	return true;
+}
+
+bool MetaIndex::lookup(const char *path, const struct stat *st, Meta &meta)
+{
+	return find(path, meta) && current(meta, st);
+}
+
+void MetaIndex::record(const char *path, const Meta &meta)
+{
+	Meta old, m = meta;
+
+	if (find(path, old) && old.size == m.size && old.mtime == m.mtime) {
+		if (!m.dated && old.dated) {
+			m.dated = old.dated;
+			m.taken = old.taken;
+		}
+		if (!m.hashed && old.hashed) {
+			m.hashed = old.hashed;
+			m.hash = old.hash;
+		}
+	}
+
+	m_lock.lock();
+	m_metas[std::string(path, dir_length(path))][base_name(path)] = m;
+	m_dirty = true;
+	m_lock.unlock();
+}
+
+/* the latest on path if it is the file st describes, or nothing learnt about it yet */
+MetaIndex::Meta MetaIndex::latest(const char *path, const struct stat *st)
+{
+	Meta meta;
+
+	if (!find(path, meta) || meta.size != (uint64_t)st->st_size || meta.mtime != mtime_ns(st))
+		meta = file_meta(Unknown, 0, 1, 0, 0, st->st_size, mtime_ns(st));
+
+	return meta;
+}
+
+bool MetaIndex::taken(const char *path, const struct stat *st, int64_t &date)
+{
+	Meta meta = latest(path, st);
+
+	if (!meta.dated)
+		return false;
+	date = meta.taken;
+
+	return true;
+}
+
+void MetaIndex::recordTaken(const char *path, const struct stat *st, int64_t date)
+{
+	/* whatever loading found out about the same file stays */
+	Meta meta = latest(path, st);
+
+	meta.dated = 1;
+	meta.taken = date;
+	record(path, meta);
+}
+
+bool MetaIndex::hash(const char *path, const struct stat *st, uint64_t &hash)
+{
+	Meta meta = latest(path, st);
+
+	if (!meta.hashed)
+		return false;
+	hash = meta.hash;
+
+	return true;
+}
+
+void MetaIndex::recordHash(const char *path, const struct stat *st, uint64_t hash)
+{
+	Meta meta = latest(path, st);
+
+	meta.hashed = 1;
+	meta.hash = hash;
+	record(path, meta);
+}
+
+bool MetaIndex::rejected(const char *path)
+{
+	const Mapping *map = mapping();
+	const Dir *d = map->findDir(path, dir_length(path));
+	const File *f = d != NULL ? map->findFile(d, base_name(path)) : NULL;
+	struct stat st;
+	Meta meta;
+
+	/* only those that failed are worth a stat */
+	if (f == NULL || f->state != Invalid || stat(path, &st))
+		return false;
+
+	return lookup(path, &st, meta) && meta.state == Invalid;
+}
+
+static uint32_t add_string(std::string &chars, const char *s)
+{
+	uint32_t offset = chars.size();
+
+	chars.append(s, strlen(s) + 1);
+
+	return offset;
+}
+
+/* merges old with what was learnt since into a new index at path */
+bool MetaIndex::write(const Mapping *old, const Listings &listings, const DirMetas &metas,
+		const char *path)
+{
+	std::vector<const char *> paths;
+	std::vector<Dir> dirs;
+	std::vector<File> files;
+	std::string chars(1, 0);
+	Header header;
+	char *tmp;
+	FILE *fp;
+	bool ok;
+
+	for (uint32_t i = 0; i < old->ndirs; ++i)
+		paths.push_back(old->string(old->dirs[i].path));
+	for (Listings::const_iterator it = listings.begin(); it != listings.end(); ++it)
+		paths.push_back(it->first.c_str());
+	for (DirMetas::const_iterator it = metas.begin(); it != metas.end(); ++it)
+		paths.push_back(it->first.c_str());
+	std::sort(paths.begin(), paths.end(), CStrLess());
+
+	for (unsigned int i = 0; i < paths.size(); ++i) {
+		const char *path = paths[i];
+		Listings::const_iterator listing = listings.find(path);
+		DirMetas::const_iterator dirmetas = metas.find(path);
+		const Dir *dir = old->findDir(path, strlen(path));
+		std::vector<Entry> entries;
+		unsigned int listed;
+		Dir d;
+
+		if (i > 0 && !strcmp(path, paths[i - 1]))
+			continue;
+
+		memset(&d, 0, sizeof(d));
+		if (listing != listings.end()) {
+			const std::string &names = listing->second.names;
+
+			d.flags = DIR_LISTED;
+			d.dev = listing->second.dev;
+			d.ino = listing->second.ino;
+			d.mtime = listing->second.mtime;
+			for (size_t pos = 0; pos < names.size(); pos += strlen(&names[pos]) + 1) {
+				const File *f = dir != NULL ? old->findFile(dir, &names[pos + 1]) : NULL;
+				Entry e;
+
+				e.type = names[pos++];
+				e.name = &names[pos];
+				if (f != NULL)
+					e.meta = f->meta();
+				else
+					e.meta = file_meta(Unknown, 0, 1, 0, 0, 0, 0);
+				entries.push_back(e);
+			}
+		} else if (dir != NULL) {
+			Listings::const_iterator parent;
+			std::string entry(1, 0);
+
+			/* gone, if its parent was read again and no longer has it */
+			parent = listings.find(std::string(path, dir_length(path)));
+			entry += 'd';
+			entry += base_name(path);
+			entry += '\0';
+			if (parent != listings.end() && (std::string(1, 0) +
+					parent->second.names).find(entry) == std::string::npos)
+				continue;
+
+			d = *dir;
+			for (uint32_t j = dir->first; j < dir->first + dir->count; ++j) {
+				const File &f = old->files[j];
+				Entry e;
+
+				e.name = old->string(f.name);
+				e.type = f.type;
+				e.meta = f.meta();
+				entries.push_back(e);
+			}
+		}
+		std::sort(entries.begin(), entries.end());
+
+		/* what was learnt by loading */
+		listed = entries.size();
+		if (dirmetas != metas.end()) {
+			for (Metas::const_iterator it = dirmetas->second.begin();
+					it != dirmetas->second.end(); ++it) {
+				std::vector<Entry>::iterator at;
+				Entry e;
+
+				e.name = it->first.c_str();
+				e.type = 0;
+				e.meta = it->second;
+				at = std::lower_bound(entries.begin(), entries.begin() + listed, e);
+				if (at != entries.begin() + listed && !strcmp(at->name, e.name))
+					at->meta = e.meta;
+				else
+					entries.push_back(e);
+			}
+			std::sort(entries.begin(), entries.end());
+		}
+
+		d.path = add_string(chars, path);
+		d.first = files.size();
+		d.count = entries.size();
+		dirs.push_back(d);
+		for (unsigned int j = 0; j < entries.size(); ++j) {
+			const Entry &e = entries[j];
+			File f;
+
+			f.name = add_string(chars, e.name);
+			f.type = e.type;
+			f.state = e.meta.state;
+			f.format = e.meta.format;
+			f.orientation = e.meta.orientation;
+			f.w = e.meta.w;
+			f.h = e.meta.h;
+			f.size = e.meta.size;
+			f.mtime = e.meta.mtime;
+			f.taken = e.meta.taken;
+			f.hash = e.meta.hash;
+			f.dated = e.meta.dated;
+			f.hashed = e.meta.hashed;
+			files.push_back(f);
+		}
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = METAINDEX_MAGIC;
+	header.version = METAINDEX_VERSION;
+	header.ndirs = dirs.size();
+	header.nfiles = files.size();
+	header.nchars = chars.size();
+
+	/* other instances may have the old one mapped; replace it whole */
+	tmp = (char *)malloc(strlen(path) + 32);
+	sprintf(tmp, "%s.%d", path, (int)getpid());
+	fp = fopen(tmp, "wb");
+	ok = fp != NULL;
+	if (ok) {
+		ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+		ok = ok && (dirs.empty() ||
+			fwrite(&dirs[0], sizeof(Dir), dirs.size(), fp) == dirs.size());
+		ok = ok && (files.empty() ||
+			fwrite(&files[0], sizeof(File), files.size(), fp) == files.size());
+		ok = ok && fwrite(chars.data(), chars.size(), 1, fp) == 1;
+		ok = (fclose(fp) == 0) && ok;
+		ok = ok && rename(tmp, path) == 0;
+		if (!ok)
+			unlink(tmp);
+	}
+	free(tmp);
+
+	return ok;
+}
+
+int MetaIndex::save(void)
+{
+	Listings listings;
+	DirMetas metas;
+	const Mapping *old;
+	Mapping *map;
+	bool ok;
+
+	/* built outside m_lock, so lookups carry on meanwhile */
+	m_savelock.lock();
+	m_lock.lock();
+	if (!m_dirty || m_path == NULL) {
+		m_lock.unlock();
+		m_savelock.unlock();
+		return 0;
+	}
+	listings.swap(m_listings);
+	metas.swap(m_metas);
+	m_dirty = false;
+	old = m_map;
+	m_lock.unlock();
+
+	ok = write(old, listings, metas, m_path);
+	map = ok ? Mapping::open(m_path) : NULL;
+
+	m_lock.lock();
+	if (ok) {
+		m_maps.push_back(map);
+		__atomic_store_n(&m_map, map, __ATOMIC_RELEASE);
+	} else {
+		/* keep it for next time; anything newer takes precedence */
+		m_listings.insert(listings.begin(), listings.end());
+		for (DirMetas::iterator it = metas.begin(); it != metas.end(); ++it)
+			m_metas[it->first].insert(it->second.begin(), it->second.end());
+		m_dirty = true;
+	}
+	m_lock.unlock();
+	m_savelock.unlock();
+
+	return ok ? 0 : -1;
+}
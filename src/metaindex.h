@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "thread.h"
+
+/*
+ * What earlier runs learnt about the files shown, kept in one file under
+ * $XDG_CACHE_HOME/imager and mapped read-only at startup.  Directories
+ * are listed along with their mtime, so one that hasn't changed needn't
+ * be read again.  Files carry their format, dimensions and orientation,
+ * or the fact that they can't be loaded, when they were taken and a hash
+ * of their content, for as long as their size and mtime stay the same.
+ * Whatever is learnt meanwhile is kept in memory until save() writes out
+ * a new index, which then replaces the mapped one.  Safe to use from any
+ * thread.
+ */
+class MetaIndex {
+public:
+	enum State {
+		Unknown,
+		Valid,
+		Invalid,
+	};
+
+	struct Meta {
+		uint64_t size;
+		int64_t  mtime;         /* ns */
+		uint32_t w, h;          /* as decoded, before orientation; 0 if unknown */
+		uint8_t  state;
+		uint8_t  format;
+		uint8_t  orientation;   /* EXIF, 1 is upright */
+		uint8_t  dated;         /* taken is known */
+		int64_t  taken;         /* as from exif_date(), 0 if it has none */
+		uint8_t  hashed;        /* hash is known */
+		uint64_t hash;          /* xxh64() of the whole file */
+	};
+
+	MetaIndex();
+	~MetaIndex();
+
+	/* maps the index at path, or at the default location if NULL */
+	int open(const char *path);
+	/* writes out a new index, if anything was learnt since the last one */
+	int save(void);
+
+	/*
+	 * Directory listings are a series of entries, each a type followed
+	 * by a name and a 0: 'd' for directories, 'f' for files and, from
+	 * list() only, 'x' for files that failed to load last time.
+	 * list() appends the listing of path to names, if the directory is
+	 * indexed and unchanged according to st.
+	 */
+	bool list(const char *path, const struct stat *st, std::string &names) const;
+	void setListing(const char *path, const struct stat *st, const std::string &names);
+
+	/* what is known about path, as long as it is unchanged according to st */
+	bool lookup(const char *path, const struct stat *st, Meta &meta);
+	void record(const char *path, const Meta &meta);
+	/* true if path failed to load and hasn't changed since; may stat it */
+	bool rejected(const char *path);
+
+	/*
+	 * When path was taken, and the hash of its content, as long as it is
+	 * unchanged according to st; each recorded apart from the rest, which
+	 * record() leaves alone.
+	 */
+	bool taken(const char *path, const struct stat *st, int64_t &date);
+	void recordTaken(const char *path, const struct stat *st, int64_t date);
+	bool hash(const char *path, const struct stat *st, uint64_t &hash);
+	void recordHash(const char *path, const struct stat *st, uint64_t hash);
+
+private:
+	struct Header;
+	struct Dir;
+	struct File;
+	class Mapping;
+
+	struct Listing {
+		uint64_t    dev;
+		uint64_t    ino;
+		int64_t     mtime;
+		std::string names;
+	};
+
+	typedef std::map<std::string, Listing> Listings;
+	typedef std::map<std::string, Meta> Metas;
+	typedef std::map<std::string, Metas> DirMetas;
+
+	const Mapping *mapping(void) const;
+	bool find(const char *path, Meta &meta);
+	Meta latest(const char *path, const struct stat *st);
+	bool write(const Mapping *old, const Listings &listings, const DirMetas &metas,
+			const char *path);
+
+	char         *m_path;
+	/* readers use it unlocked; replaced ones stay mapped until we go */
+	Mapping      *m_map;
+
+	Mutex         m_savelock;
+	Mutex         m_lock;   /* guards everything below */
+	std::vector<Mapping *> m_maps;
+	Listings      m_listings;
+	DirMetas      m_metas;
+	bool          m_dirty;
+};
@@ -0,0 +1,396 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "patharena.h"
+
+/* segment k is SEGMENT_BASE << k bytes, so a few cover the 32-bit space */
+#define SEGMENT_SHIFT 12
+#define SEGMENT_BASE  (1u << SEGMENT_SHIFT)
+#define MAX_PATH_LEN  4096
+
+const uint32_t PathArena::None;
+
+static inline int segment(uint64_t offset)
+{
+	return 31 - __builtin_clz((uint32_t)(offset >> SEGMENT_SHIFT) + 1);
+}
+
+static inline uint64_t segmentStart(int k)
+{
+	return (uint64_t)SEGMENT_BASE * ((1u << k) - 1);
+}
+
+PathArena::Segments::Segments()
+ : m_used(0)
+{
+	for (int i = 0; i < MaxSegments; ++i)
+		m_segments[i] = NULL;
+}
+
+PathArena::Segments::~Segments()
+{
+	for (int i = 0; i < MaxSegments; ++i)
+		free(m_segments[i]);
+}
+
+uint32_t PathArena::Segments::alloc(uint32_t len)
+{
+	uint64_t offset = m_used;
+	int k = segment(offset);
+
+	/* never straddle two segments */
+	while (offset + len > segmentStart(k + 1)) {
+		k++;
+		offset = segmentStart(k);
+	}
+	if (k >= MaxSegments || offset + len > 0xffffffffull)
+		return None;
+
+	if (m_segments[k] == NULL) {
+		m_segments[k] = (char *)malloc((size_t)SEGMENT_BASE << k);
+		if (m_segments[k] == NULL)
+			return None;
+	}
+	m_used = offset + len;
+
+	return offset;
+}
+
+void *PathArena::Segments::at(uint32_t offset) const
+{
+	int k = segment(offset);
+
+	return m_segments[k] + (offset - segmentStart(k));
+}
+
+size_t PathArena::Segments::used(void) const
+{
+	return m_used;
+}
+
+PathArena::PathArena()
+ : m_hash(64, None), m_ndirs(0), m_count(0), m_last(None)
+{
+	Dir *root;
+	uint32_t dir;
+
+	/* the directory of paths without any '/' */
+	dir = m_dirs.alloc(sizeof(Dir));
+	root = (Dir *)m_dirs.at(dir);
+	root->parent = None;
+	root->name = string("", 0);
+	root->length = 0;
+	root->depth = 0;
+}
+
+PathArena::~PathArena()
+{ }
+
+uint32_t PathArena::string(const char *str, int len)
+{
+	uint32_t offset;
+	char *p;
+
+	offset = m_chars.alloc(len + 1);
+	if (offset == None)
+		return None;
+	p = (char *)m_chars.at(offset);
+	memcpy(p, str, len);
+	p[len] = 0;
+
+	return offset;
+}
+
+static uint32_t hash(uint32_t parent, const char *name, int len)
+{
+	uint32_t h = 2166136261u ^ parent;
+
+	for (int i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+
+	return h ^ (h >> 15);
+}
+
+void PathArena::rehash(void)
+{
+	std::vector<uint32_t> old;
+	uint32_t mask;
+
+	old.swap(m_hash);
+	m_hash.assign(old.size() * 2, None);
+	mask = m_hash.size() - 1;
+
+	for (unsigned int i = 0; i < old.size(); ++i) {
+		const Dir *d;
+		const char *name;
+		uint32_t h;
+
+		if (old[i] == None)
+			continue;
+		d = getDir(old[i]);
+		name = (const char *)m_chars.at(d->name);
+		h = hash(d->parent, name, strlen(name));
+		while (m_hash[h & mask] != None)
+			h++;
+		m_hash[h & mask] = old[i];
+	}
+}
+
+/* the directory, or None and the free slot it would go in */
+uint32_t PathArena::lookup(uint32_t parent, const char *name, int len, uint32_t *slot) const
+{
+	uint32_t mask = m_hash.size() - 1;
+	uint32_t h = hash(parent, name, len);
+
+	for (; m_hash[h & mask] != None; ++h) {
+		const Dir *e = getDir(m_hash[h & mask]);
+		const char *s = (const char *)m_chars.at(e->name);
+
+		if (e->parent == parent && !strncmp(s, name, len) && s[len] == 0)
+			return m_hash[h & mask];
+	}
+	*slot = h & mask;
+
+	return None;
+}
+
+uint32_t PathArena::intern(uint32_t parent, const char *name, int len)
+{
+	const Dir *p = getDir(parent);
+	uint32_t offset, slot;
+	Dir *d;
+
+	offset = lookup(parent, name, len, &slot);
+	if (offset != None)
+		return offset;
+
+	offset = m_dirs.alloc(sizeof(Dir));
+	if (offset == None)
+		return None;
+	d = (Dir *)m_dirs.at(offset);
+	d->parent = parent;
+	d->name = string(name, len);
+	d->length = p->length + len + 1;
+	d->depth = p->depth + 1;
+	if (d->name == None)
+		return None;
+
+	m_hash[slot] = offset;
+	if (++m_ndirs * 2 > m_hash.size())
+		rehash();
+
+	return offset;
+}
+
+uint32_t PathArena::add(const char *path)
+{
+	return add(path, strlen(path));
+}
+
+uint32_t PathArena::add(const char *path, int len)
+{
+	const char *slash = (const char *)memrchr(path, '/', len);
+	const char *name = slash != NULL ? slash + 1 : path;
+	uint32_t dir = 0;
+	uint32_t offset;
+	File *f;
+
+	if (len >= MAX_PATH_LEN)
+		return None;
+
+	if (slash != NULL) {
+		int prefix = slash - path + 1;
+
+		if (m_last != None && (int)m_lastdir.size() == prefix &&
+				!memcmp(&m_lastdir[0], path, prefix)) {
+			dir = m_last;
+		} else {
+			const char *p = path;
+
+			while (p <= slash) {
+				const char *end = (const char *)memchr(p, '/', slash + 1 - p);
+
+				dir = intern(dir, p, end - p);
+				if (dir == None)
+					return None;
+				p = end + 1;
+			}
+			m_lastdir.assign(path, path + prefix);
+			m_last = dir;
+		}
+	}
+
+	offset = m_files.alloc(sizeof(File));
+	if (offset == None)
+		return None;
+	f = (File *)m_files.at(offset);
+	f->dir = dir;
+	f->name = string(name, path + len - name);
+	if (f->name == None)
+		return None;
+	m_count++;
+
+	return offset / sizeof(File);
+}
+
+uint32_t PathArena::findDir(const char *path, int len) const
+{
+	const char *end = path + len;
+	uint32_t dir = 0, slot;
+
+	for (const char *p = path; ; ) {
+		const char *q = (const char *)memchr(p, '/', end - p);
+
+		if (q == NULL)
+			q = end;
+		dir = lookup(dir, p, q - p, &slot);
+		if (dir == None || q == end)
+			return dir;
+		p = q + 1;
+	}
+}
+
+bool PathArena::under(uint32_t dir, uint32_t ancestor) const
+{
+	uint32_t depth = getDir(ancestor)->depth;
+
+	while (getDir(dir)->depth > depth)
+		dir = getDir(dir)->parent;
+
+	return dir == ancestor;
+}
+
+uint32_t PathArena::parent(uint32_t dir) const
+{
+	return getDir(dir)->parent;
+}
+
+const char *PathArena::dirName(uint32_t dir) const
+{
+	return (const char *)m_chars.at(getDir(dir)->name);
+}
+
+/* segments are multiples of the record size, so records are packed */
+uint32_t PathArena::dirNumber(uint32_t dir) const
+{
+	return dir / sizeof(Dir);
+}
+
+const PathArena::Dir *PathArena::getDir(uint32_t dir) const
+{
+	return (const Dir *)m_dirs.at(dir);
+}
+
+const PathArena::File *PathArena::getFile(uint32_t id) const
+{
+	return (const File *)m_files.at(id * sizeof(File));
+}
+
+/* copies the part of [pos, pos + n) that fits before the terminator */
+static void put(char *buf, int len, int pos, const char *src, int n)
+{
+	if (pos >= len - 1)
+		return;
+	if (pos + n > len - 1)
+		n = len - 1 - pos;
+	memcpy(buf + pos, src, n);
+}
+
+int PathArena::path(uint32_t id, char *buf, int len) const
+{
+	const File *f = getFile(id);
+	const char *name = (const char *)m_chars.at(f->name);
+	int total = getDir(f->dir)->length + strlen(name);
+
+	if (len <= 0)
+		return total;
+
+	/* directories are filled in from the file name outwards */
+	put(buf, len, getDir(f->dir)->length, name, strlen(name));
+	for (uint32_t dir = f->dir; getDir(dir)->parent != None;
+			dir = getDir(dir)->parent) {
+		const Dir *d = getDir(dir);
+		const char *s = (const char *)m_chars.at(d->name);
+		int n = strlen(s);
+
+		put(buf, len, d->length - 1 - n, s, n);
+		put(buf, len, d->length - 1, "/", 1);
+	}
+	buf[total < len - 1 ? total : len - 1] = 0;
+
+	return total;
+}
+
+const char *PathArena::name(uint32_t id) const
+{
+	return (const char *)m_chars.at(getFile(id)->name);
+}
+
+uint32_t PathArena::dir(uint32_t id) const
+{
+	return getFile(id)->dir;
+}
+
+/* s, followed by a '/' for directories */
+static int component(char *buf, const char *s, bool dir)
+{
+	int n = strlen(s);
+
+	memcpy(buf, s, n);
+	if (dir)
+		buf[n++] = '/';
+	buf[n] = 0;
+
+	return n;
+}
+
+int PathArena::compare(uint32_t a, uint32_t b) const
+{
+	char l[MAX_PATH_LEN + 1], r[MAX_PATH_LEN + 1];
+	uint32_t da = dir(a), db = dir(b);
+	const char *ca = name(a), *cb = name(b);
+	bool adir = false, bdir = false;
+
+	/*
+	 * A shared prefix ending in '/' doesn't change strverscmp()'s
+	 * verdict, and neither does anything past the first '/' after the
+	 * point where the paths part ways.  So only the first components
+	 * below the deepest common directory need comparing.
+	 */
+	if (da == db)
+		return strverscmp(ca, cb);
+
+	while (getDir(da)->depth > getDir(db)->depth) {
+		ca = (const char *)m_chars.at(getDir(da)->name);
+		adir = true;
+		da = getDir(da)->parent;
+	}
+	while (getDir(db)->depth > getDir(da)->depth) {
+		cb = (const char *)m_chars.at(getDir(db)->name);
+		bdir = true;
+		db = getDir(db)->parent;
+	}
+	while (da != db) {
+		ca = (const char *)m_chars.at(getDir(da)->name);
+		cb = (const char *)m_chars.at(getDir(db)->name);
+		adir = bdir = true;
+		da = getDir(da)->parent;
+		db = getDir(db)->parent;
+	}
+
+	component(l, ca, adir);
+	component(r, cb, bdir);
+
+	return strverscmp(l, r);
+}
+
+uint32_t PathArena::count(void) const
+{
+	return m_count;
+}
+
+size_t PathArena::memoryUsage(void) const
+{
+	return m_chars.used() + m_dirs.used() + m_files.used() +
+		m_hash.capacity() * sizeof(m_hash[0]) + m_lastdir.capacity();
+}
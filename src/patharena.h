@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Append-only store for the paths of a playlist.  Each directory is
+ * kept once, as its last component plus a reference to its parent, and
+ * a path is a directory and a file name, so an entry costs 8 bytes plus
+ * its name.  Everything is addressed by 32-bit offsets into segments
+ * that never move, which lets readers look up published ids without
+ * locking while a single writer (serialized by the caller) adds more.
+ */
+class PathArena {
+public:
+	static const uint32_t None = 0xffffffff;
+
+	PathArena();
+	~PathArena();
+
+	/* returns the new path's id, or None if the arena is full */
+	uint32_t add(const char *path);
+	/* the same for path[0, len), which needn't be terminated */
+	uint32_t add(const char *path, int len);
+
+	/* writes the full path, truncated to len; returns its length */
+	int path(uint32_t id, char *buf, int len) const;
+	const char *name(uint32_t id) const;
+	uint32_t dir(uint32_t id) const;
+	/* strverscmp() order of the full paths */
+	int compare(uint32_t a, uint32_t b) const;
+
+	/*
+	 * The directory path[0, len) (no trailing '/'), or None if nothing
+	 * in it was ever added.  Only safe where add() can't run meanwhile.
+	 */
+	uint32_t findDir(const char *path, int len) const;
+	/* true if dir is ancestor or one of its subdirectories */
+	bool under(uint32_t dir, uint32_t ancestor) const;
+
+	/*
+	 * Directories as returned by dir(): their parent (None for the top
+	 * one) and last component, and a dense numbering from 0 for the top
+	 * one, in the order they were added.
+	 */
+	uint32_t parent(uint32_t dir) const;
+	const char *dirName(uint32_t dir) const;
+	uint32_t dirNumber(uint32_t dir) const;
+
+	uint32_t count(void) const;
+	/* bytes in use, excluding playlists that refer to the paths */
+	size_t memoryUsage(void) const;
+
+private:
+	class Segments {
+	public:
+		Segments();
+		~Segments();
+
+		/* len contiguous bytes; None if the 32-bit space is used up */
+		uint32_t alloc(uint32_t len);
+		void *at(uint32_t offset) const;
+		size_t used(void) const;
+
+	private:
+		static const int MaxSegments = 21;
+
+		char     *m_segments[MaxSegments];
+		uint64_t  m_used;
+	};
+
+	struct Dir {
+		uint32_t parent;
+		uint32_t name;
+		uint32_t length;   /* of the full directory, trailing '/' included */
+		uint32_t depth;
+	};
+
+	struct File {
+		uint32_t dir;
+		uint32_t name;
+	};
+
+	uint32_t lookup(uint32_t parent, const char *name, int len, uint32_t *slot) const;
+	uint32_t intern(uint32_t parent, const char *name, int len);
+	uint32_t string(const char *str, int len);
+	const Dir *getDir(uint32_t dir) const;
+	const File *getFile(uint32_t id) const;
+	void rehash(void);
+
+	Segments              m_chars;
+	Segments              m_dirs;
+	Segments              m_files;
+	std::vector<uint32_t> m_hash;
+	uint32_t              m_ndirs;
+	uint32_t              m_count;
+
+	/* appends usually come a directory at a time */
+	std::vector<char>     m_lastdir;
+	uint32_t              m_last;
+};
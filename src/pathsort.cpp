@@ -0,0 +1,381 @@
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+
+#include "thread.h"
+#include "pathsort.h"
+
+/* entries per part below which splitting the work costs more than it saves */
+#define MIN_PART  16384
+/* a name key that still has to be worked out; real ones only collide harmlessly */
+#define UNENCODED (~0ull)
+
+class PathSorter::Job : public Task {
+public:
+	enum Type {
+		Encode,
+		Place,
+		Sort,
+		Merge,
+	};
+
+	Job()
+	 : sorter(NULL), type(Encode), keys(NULL), ids(NULL), count(0),
+	   b(NULL), nb(0), out(NULL), from(0), to(0)
+	{ }
+
+	void run(void)
+	{
+		switch (type) {
+		case Encode:
+			sorter->encode(keys, ids, count);
+			break;
+		case Place:
+			sorter->place(keys, count);
+			break;
+		case Sort:
+			std::sort(keys, keys + count, Order(sorter->m_paths));
+			break;
+		case Merge:
+			sorter->merge(keys, count, b, nb, out, from, to);
+			break;
+		}
+	}
+
+	PathSorter     *sorter;
+	Type            type;
+	Key            *keys;
+	const uint32_t *ids;
+	int             count;
+	/* merges keys and b into out[from, to) of their merged order */
+	const Key      *b;
+	int             nb;
+	Key            *out;
+	int             from;
+	int             to;
+};
+
+/* runs the first job here and the rest on the pool */
+static void runAll(std::vector<Task *> &jobs)
+{
+	ThreadPool &pool = ThreadPool::shared();
+
+	for (unsigned int i = 1; i < jobs.size(); ++i)
+		pool.submit(jobs[i]);
+	if (!jobs.empty())
+		jobs[0]->run();
+	for (unsigned int i = 1; i < jobs.size(); ++i)
+		jobs[i]->wait();
+	for (unsigned int i = 0; i < jobs.size(); ++i)
+		delete jobs[i];
+	jobs.clear();
+}
+
+/*
+ * The first 8 bytes of name, rewritten so that comparing them as a
+ * big-endian number never disagrees with strverscmp().  Other bytes
+ * stay as they are.  A run of digits, which strverscmp() orders by
+ * length first, becomes '0' + its length and then the digits two to a
+ * byte; both sort like any digit against other bytes.  Where that gets
+ * too subtle (leading zeros, runs longer than 8) the key stops with '0'
+ * or '9', so such names tie and get compared in full.
+ */
+static uint64_t encodeName(const char *name)
+{
+	const unsigned char *s = (const unsigned char *)name;
+	unsigned char key[8];
+	int n = 0;
+
+	while (n < 8 && *s) {
+		int len = 0;
+
+		if (*s < '0' || *s > '9') {
+			key[n++] = *s++;
+			continue;
+		}
+		while (s[len] >= '0' && s[len] <= '9')
+			len++;
+		if (*s == '0' || len > 8) {
+			key[n++] = *s == '0' ? '0' : '9';
+			break;
+		}
+		key[n++] = '0' + len;
+		for (int i = 0; i < len && n < 8; i += 2)
+			key[n++] = (s[i] - '0') << 4 | (i + 1 < len ? s[i + 1] - '0' : 0);
+		s += len;
+	}
+
+	uint64_t value = 0;
+	for (int i = 0; i < 8; ++i)
+		value = value << 8 | (i < n ? key[i] : 0);
+
+	return value;
+}
+
+struct DirOrder {
+	DirOrder(const std::vector<std::string> &names)
+	 : names(names)
+	{ }
+
+	bool operator()(uint32_t a, uint32_t b) const
+	{
+		return strverscmp(names[a].c_str(), names[b].c_str()) < 0;
+	}
+
+	const std::vector<std::string> &names;
+};
+
+bool PathSorter::Order::operator()(const Key &a, const Key &b) const
+{
+	if (a.slot != b.slot)
+		return a.slot < b.slot;
+	if (a.name != b.name)
+		return a.name < b.name;
+
+	return strverscmp(paths.name(a.id), paths.name(b.id)) < 0;
+}
+
+PathSorter::PathSorter(const PathArena &paths)
+ : m_paths(paths)
+{ }
+
+PathSorter::~PathSorter()
+{ }
+
+/* keys with names, and their directory in place of the slot for now */
+void PathSorter::encode(Key *keys, const uint32_t *ids, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		uint32_t id = ids[i];
+
+		if (m_names[id] == UNENCODED)
+			m_names[id] = encodeName(m_paths.name(id));
+		keys[i].slot = m_paths.dir(id);
+		keys[i].id = id;
+		keys[i].name = m_names[id];
+	}
+}
+
+/*
+ * The directories the keys are in, and their ancestors, as a tree with
+ * each directory's subdirectories in order.  A directory's files can
+ * fall before, between or after its subdirectories, so it has a gap for
+ * each of those, and numbering all gaps depth first gives slots whose
+ * order is the order of the paths in them.
+ */
+void PathSorter::layout(const Key *keys, int count)
+{
+	std::vector<std::pair<uint32_t, uint32_t> > stack;
+	std::vector<std::string> names;
+	uint32_t ndirs = 0, last = PathArena::None;
+	uint32_t next = 0;
+
+	for (int i = 0; i < count; ++i)
+		ndirs = std::max(ndirs, m_paths.dirNumber(keys[i].slot) + 1);
+	m_dirs.assign(ndirs, PathArena::None);
+	for (int i = 0; i < count; ++i) {
+		/* parents come before their subdirectories */
+		for (uint32_t dir = keys[i].slot; dir != last && dir != PathArena::None &&
+				m_dirs[m_paths.dirNumber(dir)] == PathArena::None;
+				dir = m_paths.parent(dir))
+			m_dirs[m_paths.dirNumber(dir)] = dir;
+		last = keys[i].slot;
+	}
+
+	m_first.assign(ndirs + 1, 0);
+	for (uint32_t d = 1; d < ndirs; ++d) {
+		if (m_dirs[d] != PathArena::None)
+			m_first[m_paths.dirNumber(m_paths.parent(m_dirs[d])) + 1]++;
+	}
+	for (uint32_t d = 0; d < ndirs; ++d)
+		m_first[d + 1] += m_first[d];
+
+	std::vector<uint32_t> fill(m_first.begin(), m_first.end() - 1);
+	m_children.resize(m_first[ndirs]);
+	for (uint32_t d = 1; d < ndirs; ++d) {
+		if (m_dirs[d] != PathArena::None)
+			m_children[fill[m_paths.dirNumber(m_paths.parent(m_dirs[d]))]++] = d;
+	}
+
+	/* as compare() has it, a directory is its name followed by a '/' */
+	names.resize(ndirs);
+	for (uint32_t d = 1; d < ndirs; ++d) {
+		if (m_dirs[d] != PathArena::None)
+			names[d] = std::string(m_paths.dirName(m_dirs[d])) + "/";
+	}
+	for (uint32_t d = 0; d < ndirs; ++d) {
+		std::sort(m_children.begin() + m_first[d], m_children.begin() + m_first[d + 1],
+				DirOrder(names));
+	}
+
+	m_slots.assign(m_first[ndirs] + ndirs, 0);
+	stack.push_back(std::make_pair(0u, 0u));
+	while (!stack.empty()) {
+		uint32_t d = stack.back().first, gap = stack.back().second;
+
+		m_slots[m_first[d] + d + gap] = next++;
+		if (gap == m_first[d + 1] - m_first[d]) {
+			stack.pop_back();
+			continue;
+		}
+		stack.back().second++;
+		stack.push_back(std::make_pair(m_children[m_first[d] + gap], 0u));
+	}
+}
+
+/* from directories to the slots of the gaps the names fall in */
+void PathSorter::place(Key *keys, int count)
+{
+	char name[4098];
+
+	for (int i = 0; i < count; ++i) {
+		uint32_t d = m_paths.dirNumber(keys[i].slot);
+		uint32_t lo = m_first[d], hi = m_first[d + 1];
+		const char *file;
+
+		if (lo == hi) {
+			keys[i].slot = m_slots[m_first[d] + d];
+			continue;
+		}
+
+		/* the subdirectories that come before it */
+		file = m_paths.name(keys[i].id);
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			const char *dir = m_paths.dirName(m_dirs[m_children[mid]]);
+			int len = strlen(dir);
+
+			memcpy(name, dir, len);
+			name[len] = '/';
+			name[len + 1] = 0;
+			if (strverscmp(file, name) > 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		keys[i].slot = m_slots[m_first[d] + d + (lo - m_first[d])];
+	}
+}
+
+void PathSorter::merge(const Key *a, int na, const Key *b, int nb, Key *out, int from, int to)
+{
+	Order less(m_paths);
+	int lo, hi, i, j;
+
+	/* how many of the first from entries come from a; on ties, a goes first */
+	lo = std::max(0, from - nb);
+	hi = std::min(from, na);
+	while (lo < hi) {
+		i = lo + (hi - lo) / 2;
+		if (!less(b[from - i - 1], a[i]))
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	i = lo;
+	j = from - i;
+
+	for (int k = from; k < to; ++k) {
+		if (j >= nb || (i < na && !less(b[j], a[i])))
+			out[k] = a[i++];
+		else
+			out[k] = b[j++];
+	}
+}
+
+void PathSorter::sort(uint32_t *ids, int count)
+{
+	int parts = std::min(ThreadPool::shared().size(), std::max(1, count / MIN_PART));
+	std::vector<Task *> jobs;
+	std::vector<int> runs;
+	uint32_t maxid = 0;
+	Key *keys, *tmp;
+
+	if (count <= 1)
+		return;
+
+	for (int i = 0; i < count; ++i)
+		maxid = std::max(maxid, ids[i]);
+	if (m_names.size() <= maxid)
+		m_names.resize(maxid + 1, UNENCODED);
+
+	keys = new Key[count];
+	tmp = new Key[count];
+	for (int p = 0; p <= parts; ++p)
+		runs.push_back((int64_t)count * p / parts);
+
+	for (int p = 0; p < parts; ++p) {
+		Job *job = new Job;
+
+		job->sorter = this;
+		job->type = Job::Encode;
+		job->keys = keys + runs[p];
+		job->ids = ids + runs[p];
+		job->count = runs[p + 1] - runs[p];
+		jobs.push_back(job);
+	}
+	runAll(jobs);
+
+	layout(keys, count);
+
+	for (int p = 0; p < parts; ++p) {
+		Job *job = new Job;
+
+		job->sorter = this;
+		job->type = Job::Place;
+		job->keys = keys + runs[p];
+		job->count = runs[p + 1] - runs[p];
+		jobs.push_back(job);
+	}
+	runAll(jobs);
+
+	for (int p = 0; p < parts; ++p) {
+		Job *job = new Job;
+
+		job->sorter = this;
+		job->type = Job::Sort;
+		job->keys = keys + runs[p];
+		job->count = runs[p + 1] - runs[p];
+		jobs.push_back(job);
+	}
+	runAll(jobs);
+
+	/* pairs of runs merge in rounds; each merge is split between workers */
+	while (runs.size() > 2) {
+		std::vector<int> merged;
+
+		for (unsigned int r = 0; r + 1 < runs.size(); r += 2) {
+			int lo = runs[r];
+			int mid = runs[r + 1];
+			int hi = r + 2 < runs.size() ? runs[r + 2] : mid;
+			int pieces = std::max(1, (int)((int64_t)parts * (hi - lo) / count));
+
+			for (int k = 0; k < pieces; ++k) {
+				Job *job = new Job;
+
+				job->sorter = this;
+				job->type = Job::Merge;
+				job->keys = keys + lo;
+				job->count = mid - lo;
+				job->b = keys + mid;
+				job->nb = hi - mid;
+				job->out = tmp + lo;
+				job->from = (int64_t)(hi - lo) * k / pieces;
+				job->to = (int64_t)(hi - lo) * (k + 1) / pieces;
+				jobs.push_back(job);
+			}
+			merged.push_back(lo);
+		}
+		merged.push_back(count);
+		runAll(jobs);
+		std::swap(keys, tmp);
+		runs.swap(merged);
+	}
+
+	for (int i = 0; i < count; ++i)
+		ids[i] = keys[i].id;
+
+	delete[] keys;
+	delete[] tmp;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "patharena.h"
+
+/*
+ * Puts ids of a PathArena in PathArena::compare() order, in parallel on
+ * the shared pool.  Every entry gets a key once per sort: the stretch of
+ * the directory tree it falls in, numbered in tree order, and the start
+ * of its name encoded so that comparing keys agrees with strverscmp().
+ * Names are only compared as strings where keys tie.  Name keys are kept
+ * by id, so sorting again after appends only encodes what is new.  One
+ * sort at a time.
+ */
+class PathSorter {
+public:
+	PathSorter(const PathArena &paths);
+	~PathSorter();
+
+	void sort(uint32_t *ids, int count);
+
+private:
+	class Job;
+
+	struct Key {
+		uint32_t slot;
+		uint32_t id;
+		uint64_t name;
+	};
+
+	struct Order {
+		Order(const PathArena &paths)
+		 : paths(paths)
+		{ }
+
+		bool operator()(const Key &a, const Key &b) const;
+
+		const PathArena &paths;
+	};
+
+	void encode(Key *keys, const uint32_t *ids, int count);
+	void place(Key *keys, int count);
+	void layout(const Key *keys, int count);
+	void merge(const Key *a, int na, const Key *b, int nb, Key *out, int from, int to);
+
+	const PathArena &m_paths;
+	std::vector<uint64_t> m_names;   /* by id */
+	/* the directory tree of the entries being sorted, by dirNumber() */
+	std::vector<uint32_t> m_dirs;
+	std::vector<uint32_t> m_first;   /* of a directory's subdirectories in m_children */
+	std::vector<uint32_t> m_children;
+	std::vector<uint32_t> m_slots;   /* of gaps between subdirectories, m_first + number */
+};
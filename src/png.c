@@ -26,6 +26,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <png.h>
@@ -162,3 +163,98 @@ err_exit:
 
 	return -1;
 }
+
+static unsigned int png_be32(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+int ReadPNGText(void *pRaw, int rawlen, const char *key, char *value, int len)
+{
+	const unsigned char *p = (const unsigned char *)pRaw;
+	int keylen = strlen(key);
+	int off = 8;
+
+	if (rawlen < 8 || png_sig_cmp((png_bytep)pRaw, 0, 8) != 0)
+		return -1;
+
+	while (off + 12 <= rawlen) {
+		unsigned int clen = png_be32(p + off);
+		const unsigned char *data = p + off + 8;
+
+		if (clen > (unsigned int)(rawlen - off - 12))
+			break;
+		if (!memcmp(p + off + 4, "IEND", 4))
+			break;
+		if (!memcmp(p + off + 4, "tEXt", 4) && (int)clen > keylen &&
+				!memcmp(data, key, keylen) && data[keylen] == 0) {
+			int n = clen - keylen - 1;
+			if (n >= len)
+				n = len - 1;
+			memcpy(value, data + keylen + 1, n);
+			value[n] = 0;
+			return 0;
+		}
+		off += clen + 12;
+	}
+
+	return -1;
+}
+
+/* writes to fp, and closes it */
+int SavePNGFile(FILE *fp, const void *pData, unsigned int uWidth, unsigned int uHeight, const char **text)
+{
+	png_structp png_ptr;
+	png_infop info_ptr;
+	png_text *ptext = NULL;
+	int ntext = 0;
+	unsigned int i;
+
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr) {
+		fclose(fp);
+		return -1;
+	}
+
+	info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr) {
+		png_destroy_write_struct(&png_ptr, NULL);
+		fclose(fp);
+		return -1;
+	}
+
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		free(ptext);
+		fclose(fp);
+		return -1;
+	}
+
+	png_init_io(png_ptr, fp);
+	png_set_IHDR(png_ptr, info_ptr, uWidth, uHeight, 8,
+		PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+		PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+	/* text is a NULL terminated list of key/value pairs */
+	while (text != NULL && text[ntext * 2] != NULL)
+		ntext++;
+	if (ntext) {
+		ptext = (png_text *)calloc(ntext, sizeof(png_text));
+		for (i = 0; i < (unsigned int)ntext; ++i) {
+			ptext[i].compression = PNG_TEXT_COMPRESSION_NONE;
+			ptext[i].key = (png_charp)text[i * 2];
+			ptext[i].text = (png_charp)text[i * 2 + 1];
+		}
+		png_set_text(png_ptr, info_ptr, ptext, ntext);
+	}
+
+	png_write_info(png_ptr, info_ptr);
+	for (i = 0; i < uHeight; ++i)
+		png_write_row(png_ptr, (png_bytep)pData + i * uWidth * 4);
+	png_write_end(png_ptr, info_ptr);
+
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	free(ptext);
+
+	return fclose(fp) ? -1 : 0;
+}
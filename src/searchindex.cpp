@@ -0,0 +1,344 @@
+#include <string.h>
+#include <algorithm>
+#include <utility>
+
+#include "searchindex.h"
+
+/* ids per block in the lists; a block is a candidate as a whole */
+#define BLOCK_SHIFT   3
+/* names indexed per lock, so that queries never wait long */
+#define INDEX_BATCH   16384
+/* lists this much longer than a query's shortest one are not worth reading */
+#define MAX_RATIO     32
+
+static inline unsigned char fold(unsigned char c)
+{
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static inline uint32_t trigram(const char *s)
+{
+	return fold(s[0]) << 16 | fold(s[1]) << 8 | fold(s[2]);
+}
+
+static inline uint32_t hash(uint32_t key)
+{
+	uint32_t h = key * 2654435761u;
+
+	/* the low bits get picked, so let the high ones in */
+	return h ^ (h >> 16);
+}
+
+/* reads a list from the start, one block at a time */
+struct Reader {
+	Reader(const std::vector<uint8_t> &deltas)
+	 : p(deltas.empty() ? NULL : &deltas[0]), end(p + deltas.size()), block(0), first(true)
+	{ }
+
+	/* false at the end of the list */
+	bool next(void)
+	{
+		uint32_t delta = 0;
+		int shift = 0;
+
+		if (p == end)
+			return false;
+		do {
+			delta |= (uint32_t)(*p & 0x7f) << shift;
+			shift += 7;
+		} while (*p++ & 0x80);
+		block = first ? delta : block + delta;
+		first = false;
+
+		return true;
+	}
+
+	const uint8_t *p;
+	const uint8_t *end;
+	uint32_t       block;
+	bool           first;
+};
+
+SearchIndex::SearchIndex(const PathArena &paths)
+ : m_paths(paths), m_slots(1024, 0), m_indexed(0), m_count(0), m_quit(false)
+{
+	/* last, so the indexer sees everything above */
+	m_thread = new Thread(indexer, this);
+}
+
+SearchIndex::~SearchIndex()
+{
+	__atomic_store_n(&m_quit, true, __ATOMIC_RELEASE);
+	m_wake.notify();
+	m_thread->join();
+	delete m_thread;
+}
+
+void SearchIndex::grow(uint32_t count)
+{
+	__atomic_store_n(&m_count, count, __ATOMIC_RELEASE);
+	m_wake.notify();
+}
+
+uint32_t SearchIndex::indexed(void) const
+{
+	return __atomic_load_n(&m_indexed, __ATOMIC_ACQUIRE);
+}
+
+size_t SearchIndex::memoryUsage(void)
+{
+	size_t total;
+
+	m_lock.lock();
+	total = m_lists.capacity() * sizeof(m_lists[0]) + m_slots.capacity() * sizeof(m_slots[0]);
+	for (unsigned int i = 0; i < m_lists.size(); ++i)
+		total += m_lists[i].deltas.capacity() + m_lists[i].bits.capacity() * 4;
+	m_lock.unlock();
+
+	return total;
+}
+
+const SearchIndex::List *SearchIndex::lookup(uint32_t key) const
+{
+	uint32_t mask = m_slots.size() - 1;
+
+	for (uint32_t h = hash(key); m_slots[h & mask] != 0; ++h) {
+		if (m_lists[m_slots[h & mask] - 1].key == key)
+			return &m_lists[m_slots[h & mask] - 1];
+	}
+
+	return NULL;
+}
+
+SearchIndex::List &SearchIndex::insert(uint32_t key)
+{
+	uint32_t mask = m_slots.size() - 1;
+	uint32_t h;
+
+	for (h = hash(key); m_slots[h & mask] != 0; ++h) {
+		if (m_lists[m_slots[h & mask] - 1].key == key)
+			return m_lists[m_slots[h & mask] - 1];
+	}
+
+	m_lists.push_back(List());
+	m_lists.back().key = key;
+	m_lists.back().count = 0;
+	m_lists.back().last = 0;
+	m_slots[h & mask] = m_lists.size();
+
+	/* no more than half full */
+	if (m_lists.size() * 2 > m_slots.size()) {
+		m_slots.assign(m_slots.size() * 2, 0);
+		mask = m_slots.size() - 1;
+		for (unsigned int i = 0; i < m_lists.size(); ++i) {
+			for (h = hash(m_lists[i].key); m_slots[h & mask] != 0; ++h)
+				;
+			m_slots[h & mask] = i + 1;
+		}
+	}
+
+	return m_lists.back();
+}
+
+/* blocks come in ascending order */
+void SearchIndex::add(List &list, uint32_t block)
+{
+	uint32_t delta;
+
+	list.count++;
+	if (!list.bits.empty()) {
+		if (block / 32 >= list.bits.size())
+			list.bits.resize(block / 32 + 1, 0);
+		list.bits[block / 32] |= 1u << block % 32;
+		list.last = block + 1;
+		return;
+	}
+
+	delta = list.last == 0 ? block : block + 1 - list.last;
+	while (delta >= 0x80) {
+		list.deltas.push_back(delta | 0x80);
+		delta >>= 7;
+	}
+	list.deltas.push_back(delta);
+	list.last = block + 1;
+
+	/* a bit per block now takes less */
+	if (list.deltas.size() > list.last / 8 + 64) {
+		Reader reader(list.deltas);
+
+		list.bits.assign(list.last / 32 + 1, 0);
+		while (reader.next())
+			list.bits[reader.block / 32] |= 1u << reader.block % 32;
+		std::vector<uint8_t>().swap(list.deltas);
+	}
+}
+
+void SearchIndex::indexer(void *data)
+{
+	((SearchIndex *)data)->run();
+}
+
+void SearchIndex::run(void)
+{
+	std::vector<std::pair<uint32_t, uint32_t> > keys;
+	unsigned int key;
+
+	Sched::setName("search");
+	Sched::enterBackground();
+
+	for (;;) {
+		uint32_t from = m_indexed;
+		uint32_t to;
+
+		key = m_wake.prepare();
+		if (__atomic_load_n(&m_quit, __ATOMIC_ACQUIRE))
+			break;
+		to = __atomic_load_n(&m_count, __ATOMIC_ACQUIRE);
+		if (to <= from) {
+			m_wake.wait(key);
+			continue;
+		}
+		to = std::min(to, from + INDEX_BATCH);
+
+		/* the work is done here; the lock is only held to file it */
+		keys.clear();
+		for (uint32_t id = from; id < to; ++id) {
+			const char *name = m_paths.name(id);
+
+			for (int i = 0; name[i] && name[i + 1] && name[i + 2]; ++i)
+				keys.push_back(std::make_pair(trigram(name + i), id >> BLOCK_SHIFT));
+		}
+
+		m_lock.lock();
+		for (unsigned int i = 0; i < keys.size(); ++i) {
+			List &list = insert(keys[i].first);
+
+			/* ids come in order, so repeats within a block are always last */
+			if (list.last != keys[i].second + 1)
+				add(list, keys[i].second);
+		}
+		__atomic_store_n(&m_indexed, to, __ATOMIC_RELEASE);
+		m_lock.unlock();
+	}
+}
+
+/* names are never run through the locale, so this folds ASCII only */
+bool SearchIndex::matches(const char *name, const char *text)
+{
+	return strcasestr(name, text) != NULL;
+}
+
+void SearchIndex::scan(const char *text, uint32_t from, uint32_t to,
+		std::vector<uint32_t> &ids) const
+{
+	for (uint32_t id = from; id < to; ++id) {
+		if (matches(m_paths.name(id), text))
+			ids.push_back(id);
+	}
+}
+
+/* shortest first; the same list twice ends up side by side */
+template <typename List>
+struct Shorter {
+	bool operator()(const List *a, const List *b) const
+	{
+		if (a->count != b->count)
+			return a->count < b->count;
+		return a < b;
+	}
+};
+
+bool SearchIndex::find(const char *text, uint32_t limit, std::vector<uint32_t> &ids,
+		uint32_t most)
+{
+	std::vector<const List *> lists, sparse, dense;
+	std::vector<Reader> readers;
+	std::vector<uint32_t> blocks;
+	int n = strlen(text);
+	uint32_t indexed;
+	uint64_t budget;
+	bool done = false;
+
+	if (n == 0)
+		return true;
+
+	m_lock.lock();
+	indexed = std::min(m_indexed, limit);
+	/* too short to have a trigram; everything is a candidate */
+	if (n < 3 || limit - indexed > most) {
+		m_lock.unlock();
+		if (limit > most)
+			return false;
+		scan(text, 0, limit, ids);
+		return true;
+	}
+	/* in blocks; the names not indexed yet are candidates too */
+	budget = (most - (limit - indexed)) >> BLOCK_SHIFT;
+
+	for (int i = 0; i + 2 < n; ++i) {
+		const List *list = lookup(trigram(text + i));
+
+		/* a trigram no name has */
+		if (list == NULL) {
+			lists.clear();
+			break;
+		}
+		lists.push_back(list);
+	}
+	std::sort(lists.begin(), lists.end(), Shorter<List>());
+	lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+	for (unsigned int i = 0; i < lists.size(); ++i) {
+		if (!lists[i]->bits.empty())
+			dense.push_back(lists[i]);
+		else if (sparse.empty() || lists[i]->count / MAX_RATIO <= sparse[0]->count)
+			sparse.push_back(lists[i]);
+	}
+	for (unsigned int i = 0; i < sparse.size(); ++i)
+		readers.push_back(Reader(sparse[i]->deltas));
+
+	/* the shortest list against the others, all read in step */
+	for (unsigned int j = 1; j < readers.size(); ++j)
+		done |= !readers[j].next();
+	while (!readers.empty() && !done && readers[0].next()) {
+		uint32_t block = readers[0].block;
+		unsigned int j;
+
+		for (j = 1; j < readers.size(); ++j) {
+			while (readers[j].block < block && !done)
+				done = !readers[j].next();
+			if (readers[j].block != block)
+				break;
+		}
+		if (j < readers.size())
+			continue;
+		for (j = 0; j < dense.size() && dense[j]->has(block); ++j)
+			;
+		if (j == dense.size())
+			blocks.push_back(block);
+		done |= blocks.size() > budget;
+	}
+	/* only common trigrams; their bitmaps a word at a time */
+	if (readers.empty() && !dense.empty()) {
+		for (unsigned int w = 0; w < dense[0]->bits.size() && blocks.size() <= budget; ++w) {
+			uint32_t word = dense[0]->bits[w];
+
+			for (unsigned int j = 1; j < dense.size() && word != 0; ++j)
+				word &= w < dense[j]->bits.size() ? dense[j]->bits[w] : 0;
+			for (; word != 0; word &= word - 1)
+				blocks.push_back(w * 32 + __builtin_ctz(word));
+		}
+	}
+	m_lock.unlock();
+	if (blocks.size() > budget)
+		return false;
+
+	for (unsigned int i = 0; i < blocks.size(); ++i) {
+		uint32_t first = blocks[i] << BLOCK_SHIFT;
+
+		scan(text, first, std::min(first + (1 << BLOCK_SHIFT), indexed), ids);
+	}
+	/* appended since the indexer last caught up */
+	scan(text, indexed, limit, ids);
+
+	return true;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "thread.h"
+#include "patharena.h"
+
+/*
+ * Finds the ids of a PathArena whose file names contain some text,
+ * ignoring ASCII case.  Names are indexed by their trigrams on a thread
+ * of its own, as grow() makes them available.  Each trigram lists the
+ * blocks of consecutive ids that have it, since neighbouring ids tend
+ * to share most of theirs, delta coded at about a byte per block, or as
+ * a bitmap for trigrams common enough that it is smaller.  Only names in
+ * blocks that have all of a query's trigrams are compared in full.
+ * Whatever isn't indexed yet is searched the slow way, so results are
+ * always complete.
+ */
+class SearchIndex {
+public:
+	SearchIndex(const PathArena &paths);
+	~SearchIndex();
+
+	/* ids below count are in the arena, and may be indexed */
+	void grow(uint32_t count);
+	/*
+	 * Appends to ids, in ascending order, those below limit that match.
+	 * Returns false, with ids untouched, if more than most names would
+	 * have to be compared.
+	 */
+	bool find(const char *text, uint32_t limit, std::vector<uint32_t> &ids, uint32_t most);
+
+	/* the same test for a single name */
+	static bool matches(const char *name, const char *text);
+
+	/* ids indexed so far, and bytes used for them */
+	uint32_t indexed(void) const;
+	size_t memoryUsage(void);
+
+private:
+	/* once a bitmap of the blocks is smaller than their deltas, it is that */
+	struct List {
+		std::vector<uint8_t>  deltas;
+		std::vector<uint32_t> bits;
+		uint32_t              key;
+		uint32_t              count;
+		uint32_t              last;   /* block, plus one */
+
+		bool has(uint32_t block) const
+		{
+			return block / 32 < bits.size() && bits[block / 32] >> (block % 32) & 1;
+		}
+	};
+
+	const List *lookup(uint32_t key) const;
+	List &insert(uint32_t key);
+	static void add(List &list, uint32_t block);
+	static void indexer(void *data);
+	void run(void);
+	void scan(const char *text, uint32_t from, uint32_t to, std::vector<uint32_t> &ids) const;
+
+	const PathArena &m_paths;
+	Mutex        m_lock;     /* guards m_lists and m_slots */
+	std::vector<List>     m_lists;
+	std::vector<uint32_t> m_slots;   /* hash of trigrams to lists, plus one */
+	uint32_t     m_indexed;
+	uint32_t     m_count;
+	EventCount   m_wake;
+	bool         m_quit;
+	Thread      *m_thread;
+};
@@ -178,3 +178,16 @@ int       server_readline(server_t *srv, char *buf, int len)
 
 	return -1;
 }
+
+int       server_fds(server_t *srv, int *fds, int max)
+{
+	struct server_conn *conn;
+	int n = 0;
+
+	if (n < max)
+		fds[n++] = stcp_fd(srv->stcp);
+	for (conn = srv->connections; conn != NULL && n < max; conn = conn->next)
+		fds[n++] = stcp_fd(conn->stcp);
+
+	return n;
+}
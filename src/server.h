@@ -4,3 +4,5 @@ typedef struct server server_t;
 server_t *server_create(int port);
 void      server_destroy(server_t *);
 int       server_readline(server_t *, char *buf, int len);
+/* fills fds with the sockets to wait on before server_readline(); returns the count */
+int       server_fds(server_t *, int *fds, int max);
@@ -0,0 +1,359 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sharedcache.h"
+
+#define SHAREDCACHE_MAGIC   0x494d4743u /* 'IMGC' */
+#define SHAREDCACHE_VERSION 2
+#define SHAREDCACHE_PROBE   16
+
+struct SharedCache::Header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t reserved;
+	uint64_t ring_offset;
+	uint64_t ring_size;
+	uint64_t head;
+};
+
+struct SharedCache::Slot {
+	uint64_t seq;       /* sequence low, the writer's pid high while odd */
+	uint32_t w, h;
+	uint64_t key;
+	uint64_t pos;
+	uint64_t len;
+};
+
+static uint32_t slot_count(size_t size)
+{
+	uint32_t n = 64;
+
+	/* roughly one slot per 256KiB of ring */
+	while (n < 65536 && ((size_t)n << 18) < size)
+		n <<= 1;
+
+	return n;
+}
+
+SharedCache::SharedCache(const char *name, int fd, void *base, size_t size)
+ : m_header((Header *)base), m_size(size), m_fd(fd), m_name(strdup(name))
+{ }
+
+SharedCache::~SharedCache()
+{
+	munmap(m_header, m_size);
+	/* whoever gets it exclusively is the last one out */
+	if (flock(m_fd, LOCK_EX | LOCK_NB) == 0)
+		shm_unlink(m_name);
+	close(m_fd);
+	free(m_name);
+}
+
+/*
+ * Opens name, holding a shared lock on it for as long as it is in use.
+ * Segments are only unlinked under an exclusive lock, so once ours is
+ * taken name either still refers to the same segment, or it was
+ * unlinked before that and we have to start over.
+ */
+static int attach(const char *name, bool *creator)
+{
+	struct stat st, cur;
+	int fd, check;
+
+	for (int tries = 0; tries < 100; ++tries) {
+		*creator = true;
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd == -1) {
+			if (errno != EEXIST)
+				return -1;
+			*creator = false;
+			fd = shm_open(name, O_RDWR, 0600);
+			if (fd == -1) {
+				if (errno == ENOENT)
+					continue;
+				return -1;
+			}
+		}
+		while (flock(fd, LOCK_SH) == -1) {
+			if (errno != EINTR) {
+				close(fd);
+				return -1;
+			}
+		}
+
+		check = shm_open(name, O_RDONLY, 0600);
+		if (check != -1 && !fstat(fd, &st) && !fstat(check, &cur) &&
+				st.st_dev == cur.st_dev && st.st_ino == cur.st_ino) {
+			close(check);
+			return fd;
+		}
+		if (check != -1)
+			close(check);
+		close(fd);
+	}
+
+	return -1;
+}
+
+SharedCache *SharedCache::create(const char *name, int fd, size_t size)
+{
+	uint32_t nslots = slot_count(size);
+	uint64_t off = sizeof(Header) + nslots * sizeof(Slot);
+	Header *hdr;
+	void *base;
+
+	off = (off + 63) & ~63ull;
+	if (off >= size || ftruncate(fd, size))
+		return NULL;
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	hdr = (Header *)base;
+	hdr->version = SHAREDCACHE_VERSION;
+	hdr->nslots = nslots;
+	hdr->ring_offset = off;
+	hdr->ring_size = size - off;
+	hdr->head = 0;
+	__atomic_store_n(&hdr->magic, SHAREDCACHE_MAGIC, __ATOMIC_RELEASE);
+
+	return new SharedCache(name, fd, base, size);
+}
+
+SharedCache *SharedCache::join(const char *name, int fd, size_t size)
+{
+	struct stat st;
+	Header *hdr;
+	void *base;
+	int tries;
+
+	/* the creator may not have sized it yet */
+	for (tries = 1000; ; usleep(1000)) {
+		if (fstat(fd, &st))
+			return NULL;
+		if (st.st_size >= (off_t)sizeof(Header))
+			break;
+		if (--tries == 0)
+			return NULL;
+	}
+
+	/* the first instance decides the size */
+	if ((size_t)st.st_size != size)
+		fprintf(stderr, "Shared cache is already open with %llu MiB, using that\n",
+				(unsigned long long)st.st_size >> 20);
+	size = st.st_size;
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+	hdr = (Header *)base;
+
+	for (tries = 1000; __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHAREDCACHE_MAGIC;
+			usleep(1000)) {
+		if (--tries == 0) {
+			munmap(base, size);
+			return NULL;
+		}
+	}
+	if (hdr->version != SHAREDCACHE_VERSION ||
+			hdr->ring_offset + hdr->ring_size > size) {
+		munmap(base, size);
+		return NULL;
+	}
+
+	return new SharedCache(name, fd, base, size);
+}
+
+SharedCache *SharedCache::open(const char *name, size_t size)
+{
+	for (int tries = 0; tries < 3; ++tries) {
+		SharedCache *cache;
+		bool creator;
+		int fd;
+
+		fd = attach(name, &creator);
+		if (fd == -1)
+			return NULL;
+		cache = creator ? create(name, fd, size) : join(name, fd, size);
+		if (cache != NULL)
+			return cache;
+
+		/*
+		 * Unusable: half made by a creator that died, or left by an
+		 * older version.  Replace it, unless someone is still using it.
+		 */
+		if (!creator && flock(fd, LOCK_EX | LOCK_NB)) {
+			close(fd);
+			break;
+		}
+		shm_unlink(name);
+		close(fd);
+		if (creator)
+			break;
+	}
+
+	return NULL;
+}
+
+/* an odd slot whose writer died before finishing; anyone may take it over */
+static bool abandoned(uint64_t seq)
+{
+	pid_t pid = seq >> 32;
+
+	return pid != 0 && kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+SharedCache::Slot *SharedCache::slot(unsigned int idx)
+{
+	Slot *slots = (Slot *)(m_header + 1);
+
+	return &slots[idx & (m_header->nslots - 1)];
+}
+
+uint8_t *SharedCache::data(uint64_t pos)
+{
+	return (uint8_t *)m_header + m_header->ring_offset + pos % m_header->ring_size;
+}
+
+bool SharedCache::allocate(uint64_t len, uint64_t *pos)
+{
+	uint64_t ring = m_header->ring_size;
+	uint64_t head;
+
+	head = __atomic_load_n(&m_header->head, __ATOMIC_ACQUIRE);
+	for (;;) {
+		uint64_t start = head;
+
+		/* regions never wrap; skip the tail of the ring instead */
+		if (head % ring + len > ring)
+			start += ring - head % ring;
+
+		if (__atomic_compare_exchange_n(&m_header->head, &head, start + len,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			*pos = start;
+			return true;
+		}
+	}
+}
+
+bool SharedCache::valid(uint64_t pos, uint64_t len)
+{
+	uint64_t head = __atomic_load_n(&m_header->head, __ATOMIC_ACQUIRE);
+
+	/* data is gone once the ring has been claimed a full lap past it */
+	return head <= pos + m_header->ring_size && len <= m_header->ring_size;
+}
+
+void *SharedCache::lookup(uint64_t key, GRE::Dimensions &dims)
+{
+	if (key == 0)
+		return NULL;
+
+	for (unsigned int i = 0; i < SHAREDCACHE_PROBE; ++i) {
+		Slot *s = slot(key + i);
+		uint32_t w, h;
+		uint64_t seq, pos, len;
+		void *ret;
+
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq == 0)
+			return NULL;
+		if ((seq & 1) || __atomic_load_n(&s->key, __ATOMIC_RELAXED) != key)
+			continue;
+
+		w   = __atomic_load_n(&s->w, __ATOMIC_RELAXED);
+		h   = __atomic_load_n(&s->h, __ATOMIC_RELAXED);
+		pos = __atomic_load_n(&s->pos, __ATOMIC_RELAXED);
+		len = __atomic_load_n(&s->len, __ATOMIC_RELAXED);
+		if (len != (uint64_t)w * h * 4 || !valid(pos, len))
+			return NULL;
+
+		ret = malloc(len);
+		if (ret == NULL)
+			return NULL;
+		memcpy(ret, data(pos), len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq || !valid(pos, len)) {
+			free(ret);
+			return NULL;
+		}
+
+		dims = GRE::Dimensions(w, h);
+		return ret;
+	}
+
+	return NULL;
+}
+
+void SharedCache::store(uint64_t key, const void *pixels, const GRE::Dimensions &dims)
+{
+	uint64_t len = (uint64_t)dims.w * dims.h * 4;
+	Slot *victim = NULL;
+	uint64_t vseq = 0;
+	uint64_t vpos = ~0ull;
+	uint64_t pos, claim;
+	uint32_t seq;
+
+	if (key == 0 || len == 0 || len > m_header->ring_size / 2)
+		return;
+
+	for (unsigned int i = 0; i < SHAREDCACHE_PROBE; ++i) {
+		Slot *s = slot(key + i);
+		uint64_t sseq, spos;
+
+		sseq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if ((sseq & 1) && !abandoned(sseq))
+			continue;
+		if (sseq == 0 || (sseq & 1)) {
+			victim = s;
+			vseq = sseq;
+			break;
+		}
+
+		spos = __atomic_load_n(&s->pos, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&s->key, __ATOMIC_RELAXED) == key &&
+				valid(spos, __atomic_load_n(&s->len, __ATOMIC_RELAXED)))
+			return;
+
+		/* prefer stale slots, then the oldest data in the window */
+		if (!valid(spos, 0))
+			spos = 0;
+		if (victim == NULL || spos < vpos) {
+			victim = s;
+			vseq = sseq;
+			vpos = spos;
+		}
+	}
+
+	if (victim == NULL)
+		return;
+	/* the next odd sequence, under our pid */
+	seq = ((uint32_t)vseq + 1) | 1;
+	claim = (uint64_t)getpid() << 32 | seq;
+	if (!__atomic_compare_exchange_n(&victim->seq, &vseq, claim,
+			false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return;
+
+	allocate(len, &pos);
+	memcpy(data(pos), pixels, len);
+
+	__atomic_store_n(&victim->w, dims.w, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->h, dims.h, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->pos, pos, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->len, len, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->key, valid(pos, len) ? key : 0, __ATOMIC_RELAXED);
+
+	if (++seq == 0)
+		seq = 2;
+	__atomic_store_n(&victim->seq, (uint64_t)seq, __ATOMIC_RELEASE);
+}
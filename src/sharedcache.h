@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "gre.h"
+
+/*
+ * Decoded images shared between imager processes through a POSIX shared
+ * memory segment.  The index is lock-free: each slot is guarded by a
+ * sequence counter (odd while being written), and pixel data lives in a
+ * ring that writers claim with a CAS on a monotonic head.  Readers copy
+ * data out and validate that neither the slot nor the ring was reused
+ * underneath them.  A writer that dies mid-store leaves its pid in the
+ * slot, so that the next one can take the slot over.
+ *
+ * The segment lives as long as some instance has it open: every user
+ * holds a shared flock() on it, and the last one out unlinks it.  One
+ * left behind by a crash is reused, then unlinked, by the next run.
+ * Instances opening it later share it at the size the first one gave.
+ */
+class SharedCache {
+public:
+	~SharedCache();
+
+	static SharedCache *open(const char *name, size_t size);
+
+	/* returns malloc'd pixel data on a hit, NULL otherwise */
+	void *lookup(uint64_t key, GRE::Dimensions &dims);
+	void  store(uint64_t key, const void *data, const GRE::Dimensions &dims);
+
+private:
+	struct Header;
+	struct Slot;
+
+	SharedCache(const char *name, int fd, void *base, size_t size);
+
+	static SharedCache *create(const char *name, int fd, size_t size);
+	static SharedCache *join(const char *name, int fd, size_t size);
+
+	Slot *slot(unsigned int idx);
+	uint8_t *data(uint64_t pos);
+	bool allocate(uint64_t len, uint64_t *pos);
+	bool valid(uint64_t pos, uint64_t len);
+
+	Header *m_header;
+	size_t  m_size;
+	int     m_fd;       /* holds the shared lock */
+	char   *m_name;
+};
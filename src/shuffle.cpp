@@ -0,0 +1,166 @@
+#include <algorithm>
+
+#include "shuffle.h"
+
+static inline uint64_t mix(uint64_t z)
+{
+	z = (z ^ (z >> 33)) * 0xff51afd7ed558ccdull;
+	z = (z ^ (z >> 33)) * 0xc4ceb9fe1a85ec53ull;
+	return z ^ (z >> 33);
+}
+
+Permutation::Permutation()
+ : m_keyed(false), m_count(0), m_half(1), m_mask(1), m_key(0)
+{
+	for (int r = 0; r < Rounds; ++r)
+		m_keys[r] = 0;
+}
+
+Permutation::Permutation(uint32_t count, uint64_t key)
+ : m_keyed(true), m_count(count), m_half(4), m_key(key)
+{
+	Random random(key);
+
+	/*
+	 * Past 256 the domain is at most four times count, so walks stay
+	 * short; below it, a Feistel network this narrow is visibly biased.
+	 */
+	while (m_half < 16 && (1ull << (2 * m_half)) < count)
+		m_half++;
+	m_mask = (1u << m_half) - 1;
+	for (int r = 0; r < Rounds; ++r)
+		m_keys[r] = random.next();
+}
+
+Permutation Permutation::resized(uint32_t count) const
+{
+	if (!m_keyed)
+		return Permutation();
+
+	return Permutation(count, m_key);
+}
+
+Permutation Permutation::resized(uint32_t count, const std::vector<uint32_t> &kept) const
+{
+	std::vector<std::pair<uint32_t, uint32_t> > byvalue(kept.size());
+	Permutation ret;
+
+	if (!m_keyed || kept.empty())
+		return resized(count);
+
+	ret = Permutation(count - kept.size(), m_key);
+	ret.m_kept = kept;
+	for (uint32_t i = 0; i < kept.size(); ++i)
+		byvalue[i] = std::make_pair(kept[i], i);
+	std::sort(byvalue.begin(), byvalue.end());
+	ret.m_sorted.resize(kept.size());
+	for (uint32_t i = 0; i < kept.size(); ++i)
+		ret.m_sorted[i] = byvalue[i].second;
+
+	return ret;
+}
+
+uint32_t Permutation::round(int r, uint32_t half) const
+{
+	return mix(m_keys[r] ^ half) & m_mask;
+}
+
+uint32_t Permutation::encrypt(uint32_t x) const
+{
+	uint32_t l = x >> m_half, r = x & m_mask;
+
+	for (int i = 0; i < Rounds; ++i) {
+		uint32_t t = l ^ round(i, r);
+
+		l = r;
+		r = t;
+	}
+
+	return (l << m_half) | r;
+}
+
+uint32_t Permutation::decrypt(uint32_t x) const
+{
+	uint32_t l = x >> m_half, r = x & m_mask;
+
+	for (int i = Rounds - 1; i >= 0; --i) {
+		uint32_t t = r ^ round(i, l);
+
+		r = l;
+		l = t;
+	}
+
+	return (l << m_half) | r;
+}
+
+/* how many kept elements are below value */
+uint32_t Permutation::rank(uint32_t value) const
+{
+	uint32_t lo = 0, hi = m_sorted.size();
+
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+
+		if (m_kept[m_sorted[mid]] < value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+uint32_t Permutation::at(uint32_t index) const
+{
+	uint32_t lo, hi;
+
+	if (!m_keyed)
+		return index;
+	if (index < m_kept.size())
+		return m_kept[index];
+	index -= m_kept.size();
+
+	/* every cycle through the domain passes back into [0, count) */
+	do
+		index = encrypt(index);
+	while (index >= m_count);
+
+	/* the index-th element that isn't kept: past as many kept as are below it */
+	lo = 0;
+	hi = m_sorted.size();
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+
+		if (m_kept[m_sorted[mid]] - mid <= index)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return index + lo;
+}
+
+uint32_t Permutation::indexOf(uint32_t value) const
+{
+	uint32_t below;
+
+	if (!m_keyed)
+		return value;
+	if (!m_kept.empty()) {
+		below = rank(value);
+		if (below < m_sorted.size() && m_kept[m_sorted[below]] == value)
+			return m_sorted[below];
+		value -= below;
+	}
+
+	do
+		value = decrypt(value);
+	while (value >= m_count);
+
+	return value + m_kept.size();
+}
+
+bool Permutation::identity(void) const
+{
+	return !m_keyed;
+}
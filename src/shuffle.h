@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Small, fast generator for shuffling (splitmix64); the same seed gives
+ * the same sequence.  Not thread safe, and not for anything that needs
+ * to be unpredictable.
+ */
+class Random {
+public:
+	Random(uint64_t seed)
+	 : m_state(seed)
+	{ }
+
+	void seed(uint64_t seed)
+	{
+		m_state = seed;
+	}
+
+	uint64_t next(void)
+	{
+		uint64_t z = (m_state += 0x9e3779b97f4a7c15ull);
+
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		return z ^ (z >> 31);
+	}
+
+	/* uniform in [0, n), n > 0 */
+	uint32_t below(uint32_t n)
+	{
+		uint64_t m = (next() >> 32) * n;
+
+		/* rejecting the short end of the range keeps it unbiased */
+		if ((uint32_t)m < n) {
+			uint32_t threshold = -n % n;
+
+			while ((uint32_t)m < threshold)
+				m = (next() >> 32) * n;
+		}
+		return m >> 32;
+	}
+
+private:
+	uint64_t m_state;
+};
+
+/*
+ * A random order of [0, count) that is computed rather than stored: a
+ * keyed Feistel network over the smallest even number of bits that
+ * covers count, walking the cycle until it lands back inside the range.
+ * Both directions cost a few rounds of hashing, whatever the count.
+ * A default constructed one keeps everything in place.
+ *
+ * Leading positions can be pinned to given elements, which are then
+ * stored; the network orders the elements left over after them.
+ */
+class Permutation {
+public:
+	Permutation();
+	Permutation(uint32_t count, uint64_t key);
+
+	/* the same key over count elements, or again the identity */
+	Permutation resized(uint32_t count) const;
+	/* the same, with the first kept.size() positions pinned to kept */
+	Permutation resized(uint32_t count, const std::vector<uint32_t> &kept) const;
+
+	/* where the index-th element comes from, and the reverse */
+	uint32_t at(uint32_t index) const;
+	uint32_t indexOf(uint32_t value) const;
+
+	bool identity(void) const;
+
+private:
+	enum { Rounds = 8 };
+
+	uint32_t round(int r, uint32_t half) const;
+	uint32_t encrypt(uint32_t x) const;
+	uint32_t decrypt(uint32_t x) const;
+	uint32_t rank(uint32_t value) const;
+
+	bool     m_keyed;
+	uint32_t m_count;   /* after those kept */
+	int      m_half;    /* bits in each half of the domain */
+	uint32_t m_mask;
+	uint64_t m_key;
+	uint64_t m_keys[Rounds];
+	std::vector<uint32_t> m_kept;     /* by position */
+	std::vector<uint32_t> m_sorted;   /* positions in m_kept, by element */
+};
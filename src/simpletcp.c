@@ -221,6 +221,14 @@ int     stcp_wait(stcp_t *s, int ms)
 	return -1;
 }
 
+/* the socket to wait on, -1 for proxied connections */
+int     stcp_fd(stcp_t *s)
+{
+	if (s->proxy != NULL)
+		return -1;
+	return s->fd;
+}
+
 int     stcp_write(stcp_t *s, int n, const void *p)
 {
 	if (s->proxy == NULL)
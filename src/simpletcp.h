@@ -9,3 +9,4 @@ void    stcp_close(stcp_t *s);
 int     stcp_read(stcp_t *s, int n, void *p);
 int     stcp_wait(stcp_t *s, int ms);
 int     stcp_write(stcp_t *s, int n, const void *p);
+int     stcp_fd(stcp_t *s);
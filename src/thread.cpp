@@ -1,10 +1,18 @@
 #include <semaphore.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#include <deque>
 
 #include "thread.h"
 
@@ -113,6 +121,26 @@ int posal_sem_wait(posal_sem_t sem)
 	return 0;
 }
 
+int posal_sem_trywait(posal_sem_t sem)
+{
+	int rc;
+
+	rc = sem_trywait((sem_t *)sem);
+	if (rc)
+		return -errno;
+
+	return 0;
+}
+
+/* sem_clockwait() appeared in glibc 2.30 */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+#define SEM_CLOCK CLOCK_MONOTONIC
+#define sem_waituntil(sem, ts) sem_clockwait(sem, CLOCK_MONOTONIC, ts)
+#else
+#define SEM_CLOCK CLOCK_REALTIME
+#define sem_waituntil(sem, ts) sem_timedwait(sem, ts)
+#endif
+
 int posal_sem_timedwait(posal_sem_t sem, unsigned int ms)
 {
 	struct timespec ts;
@@ -120,7 +148,8 @@ int posal_sem_timedwait(posal_sem_t sem, unsigned int ms)
 	struct timespec sts;
 	int s;
 
-	if (clock_gettime(CLOCK_REALTIME, &ts) == -1)
+	/* a monotonic deadline is immune to the wall clock being set */
+	if (clock_gettime(SEM_CLOCK, &ts) == -1)
 		return -1;
 
 	dts.tv_sec = ms / 1000;
@@ -128,7 +157,7 @@ int posal_sem_timedwait(posal_sem_t sem, unsigned int ms)
 	sts.tv_sec = ts.tv_sec + dts.tv_sec + (dts.tv_nsec + ts.tv_nsec) / 1000000000ll;
 	sts.tv_nsec = (dts.tv_nsec + ts.tv_nsec) % 1000000000ll;
 
-	while ((s = sem_timedwait((sem_t *)sem, &sts)) == -1 && errno == EINTR)
+	while ((s = sem_waituntil((sem_t *)sem, &sts)) == -1 && errno == EINTR)
 		continue;
 	if (s == -1)
 		return -errno;
@@ -190,6 +219,52 @@ int posal_mutex_unlock(posal_mutex_t mtx)
 	return 0;
 }
 
+static int posal_futex_wait(unsigned int *addr, unsigned int val, int ms)
+{
+	struct timespec ts;
+	int rc;
+
+	/* relative FUTEX_WAIT timeouts are measured on CLOCK_MONOTONIC */
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	rc = syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val,
+			ms < 0 ? NULL : &ts, NULL, 0);
+	if (rc == -1 && errno == ETIMEDOUT)
+		return -ETIMEDOUT;
+
+	return 0;
+}
+
+static void posal_futex_wake(unsigned int *addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+int EventCount::wait(unsigned int key, int ms)
+{
+	int rc;
+
+	__atomic_add_fetch(&m_waiters, 1, __ATOMIC_SEQ_CST);
+	rc = posal_futex_wait(&m_seq, key, ms);
+	__atomic_sub_fetch(&m_waiters, 1, __ATOMIC_SEQ_CST);
+
+	return rc;
+}
+
+void EventCount::notify(void)
+{
+	__atomic_add_fetch(&m_seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&m_waiters, __ATOMIC_SEQ_CST))
+		posal_futex_wake(&m_seq, 1);
+}
+
+void EventCount::notifyAll(void)
+{
+	__atomic_add_fetch(&m_seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&m_waiters, __ATOMIC_SEQ_CST))
+		posal_futex_wake(&m_seq, 0x7fffffff);
+}
+
 Semaphore::Semaphore(unsigned int initialValue)
 {
 	posal_sem_create(&m_sem, initialValue);
@@ -215,6 +290,11 @@ int Semaphore::wait(unsigned int ms)
 	return posal_sem_timedwait(m_sem, ms);
 }
 
+int Semaphore::tryWait(void)
+{
+	return posal_sem_trywait(m_sem);
+}
+
 static void __posal_mm_thread_fn(void *data)
 {
 	Runnable *r = static_cast<Runnable *>(data);
@@ -277,9 +357,583 @@ ScopedMutex::~ScopedMutex()
 	m_mtx.unlock();
 }
 
+enum {
+	TASK_IDLE,
+	TASK_QUEUED,
+	TASK_DONE,
+};
+
+struct ThreadPool::Worker {
+	ThreadPool        *pool;
+	int                index;
+	Mutex              lock;
+	std::deque<Task *> tasks;
+	Thread            *thread;
+};
+
+static __thread ThreadPool *tls_pool;
+static __thread int tls_worker;
+
+Task::Task()
+ : m_done(0), m_pool(NULL), m_state(TASK_IDLE), m_autodelete(false)
+{ }
+
+Task::~Task()
+{ }
+
+bool Task::finished(void) const
+{
+	return __atomic_load_n(&m_state, __ATOMIC_ACQUIRE) == TASK_DONE;
+}
+
+void Task::execute(void)
+{
+	bool autodelete = m_autodelete;
+
+	run();
+	if (autodelete) {
+		delete this;
+		return;
+	}
+	__atomic_store_n(&m_state, TASK_DONE, __ATOMIC_RELEASE);
+	m_done.post();
+}
+
+void Task::wait(void)
+{
+	if (m_pool != NULL && tls_pool == m_pool) {
+		/* blocking a worker could starve the pool; run other work */
+		while (m_done.tryWait() != 0) {
+			if (!m_pool->runOne(tls_worker) && m_done.wait(1) == 0)
+				break;
+		}
+	} else {
+		m_done.wait();
+	}
+	/* leave the result readable for further waiters */
+	m_done.post();
+}
+
+static int cgroup_cpu_quota(void)
+{
+	char line[512];
+	char path[600];
+	char group[512];
+	long long quota, period;
+	int v2 = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/cgroup", "r");
+	if (fp == NULL)
+		return 0;
+	group[0] = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = 0;
+		if (!strncmp(line, "0::", 3)) {
+			snprintf(group, sizeof(group), "%s", line + 3);
+			v2 = 1;
+			break;
+		}
+		if (strstr(line, ":cpu,") || strstr(line, ":cpu:")) {
+			snprintf(group, sizeof(group), "%s", strrchr(line, ':') + 1);
+		}
+	}
+	fclose(fp);
+
+	quota = -1;
+	period = 0;
+	if (v2) {
+		snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", group);
+		fp = fopen(path, "r");
+		if (fp != NULL) {
+			if (fscanf(fp, "%lld %lld", &quota, &period) != 2)
+				quota = -1;
+			fclose(fp);
+		}
+	} else {
+		snprintf(path, sizeof(path), "/sys/fs/cgroup/cpu%s/cpu.cfs_quota_us", group);
+		fp = fopen(path, "r");
+		if (fp != NULL) {
+			if (fscanf(fp, "%lld", &quota) != 1)
+				quota = -1;
+			fclose(fp);
+		}
+		snprintf(path, sizeof(path), "/sys/fs/cgroup/cpu%s/cpu.cfs_period_us", group);
+		fp = fopen(path, "r");
+		if (fp != NULL) {
+			if (fscanf(fp, "%lld", &period) != 1)
+				period = 0;
+			fclose(fp);
+		}
+	}
+
+	/* "max" fails to parse and leaves the quota unlimited */
+	if (quota <= 0 || period <= 0)
+		return 0;
+
+	return (quota + period - 1) / period;
+}
+
+int ThreadPool::cpuCount(void)
+{
+	cpu_set_t set;
+	int n, quota;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		n = CPU_COUNT(&set);
+	else
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	quota = cgroup_cpu_quota();
+	if (quota > 0 && quota < n)
+		n = quota;
+
+	return (n < 1) ? 1 : n;
+}
+
+ThreadPool &ThreadPool::shared(void)
+{
+	static ThreadPool pool(0, "decode");
+
+	return pool;
+}
+
+ThreadPool::ThreadPool(int threads, const char *name)
+ : m_name(name), m_next(0), m_pending(0), m_quit(false)
+{
+	if (threads <= 0)
+		threads = cpuCount();
+
+	m_count = threads;
+	m_workers = new Worker*[m_count];
+	for (int i = 0; i < m_count; ++i) {
+		m_workers[i] = new Worker;
+		m_workers[i]->pool = this;
+		m_workers[i]->index = i;
+	}
+	for (int i = 0; i < m_count; ++i)
+		m_workers[i]->thread = new Thread(workerMain, m_workers[i]);
+}
+
+ThreadPool::~ThreadPool()
+{
+	__atomic_store_n(&m_quit, true, __ATOMIC_RELEASE);
+	for (int i = 0; i < m_count; ++i)
+		m_pending.post();
+
+	/* workers steal from each other; join them all before freeing any */
+	for (int i = 0; i < m_count; ++i)
+		m_workers[i]->thread->join();
+	for (int i = 0; i < m_count; ++i) {
+		delete m_workers[i]->thread;
+		delete m_workers[i];
+	}
+	delete[] m_workers;
+}
+
+int ThreadPool::size(void) const
+{
+	return m_count;
+}
+
+int ThreadPool::self(void) const
+{
+	return (tls_pool == this) ? tls_worker : -1;
+}
+
+void ThreadPool::submit(Task *task, bool autodelete)
+{
+	int idx = self();
+	Worker *w;
+
+	/* consume the completion left behind by a previous run */
+	if (task->m_state == TASK_DONE)
+		task->m_done.wait();
+	task->m_pool = this;
+	task->m_autodelete = autodelete;
+	task->m_state = TASK_QUEUED;
+
+	if (idx < 0)
+		idx = __atomic_fetch_add(&m_next, 1, __ATOMIC_RELAXED) % m_count;
+	w = m_workers[idx];
+
+	w->lock.lock();
+	w->tasks.push_back(task);
+	w->lock.unlock();
+
+	m_pending.post();
+}
+
+Task *ThreadPool::take(int self)
+{
+	Task *task = NULL;
+	int start;
+
+	if (self >= 0) {
+		Worker *w = m_workers[self];
+		w->lock.lock();
+		if (!w->tasks.empty()) {
+			task = w->tasks.back();
+			w->tasks.pop_back();
+		}
+		w->lock.unlock();
+		if (task != NULL)
+			return task;
+		start = self + 1;
+	} else {
+		start = 0;
+	}
+
+	for (int i = 0; i < m_count; ++i) {
+		Worker *w = m_workers[(start + i) % m_count];
+		w->lock.lock();
+		if (!w->tasks.empty()) {
+			task = w->tasks.front();
+			w->tasks.pop_front();
+		}
+		w->lock.unlock();
+		if (task != NULL)
+			break;
+	}
+
+	return task;
+}
+
+bool ThreadPool::runOne(int self)
+{
+	Task *task = take(self);
+
+	if (task == NULL)
+		return false;
+	task->execute();
+
+	return true;
+}
+
+void ThreadPool::workerMain(void *data)
+{
+	Worker *w = static_cast<Worker *>(data);
+	ThreadPool *pool = w->pool;
+	char name[16];
+
+	tls_pool = pool;
+	tls_worker = w->index;
+
+	snprintf(name, sizeof(name), "%s/%d", pool->m_name, w->index);
+	Sched::setName(name);
+	Sched::enterBackground();
+
+	for (;;) {
+		pool->m_pending.wait();
+		while (pool->runOne(w->index))
+			;
+		if (__atomic_load_n(&pool->m_quit, __ATOMIC_ACQUIRE))
+			break;
+	}
+}
+
+#define EPOCH_SLOTS 64
+
+struct EpochDomain::Slot {
+	void              *owner;
+	unsigned long long epoch;	/* 0 outside a critical section */
+	int                depth;
+	char               pad[64 - sizeof(void *) - sizeof(unsigned long long) - sizeof(int)];
+};
+
+struct EpochDomain::Retired {
+	Retired           *next;
+	void              *ptr;
+	Reclaim            reclaim;
+	unsigned long long epoch;
+};
+
+/* only its address matters: it is unique among live threads */
+static __thread char tls_epoch_token;
+static __thread EpochDomain *tls_epoch_domain;
+static __thread int tls_epoch_slot;
+
+EpochDomain::EpochDomain()
+ : m_retired(NULL), m_epoch(1), m_holder(NULL), m_held(0)
+{
+	m_slots = new Slot[EPOCH_SLOTS];
+	for (int i = 0; i < EPOCH_SLOTS; ++i) {
+		m_slots[i].owner = NULL;
+		m_slots[i].epoch = 0;
+		m_slots[i].depth = 0;
+	}
+}
+
+EpochDomain::~EpochDomain()
+{
+	while (m_retired != NULL) {
+		Retired *r = m_retired;
+		m_retired = r->next;
+		r->reclaim(r->ptr);
+		delete r;
+	}
+	delete[] m_slots;
+}
+
+/*
+ * A reader holds a slot only while it is inside, so the slots bound the
+ * readers inside at once, not the threads that ever read.  The way in
+ * claims a free one, trying the one it had last time first; NULL if
+ * none is free.
+ */
+EpochDomain::Slot *EpochDomain::slot(bool claim)
+{
+	void *self = &tls_epoch_token;
+	void *expected;
+	int i;
+
+	if (tls_epoch_domain == this &&
+			__atomic_load_n(&m_slots[tls_epoch_slot].owner, __ATOMIC_RELAXED) == self)
+		return &m_slots[tls_epoch_slot];
+
+	/* nested in another domain's critical section since */
+	for (i = 0; i < EPOCH_SLOTS; ++i) {
+		if (__atomic_load_n(&m_slots[i].owner, __ATOMIC_ACQUIRE) == self)
+			goto found;
+	}
+	if (!claim)
+		return NULL;
+	for (int n = 0; n < EPOCH_SLOTS; ++n) {
+		i = (tls_epoch_slot + n) % EPOCH_SLOTS;
+		expected = NULL;
+		if (__atomic_compare_exchange_n(&m_slots[i].owner, &expected, self,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			goto found;
+	}
+	return NULL;
+
+found:
+	tls_epoch_domain = this;
+	tls_epoch_slot = i;
+	return &m_slots[i];
+}
+
+void EpochDomain::enter(void)
+{
+	void *self = &tls_epoch_token;
+	Slot *s;
+
+	if (__atomic_load_n(&m_holder, __ATOMIC_RELAXED) == self) {
+		m_held++;
+		return;
+	}
+	s = slot(true);
+	if (s == NULL) {
+		/* every slot is taken: keep retire() and collect() out instead */
+		m_lock.lock();
+		__atomic_store_n(&m_holder, self, __ATOMIC_RELAXED);
+		m_held = 1;
+		return;
+	}
+
+	if (s->depth++ == 0) {
+		unsigned long long epoch = __atomic_load_n(&m_epoch, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&s->epoch, epoch, __ATOMIC_SEQ_CST);
+	}
+}
+
+void EpochDomain::leave(void)
+{
+	Slot *s;
+
+	if (__atomic_load_n(&m_holder, __ATOMIC_RELAXED) == &tls_epoch_token) {
+		if (--m_held == 0) {
+			__atomic_store_n(&m_holder, NULL, __ATOMIC_RELAXED);
+			m_lock.unlock();
+		}
+		return;
+	}
+
+	s = slot(false);
+	if (--s->depth == 0) {
+		__atomic_store_n(&s->epoch, 0, __ATOMIC_RELEASE);
+		__atomic_store_n(&s->owner, NULL, __ATOMIC_RELEASE);
+	}
+}
+
+void EpochDomain::retire(void *ptr, Reclaim reclaim)
+{
+	Retired *r = new Retired;
+
+	r->ptr = ptr;
+	r->reclaim = reclaim;
+
+	/* a reader holding m_lock already; it may still see ptr itself */
+	if (__atomic_load_n(&m_holder, __ATOMIC_RELAXED) == &tls_epoch_token) {
+		r->epoch = __atomic_fetch_add(&m_epoch, 1, __ATOMIC_SEQ_CST);
+		r->next = m_retired;
+		m_retired = r;
+		return;
+	}
+
+	m_lock.lock();
+	/* readers that entered before this can still hold ptr */
+	r->epoch = __atomic_fetch_add(&m_epoch, 1, __ATOMIC_SEQ_CST);
+	r->next = m_retired;
+	m_retired = r;
+	m_lock.unlock();
+
+	collect();
+}
+
+void EpochDomain::collect(void)
+{
+	unsigned long long oldest = ~0ull;
+	Retired *expired = NULL;
+	Retired **pr;
+
+	/* the reader holding m_lock isn't in any slot; it leaves first */
+	if (__atomic_load_n(&m_holder, __ATOMIC_RELAXED) == &tls_epoch_token)
+		return;
+
+	/* scan under the lock, so nothing is retired after the scan */
+	m_lock.lock();
+	if (m_retired == NULL) {
+		m_lock.unlock();
+		return;
+	}
+	for (int i = 0; i < EPOCH_SLOTS; ++i) {
+		unsigned long long epoch = __atomic_load_n(&m_slots[i].epoch, __ATOMIC_SEQ_CST);
+		if (epoch != 0 && epoch < oldest)
+			oldest = epoch;
+	}
+	for (pr = &m_retired; *pr != NULL; ) {
+		Retired *r = *pr;
+		if (r->epoch < oldest) {
+			*pr = r->next;
+			r->next = expired;
+			expired = r;
+		} else {
+			pr = &r->next;
+		}
+	}
+	m_lock.unlock();
+
+	while (expired != NULL) {
+		Retired *r = expired;
+		expired = r->next;
+		r->reclaim(r->ptr);
+		delete r;
+	}
+}
+
+EpochGuard::EpochGuard(EpochDomain &domain)
+ : m_domain(domain)
+{
+	m_domain.enter();
+}
+
+EpochGuard::~EpochGuard()
+{
+	m_domain.leave();
+}
+
+static struct {
+	Sched::Policy policy;
+	int           nice;
+	bool          pinned;
+	cpu_set_t     cpus;
+} sched_background;
+
+static int parse_cpus(const char *list, cpu_set_t *set)
+{
+	const char *p = list;
+	char *end;
+
+	CPU_ZERO(set);
+	while (*p) {
+		long first, last;
+
+		first = last = strtol(p, &end, 10);
+		if (end == p || first < 0)
+			return -EINVAL;
+		p = end;
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			if (end == p + 1 || last < first)
+				return -EINVAL;
+			p = end;
+		}
+		if (last >= CPU_SETSIZE)
+			return -EINVAL;
+		for (long cpu = first; cpu <= last; ++cpu)
+			CPU_SET(cpu, set);
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -EINVAL;
+	}
+
+	return CPU_COUNT(set) ? 0 : -EINVAL;
+}
+
+int Sched::setBackground(Policy policy, int nice, const char *cpus)
+{
+	if (cpus != NULL) {
+		if (parse_cpus(cpus, &sched_background.cpus))
+			return -EINVAL;
+		sched_background.pinned = true;
+	} else {
+		sched_background.pinned = false;
+	}
+	sched_background.policy = policy;
+	sched_background.nice = nice;
+
+	return 0;
+}
+
+void Sched::enterBackground(void)
+{
+	struct sched_param param;
+	int policy = SCHED_OTHER;
+
+	switch (sched_background.policy) {
+	case Batch:
+		policy = SCHED_BATCH;
+		break;
+	case Idle:
+		policy = SCHED_IDLE;
+		break;
+	default:
+		break;
+	}
+
+	/* on Linux these are per thread, despite what POSIX says */
+	memset(&param, 0, sizeof(param));
+	if (policy != SCHED_OTHER && sched_setscheduler(0, policy, &param))
+		perror("sched_setscheduler");
+	if (sched_background.nice != 0 &&
+			setpriority(PRIO_PROCESS, syscall(SYS_gettid), sched_background.nice))
+		perror("setpriority");
+	if (sched_background.pinned &&
+			pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &sched_background.cpus))
+		fprintf(stderr, "Unable to set background CPU affinity\n");
+}
+
+void Sched::setName(const char *name)
+{
+	char buf[16];
+
+	/* the kernel keeps 15 characters */
+	snprintf(buf, sizeof(buf), "%s", name);
+	pthread_setname_np(pthread_self(), buf);
+}
+
 Timestamp Time::MS(void)
 {
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
 	return (Timestamp)tv.tv_sec*1000 + tv.tv_usec/1000;
 }
+
+Timestamp Time::monotonicMS(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (Timestamp)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
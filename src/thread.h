@@ -4,6 +4,31 @@ typedef struct posal_thread * posal_thread_t;
 typedef struct posal_sem * posal_sem_t;
 typedef struct posal_mutex * posal_mutex_t;
 
+typedef unsigned long long Timestamp;
+namespace Time {
+	Timestamp MS(void);
+	Timestamp monotonicMS(void);
+};
+
+/*
+ * Scheduling for background work (loading and decoding), so that it
+ * can't starve rendering.  Threads opt in with enterBackground(); set
+ * the configuration before any of them start.
+ */
+namespace Sched {
+	enum Policy {
+		Normal,
+		Batch,
+		Idle,
+	};
+
+	/* cpus is a list such as "0,2-3", NULL for no restriction */
+	int  setBackground(Policy policy, int nice, const char *cpus);
+	void enterBackground(void);
+	/* names the calling thread, for top and profilers */
+	void setName(const char *name);
+};
+
 class Runnable {
 public:
 	virtual void run(void) = 0;
@@ -30,6 +55,7 @@ public:
 	int post(void);
 	int wait(void);
 	int wait(unsigned int ms);
+	int tryWait(void);
 
 private:
 	posal_sem_t m_sem;
@@ -183,119 +209,394 @@ private:
 	Mutex lock;
 };
 
+/*
+ * Futex based wakeup primitive: read a key with prepare(), re-check the
+ * condition, then wait(key) sleeps only if nobody notified in between.
+ */
+class EventCount {
+public:
+	EventCount()
+	 : m_seq(0), m_waiters(0)
+	{ }
+
+	unsigned int prepare(void)
+	{
+		return __atomic_load_n(&m_seq, __ATOMIC_ACQUIRE);
+	}
+
+	/* returns non-zero if ms (-1 = forever) expired first */
+	int wait(unsigned int key, int ms = -1);
+	void notify(void);
+	void notifyAll(void);
+
+private:
+	unsigned int m_seq;
+	int          m_waiters;
+};
+
+/*
+ * Bounded lock-free multi-producer/multi-consumer FIFO (Vyukov's ring).
+ * Storage is allocated once; push/pop never allocate.
+ */
 template <typename _T>
-class WaitQ {
+class RingQueue {
 public:
-	class Item : public Queue::Item {
-	public:
-		Item(_T p)
-		 : data(p) { }
+	RingQueue(unsigned int capacity)
+	 : m_enqueue(0), m_dequeue(0)
+	{
+		unsigned int n = 2;
+
+		while (n < capacity)
+			n <<= 1;
+		m_mask = n - 1;
+		m_cells = new Cell[n];
+		for (unsigned int i = 0; i < n; ++i)
+			m_cells[i].seq = i;
+	}
+
+	~RingQueue()
+	{
+		delete[] m_cells;
+	}
+
+	bool tryPush(_T item)
+	{
+		unsigned int pos = __atomic_load_n(&m_enqueue, __ATOMIC_RELAXED);
+		Cell *cell;
+
+		for (;;) {
+			cell = &m_cells[pos & m_mask];
+			unsigned int seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+			int dif = (int)(seq - pos);
+			if (dif == 0) {
+				if (__atomic_compare_exchange_n(&m_enqueue, &pos, pos + 1,
+						true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					break;
+			} else if (dif < 0) {
+				return false;
+			} else {
+				pos = __atomic_load_n(&m_enqueue, __ATOMIC_RELAXED);
+			}
+		}
+		cell->data = item;
+		__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+		m_pushed.notify();
+
+		return true;
+	}
+
+	bool tryPop(_T &item)
+	{
+		unsigned int pos = __atomic_load_n(&m_dequeue, __ATOMIC_RELAXED);
+		Cell *cell;
+
+		for (;;) {
+			cell = &m_cells[pos & m_mask];
+			unsigned int seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+			int dif = (int)(seq - (pos + 1));
+			if (dif == 0) {
+				if (__atomic_compare_exchange_n(&m_dequeue, &pos, pos + 1,
+						true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					break;
+			} else if (dif < 0) {
+				return false;
+			} else {
+				pos = __atomic_load_n(&m_dequeue, __ATOMIC_RELAXED);
+			}
+		}
+		item = cell->data;
+		__atomic_store_n(&cell->seq, pos + m_mask + 1, __ATOMIC_RELEASE);
+		m_popped.notify();
+
+		return true;
+	}
+
+	/* blocking variants; return false if timeout_ms (-1 = forever) expires */
+	bool push(_T item, int timeout_ms = -1)
+	{
+		for (;;) {
+			unsigned int key = m_popped.prepare();
+			if (tryPush(item))
+				return true;
+			if (timeout_ms == 0 || m_popped.wait(key, timeout_ms))
+				return false;
+		}
+	}
+
+	bool pop(_T &item, int timeout_ms = -1)
+	{
+		for (;;) {
+			unsigned int key = m_pushed.prepare();
+			if (tryPop(item))
+				return true;
+			if (timeout_ms == 0 || m_pushed.wait(key, timeout_ms))
+				return false;
+		}
+	}
+
+	int count(void) const
+	{
+		unsigned int e = __atomic_load_n(&m_enqueue, __ATOMIC_RELAXED);
+		unsigned int d = __atomic_load_n(&m_dequeue, __ATOMIC_RELAXED);
+		return (int)(e - d) < 0 ? 0 : (int)(e - d);
+	}
+
+	int capacity(void) const
+	{
+		return m_mask + 1;
+	}
+
+private:
+	struct Cell {
+		unsigned int seq;
 		_T data;
 	};
 
+	Cell        *m_cells;
+	unsigned int m_mask;
+	char         m_pad0[64];
+	unsigned int m_enqueue;
+	char         m_pad1[64];
+	unsigned int m_dequeue;
+	char         m_pad2[64];
+	EventCount   m_pushed;
+	EventCount   m_popped;
+};
+
+/*
+ * Blocking double-ended queue.  Items live in a ring which only grows
+ * when an unbounded queue fills up, so steady state is allocation free.
+ */
+template <typename _T>
+class WaitQ {
+public:
 	WaitQ(int max = -1)
+	 : m_head(0), m_count(0)
 	{
-		sem = new Semaphore(0);
-		maxItems = (max == -1) ? 0 : max;
-		if (maxItems)
-			empty = new Semaphore(max);
+		m_max = (max == -1) ? 0 : max;
+		m_capacity = m_max ? m_max : 16;
+		m_ring = new _T[m_capacity];
 	}
 
 	~WaitQ()
 	{
-		Item *qi;
-
-		delete sem;
-		if (maxItems)
-			delete empty;
-
-		while ((qi = static_cast<Item *>(queue.popFront())) != 0)
-			delete qi;
+		delete[] m_ring;
 	}
 
 	void pushFront(_T item)
 	{
-		if (maxItems)
-			empty->wait();
-
-		queue.pushFront(new Item(item));
-		sem->post();
+		push(item, true);
 	}
 
 	void pushBack(_T item)
 	{
-		if (maxItems)
-			empty->wait();
+		push(item, false);
+	}
 
-		queue.pushBack(new Item(item));
-		sem->post();
+	_T popFront(int timeout_ms = -1)
+	{
+		return pop(true, timeout_ms);
 	}
 
+	_T popBack(int timeout_ms = -1)
+	{
+		return pop(false, timeout_ms);
+	}
 
-	_T popFront(int timeout_ms = -1)
+	int count(void)
+	{
+		return __atomic_load_n(&m_count, __ATOMIC_RELAXED);
+	}
+
+private:
+	void push(_T item, bool front)
 	{
-		Item *qi;
+		for (;;) {
+			unsigned int key = m_nonfull.prepare();
+
+			m_lock.lock();
+			if (m_count == m_capacity && !m_max)
+				grow();
+			if (m_count < m_capacity) {
+				if (front) {
+					m_head = (m_head + m_capacity - 1) % m_capacity;
+					m_ring[m_head] = item;
+				} else {
+					m_ring[(m_head + m_count) % m_capacity] = item;
+				}
+				__atomic_store_n(&m_count, m_count + 1, __ATOMIC_RELAXED);
+				m_lock.unlock();
+				m_nonempty.notify();
+				return;
+			}
+			m_lock.unlock();
+			m_nonfull.wait(key);
+		}
+	}
+
+	_T pop(bool front, int timeout_ms)
+	{
+		Timestamp deadline = 0;
 		_T ret;
 
-		if (timeout_ms != -1) {
-			if (sem->wait(timeout_ms))
+		if (timeout_ms > 0)
+			deadline = Time::monotonicMS() + timeout_ms;
+
+		for (;;) {
+			unsigned int key = m_nonempty.prepare();
+			int wait = -1;
+
+			m_lock.lock();
+			if (m_count > 0) {
+				if (front) {
+					ret = m_ring[m_head];
+					m_head = (m_head + 1) % m_capacity;
+				} else {
+					ret = m_ring[(m_head + m_count - 1) % m_capacity];
+				}
+				__atomic_store_n(&m_count, m_count - 1, __ATOMIC_RELAXED);
+				m_lock.unlock();
+				if (m_max)
+					m_nonfull.notify();
+				return ret;
+			}
+			m_lock.unlock();
+
+			if (timeout_ms == 0)
+				return 0;
+			if (timeout_ms > 0) {
+				Timestamp now = Time::monotonicMS();
+				if (now >= deadline)
+					return 0;
+				wait = deadline - now;
+			}
+			if (m_nonempty.wait(key, wait) && timeout_ms > 0 &&
+					Time::monotonicMS() >= deadline)
 				return 0;
-		} else {
-			sem->wait();
 		}
+	}
 
-		qi = static_cast<Item *>(queue.popFront());
-		if (qi == 0)
-			return 0;
+	void grow(void)
+	{
+		_T *n = new _T[m_capacity * 2];
+
+		for (int i = 0; i < m_count; ++i)
+			n[i] = m_ring[(m_head + i) % m_capacity];
+		delete[] m_ring;
+		m_ring = n;
+		m_head = 0;
+		m_capacity *= 2;
+	}
 
-		ret = qi->data;
-		delete qi;
+	Mutex      m_lock;
+	_T        *m_ring;
+	int        m_capacity;
+	int        m_head;
+	int        m_count;
+	int        m_max;
+	EventCount m_nonempty;
+	EventCount m_nonfull;
+};
 
-		if (maxItems)
-			empty->post();
+class ThreadPool;
 
-		return ret;
-	}
+/*
+ * A unit of work for a ThreadPool; doubles as its own future.  Subclass
+ * and implement run().  A task may be resubmitted once wait() returns.
+ */
+class Task : public Runnable {
+public:
+	Task();
+	virtual ~Task();
 
-	_T popBack(int timeout_ms = -1)
-	{
-		Item *qi;
-		_T ret;
+	/* blocks until run() has completed; pool workers help meanwhile */
+	void wait(void);
+	bool finished(void) const;
 
-		if (timeout_ms != -1) {
-			if (sem->wait(timeout_ms))
-				return 0;
-		} else {
-			sem->wait();
-		}
+private:
+	friend class ThreadPool;
+	void execute(void);
 
-		qi = static_cast<Item *>(queue.popBack());
-		if (qi == 0)
-			return 0;
+	Semaphore   m_done;
+	ThreadPool *m_pool;
+	int         m_state;
+	bool        m_autodelete;
+};
 
-		ret = qi->data;
-		delete qi;
+/*
+ * Fixed set of workers, each with its own deque.  Workers run their own
+ * work newest first and steal the oldest work of others when idle.
+ */
+class ThreadPool {
+public:
+	/* workers are named name/0, name/1... and run as background work */
+	ThreadPool(int threads = 0, const char *name = "pool");
+	~ThreadPool();
 
-		if (maxItems)
-			empty->post();
+	/* autodelete tasks are deleted after running and can't be waited on */
+	void submit(Task *task, bool autodelete = false);
+	int  size(void) const;
 
-		return ret;
-	}
+	/* online CPUs, limited by affinity and the cgroup CPU quota */
+	static int cpuCount(void);
+	static ThreadPool &shared(void);
+
+private:
+	struct Worker;
+	friend class Task;
+	static void workerMain(void *data);
+	bool runOne(int self);
+	Task *take(int self);
+	int  self(void) const;
+
+	Worker      **m_workers;
+	const char   *m_name;
+	int           m_count;
+	unsigned int  m_next;
+	Semaphore     m_pending;
+	bool          m_quit;
+};
 
 
-	int count(void)
-	{
-		return queue.count();
-	}
+/*
+ * Epoch based reclamation.  Readers bracket their accesses with enter()
+ * and leave() and never block.  Writers unpublish an object, retire()
+ * it, and it is reclaimed once every reader that might still see it
+ * has left.  Critical sections may nest.  Up to 64 threads can be
+ * inside at once without blocking; past that, readers take turns.
+ */
+class EpochDomain {
+public:
+	typedef void (*Reclaim)(void *ptr);
+
+	EpochDomain();
+	/* reclaims everything still retired; no readers may be left */
+	~EpochDomain();
+
+	void enter(void);
+	void leave(void);
+	void retire(void *ptr, Reclaim reclaim);
+	/* reclaims what no reader can see any more; retire() calls this */
+	void collect(void);
 
 private:
-	Queue queue;
-	int maxItems;
-	Semaphore *sem;
-	Semaphore *empty;
+	struct Slot;
+	struct Retired;
+
+	Slot *slot(bool claim);
+
+	Slot              *m_slots;
+	Mutex              m_lock;
+	Retired           *m_retired;
+	unsigned long long m_epoch;
+	void              *m_holder;	/* reader holding m_lock, as no slot was free */
+	int                m_held;	/* its depth */
 };
 
-typedef unsigned long long Timestamp;
-namespace Time {
-	Timestamp MS(void);
+class EpochGuard {
+public:
+	EpochGuard(EpochDomain &domain);
+	~EpochGuard();
+private:
+	EpochDomain &m_domain;
 };
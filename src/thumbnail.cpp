@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "thumbnail.h"
+#include "memorymapper.h"
+#include "md5.h"
+
+extern "C" {
+int LoadPNG(void *pRaw, int rawlen, unsigned int *puWidth, unsigned int *puHeight, void **ppData);
+int ReadPNGText(void *pRaw, int rawlen, const char *key, char *value, int len);
+int SavePNGFile(FILE *fp, const void *pData, unsigned int uWidth, unsigned int uHeight, const char **text);
+}
+
+static const struct {
+	const char *name;
+	int size;
+} thumb_sizes[] = {
+	{ "large",  256 },
+	{ "normal", 128 },
+};
+
+static int cache_dir(char *buf, int len)
+{
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	int rc;
+
+	if (xdg != NULL && xdg[0] == '/')
+		rc = snprintf(buf, len, "%s/thumbnails", xdg);
+	else if (home != NULL)
+		rc = snprintf(buf, len, "%s/.cache/thumbnails", home);
+	else
+		return -1;
+
+	return (rc < len) ? 0 : -1;
+}
+
+/* file:// URI with the escaping used by g_filename_to_uri() */
+static int file_uri(const char *path, char *buf, int len)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char abspath[PATH_MAX];
+	int off;
+
+	if (realpath(path, abspath) == NULL)
+		return -1;
+
+	off = snprintf(buf, len, "file://");
+	for (const unsigned char *p = (const unsigned char *)abspath; *p; ++p) {
+		if (off + 4 > len)
+			return -1;
+		if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+				(*p >= '0' && *p <= '9') ||
+				strchr("!$&'()*+,-./:=@_~", *p) != NULL) {
+			buf[off++] = *p;
+		} else {
+			buf[off++] = '%';
+			buf[off++] = hex[*p >> 4];
+			buf[off++] = hex[*p & 15];
+		}
+	}
+	buf[off] = 0;
+
+	return 0;
+}
+
+static int thumb_path(const char *uri, const char *size, char *buf, int len)
+{
+	char dir[PATH_MAX];
+	char md5[33];
+
+	if (cache_dir(dir, sizeof(dir)))
+		return -1;
+	md5_hex(uri, strlen(uri), md5);
+
+	return (snprintf(buf, len, "%s/%s/%s.png", dir, size, md5) < len) ? 0 : -1;
+}
+
+static bool thumb_current(MemoryMapper::Map *map, const char *uri, time_t mtime)
+{
+	char value[PATH_MAX * 3];
+
+	if (ReadPNGText(map->getData(), map->getLength(), "Thumb::MTime",
+				value, sizeof(value)))
+		return false;
+	if (strtoll(value, NULL, 10) != (long long)mtime)
+		return false;
+
+	if (ReadPNGText(map->getData(), map->getLength(), "Thumb::URI",
+				value, sizeof(value)) == 0 && strcmp(value, uri))
+		return false;
+
+	return true;
+}
+
+static MemoryMapper::Map *thumb_open(const char *path)
+{
+	char uri[PATH_MAX * 3];
+	char tpath[PATH_MAX];
+	struct stat st;
+
+	if (!strncmp(path, "http://", 7) || stat(path, &st))
+		return NULL;
+	if (file_uri(path, uri, sizeof(uri)))
+		return NULL;
+
+	for (unsigned int i = 0; i < sizeof(thumb_sizes)/sizeof(thumb_sizes[0]); ++i) {
+		MemoryMapper::Map *map;
+
+		if (thumb_path(uri, thumb_sizes[i].name, tpath, sizeof(tpath)))
+			return NULL;
+		map = MemoryMapper::map(tpath);
+		if (map == NULL)
+			continue;
+		if (thumb_current(map, uri, st.st_mtime))
+			return map;
+		MemoryMapper::unmap(map);
+	}
+
+	return NULL;
+}
+
+Image *Thumbnails::load(const char *path)
+{
+	MemoryMapper::Map *map;
+	unsigned int w, h;
+	void *pixels;
+	int rc;
+
+	map = thumb_open(path);
+	if (map == NULL)
+		return NULL;
+
+	rc = LoadPNG(map->getData(), map->getLength(), &w, &h, &pixels);
+	MemoryMapper::unmap(map);
+	if (rc)
+		return NULL;
+
+	return new Image(pixels, GRE::Dimensions(w, h));
+}
+
+bool Thumbnails::valid(const char *path)
+{
+	MemoryMapper::Map *map;
+
+	map = thumb_open(path);
+	if (map == NULL)
+		return false;
+	MemoryMapper::unmap(map);
+
+	return true;
+}
+
+static int mkdirs(const char *dir)
+{
+	char buf[PATH_MAX];
+	char *p;
+
+	snprintf(buf, sizeof(buf), "%s", dir);
+	for (p = buf + 1; *p; ++p) {
+		if (*p != '/')
+			continue;
+		*p = 0;
+		mkdir(buf, 0700);
+		*p = '/';
+	}
+
+	return (mkdir(buf, 0700) == 0 || access(buf, W_OK) == 0) ? 0 : -1;
+}
+
+int Thumbnails::store(const char *path, const Image *image)
+{
+	const GRE::Dimensions &dims = image->getDimensions();
+	char uri[PATH_MAX * 3];
+	char dir[PATH_MAX];
+	char tpath[PATH_MAX];
+	char tmp[PATH_MAX + 32];
+	char mtime[32], size[32];
+	const char *text[] = {
+		"Thumb::URI", uri,
+		"Thumb::MTime", mtime,
+		"Thumb::Size", size,
+		"Software", "imager",
+		NULL,
+	};
+	unsigned char *pixels;
+	struct stat st;
+	int tsize = thumb_sizes[0].size;
+	int w, h, fd, rc;
+	FILE *fp;
+
+	/* nothing to gain from thumbnailing something this small */
+	if (dims.w <= tsize && dims.h <= tsize)
+		return -1;
+	if (!strncmp(path, "http://", 7) || stat(path, &st))
+		return -1;
+	if (cache_dir(dir, sizeof(dir)) || file_uri(path, uri, sizeof(uri)))
+		return -1;
+	/* never thumbnail the thumbnails */
+	if (!strncmp(uri + 7, dir, strlen(dir)))
+		return -1;
+	if (thumb_path(uri, thumb_sizes[0].name, tpath, sizeof(tpath)))
+		return -1;
+
+	if (dims.w > dims.h) {
+		w = tsize;
+		h = ((long long)dims.h * tsize + dims.w / 2) / dims.w;
+	} else {
+		h = tsize;
+		w = ((long long)dims.w * tsize + dims.h / 2) / dims.h;
+	}
+	if (w < 1) w = 1;
+	if (h < 1) h = 1;
+
+	snprintf(mtime, sizeof(mtime), "%lld", (long long)st.st_mtime);
+	snprintf(size, sizeof(size), "%lld", (long long)st.st_size);
+
+	strncat(dir, "/", sizeof(dir) - strlen(dir) - 1);
+	strncat(dir, thumb_sizes[0].name, sizeof(dir) - strlen(dir) - 1);
+	if (mkdirs(dir))
+		return -1;
+
+	pixels = (unsigned char *)Image_Scale(image->getData(), dims, GRE::Dimensions(w, h));
+	if (pixels == NULL)
+		return -1;
+
+	/* written privately (mkstemp() makes it 0600), then moved into place atomically */
+	snprintf(tmp, sizeof(tmp), "%s.imager-XXXXXX", tpath);
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		free(pixels);
+		return -1;
+	}
+	fp = fdopen(fd, "wb");
+	if (fp == NULL) {
+		close(fd);
+		rc = -1;
+	} else {
+		rc = SavePNGFile(fp, pixels, w, h, text);
+	}
+	free(pixels);
+	if (rc == 0)
+		rc = rename(tmp, tpath);
+	if (rc)
+		unlink(tmp);
+
+	return rc ? -1 : 0;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "imageloader.h"
+
+/*
+ * Access to the freedesktop.org shared thumbnail cache
+ * ($XDG_CACHE_HOME/thumbnails/{large,normal}).
+ */
+class Thumbnails {
+public:
+	/* returns a cached thumbnail which is current for path, or NULL */
+	static Image *load(const char *path);
+	static bool valid(const char *path);
+
+	/* writes a "large" thumbnail for path, downscaled from image */
+	static int store(const char *path, const Image *image);
+};
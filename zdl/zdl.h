@@ -443,6 +443,21 @@ ZDL_EXPORT int  zdl_window_poll_event(zdl_window_t w, struct zdl_event *ev);
  */
 ZDL_EXPORT void zdl_window_wait_event(zdl_window_t w, struct zdl_event *ev);
 
+/** Get the file descriptor window events arrive on.
+ * It becomes readable when there is something for zdl_window_poll_event(),
+ * but events may already be queued without it; check zdl_window_pending()
+ * before sleeping on it.
+ * @param w Window handle.
+ * @return File descriptor, or -1 if there is none.
+ */
+ZDL_EXPORT int  zdl_window_get_fd(zdl_window_t w);
+
+/** Check for queued window events, without blocking.
+ * @param w Window handle.
+ * @return !0 if zdl_window_poll_event() has something to return.
+ */
+ZDL_EXPORT int  zdl_window_pending(zdl_window_t w);
+
 /** Warp mouse pointer.
  * @param w Window handle.
  * @param x New X position of mouse.
@@ -579,6 +594,12 @@ public:
 	void waitEvent(struct zdl_event *ev)
 	{ zdl_window_wait_event(m_win, ev); }
 
+	int getFd(void)
+	{ return zdl_window_get_fd(m_win); }
+
+	int pending(void)
+	{ return zdl_window_pending(m_win); }
+
 	void swap(void)
 	{ zdl_window_swap(m_win); }
 
@@ -767,6 +767,16 @@ void zdl_window_wait_event(zdl_window_t w, struct zdl_event *ev)
 	while (zdl_window_read_event(w, ev) != 0);
 }
 
+int zdl_window_get_fd(zdl_window_t w)
+{
+	return XConnectionNumber(w->display);
+}
+
+int zdl_window_pending(zdl_window_t w)
+{
+	return XEventsQueued(w->display, QueuedAfterFlush);
+}
+
 void zdl_window_warp_mouse(zdl_window_t w, int x, int y)
 {
 	XWarpPointer(w->display, None, w->window, 0, 0, 0, 0, x, y);